@@ -0,0 +1,215 @@
+// Runs a suite of Raquette jobs in parallel, one machine per job, and reports each result
+// Run from the computer directory: ./raqbatch jobs.txt [threads], the default is one thread per core
+//
+// Each line of the job file is one job. Blank lines and lines starting with # are skipped.
+//     name frames rom disk expect input
+// frames: emulated frames to run, 60 per second
+// rom: ROM file, loaded at the top of memory
+// disk: DSK file, or - for an empty drive
+// expect: memory hash the job must end with, or - to only report it
+// input: the rest of the line, typed one key per frame whenever the guest has read the last key.
+//        \r is Return and \\ is a backslash. @file instead replays an input log recorded with
+//        test_raq_gui -record file, keeping the recorded timing exactly.
+// The exit status is 1 if any job failed, halted or could not load its files.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <sys/resource.h>
+#include "computer.hpp"
+#include "raquette.hpp"
+
+struct Job {
+	std::string name;
+	unsigned frames;
+	std::string rom;
+	std::string disk;
+	std::string expect;
+	std::string input;
+};
+
+struct JobResult {
+	std::string status; // pass, fail, done (nothing expected), halted or error
+	uint64_t cycles;
+	uint64_t instructions; // Actually run, idle loop passes skipped are not counted
+	uint64_t idleSkipped; // Cycles skipped in idle loops
+	double seconds;
+	uint64_t hash;
+	std::string message; // First message the machine logged, for halted and error
+};
+
+// Reads the job file, returns false if it cannot be opened or a line is malformed
+static bool readJobs(const char *fileName, std::vector<Job> &jobs){
+	std::ifstream infile(fileName);
+	if(!infile){
+		std::cout << "Cannot open job file " << fileName << std::endl;
+		return false;
+	}
+	std::string line;
+	for(unsigned lineNum=1; std::getline(infile, line); lineNum++){
+		if(line.empty() || (line[0] == '#')) continue;
+		std::istringstream fields(line);
+		Job job;
+		if(!(fields >> job.name >> job.frames >> job.rom >> job.disk >> job.expect)){
+			std::cout << fileName << ":" << lineNum << ": expected name frames rom disk expect [input]\n";
+			return false;
+		}
+		std::string rest;
+		std::getline(fields >> std::ws, rest);
+		for(size_t i=0; i < rest.size(); i++){
+			if((rest[i] == '\\') && (i+1 < rest.size())){
+				i++;
+				job.input += (rest[i] == 'r') ? '\r' : rest[i];
+			}else{
+				job.input += rest[i];
+			}
+		}
+		jobs.push_back(job);
+	}
+	return true;
+}
+
+// FNV-1a over all of memory
+static uint64_t memoryHash(const uint8_t *memory){
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(unsigned i=0; i < 0x10000; i++){
+		hash = (hash ^ memory[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static void runJob(const Job &job, JobResult &res){
+	std::ostringstream log;
+	Raquette::Config config;
+	config.romFile = job.rom;
+	config.diskFile = (job.disk == "-") ? "" : job.disk;
+	config.log = &log;
+
+	auto start = std::chrono::steady_clock::now();
+	Raquette raquette(config);
+	raquette.useJit = true;
+	bool halted = false;
+	bool replay = (job.input.compare(0, 1, "@") == 0);
+	if(raquette.loaded && replay){
+		raquette.loaded = raquette.loadInput(job.input.c_str() + 1) && raquette.startReplay();
+	}
+	if(raquette.loaded){
+		unsigned typed = replay ? job.input.size() : 0; // Nothing to type
+		for(unsigned frame=0; frame < job.frames; frame++){
+			if((typed < job.input.size()) && !(raquette.memory[0xC000] & 0b10000000)){
+				raquette.keyInput(job.input[typed++] | 0b10000000); // The same path the GUI and a replay take
+			}
+			if(raquette.runCycles(Raquette::FRAME_CYCLES) == Raquette::STOP_HALT){
+				halted = true;
+				break;
+			}
+		}
+	}
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+
+	res.cycles = raquette.cycles;
+	res.instructions = raquette.instructions;
+	res.idleSkipped = raquette.idleSkipped;
+	res.seconds = secs.count();
+	res.hash = memoryHash(raquette.memory);
+	std::ostringstream hash;
+	hash << std::hex << res.hash;
+	if(!raquette.loaded) res.status = "error";
+	else if(halted) res.status = "halted";
+	else if(job.expect == "-") res.status = "done";
+	else res.status = (hash.str() == job.expect) ? "pass" : "fail";
+	if(!raquette.loaded || halted){
+		std::string first;
+		std::istringstream lines(log.str());
+		while(std::getline(lines, first)){
+			// Skip the usual messages about what was loaded
+			if(first.compare(0, 7, "Opened ") && first.compare(0, 15, "Cannot open DSK")) break;
+		}
+		res.message = first;
+	}
+}
+
+// One queue of job indexes per worker
+// A worker takes jobs from the back of its own queue, and once that is empty steals from the front
+// of the others, so workers that drew short jobs help out with the rest.
+struct WorkQueue {
+	std::mutex lock;
+	std::deque<size_t> jobs;
+};
+
+static bool takeJob(WorkQueue &queue, bool own, size_t &job){
+	std::lock_guard<std::mutex> guard(queue.lock);
+	if(queue.jobs.empty()) return false;
+	if(own){
+		job = queue.jobs.back();
+		queue.jobs.pop_back();
+	}else{
+		job = queue.jobs.front();
+		queue.jobs.pop_front();
+	}
+	return true;
+}
+
+static void worker(unsigned self, std::vector<WorkQueue> &queues, const std::vector<Job> &jobs, std::vector<JobResult> &results){
+	size_t job;
+	while(true){
+		bool found = takeJob(queues[self], true, job);
+		for(unsigned i=1; !found && (i < queues.size()); i++){
+			found = takeJob(queues[(self + i) % queues.size()], false, job);
+		}
+		// Jobs are never added once started, so finding every queue empty means we are done
+		if(!found) return;
+		runJob(jobs[job], results[job]);
+	}
+}
+
+int main(int argc, char **argv) {
+	if(argc < 2){
+		std::cout << "Usage: " << argv[0] << " jobs.txt [threads]\n";
+		return 1;
+	}
+	unsigned threads = (argc > 2) ? std::stoul(argv[2]) : std::thread::hardware_concurrency();
+	if(threads == 0) threads = 1;
+	std::vector<Job> jobs;
+	if(!readJobs(argv[1], jobs)) return 1;
+	if(threads > jobs.size()) threads = jobs.size() ? jobs.size() : 1;
+
+	std::vector<JobResult> results(jobs.size());
+	std::vector<WorkQueue> queues(threads);
+	for(size_t i=0; i < jobs.size(); i++){
+		queues[i % threads].jobs.push_back(i);
+	}
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> pool;
+	for(unsigned i=0; i < threads; i++){
+		pool.emplace_back(worker, i, std::ref(queues), std::cref(jobs), std::ref(results));
+	}
+	for(std::thread &t : pool){
+		t.join();
+	}
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+
+	unsigned bad = 0;
+	uint64_t totalCycles = 0;
+	for(size_t i=0; i < jobs.size(); i++){
+		const JobResult &r = results[i];
+		std::cout << jobs[i].name << " " << r.status << " cycles:" << r.cycles << " (" << r.idleSkipped << " idle) instructions:" << r.instructions
+			<< " time:" << r.seconds << " s hash:" << std::hex << r.hash << std::dec;
+		if(!r.message.empty()) std::cout << " (" << r.message << ")";
+		std::cout << "\n";
+		if((r.status != "pass") && (r.status != "done")) bad++;
+		totalCycles += r.cycles;
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	std::cout << jobs.size() << " jobs on " << threads << " threads in " << secs.count() << " s: "
+		<< (jobs.size() / secs.count()) << " jobs/s, " << (totalCycles / secs.count() / 1e6)
+		<< " emulated MHz in total, peak RSS " << usage.ru_maxrss << " KB, " << bad << " failed\n";
+	return bad ? 1 : 0;
+}
@@ -0,0 +1,311 @@
+// Headless Raquette benchmark
+// Runs fixed workloads in each execution mode and writes the results as JSON,
+// so emulator speed can be compared from one release to the next.
+// Run from the computer directory: ./raqbench [output.json], the default output is raqbench.json
+// Each workload runs in its own child process, so its peak RSS is its own.
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "computer.hpp"
+#include "raquette.hpp"
+
+// One workload in one mode
+struct BenchResult {
+	std::string workload;
+	std::string mode;
+	uint64_t instructions;
+	uint64_t cycles;
+	uint64_t frames; // Frames renderScreen() actually redrew
+	double seconds;
+	long peakRssKb; // Of the child process that ran the workload
+};
+
+// What a child process sends back, the names are already known
+struct BenchCounts {
+	uint64_t instructions;
+	uint64_t cycles;
+	uint64_t frames;
+	double seconds;
+};
+
+// Drives one machine through a workload
+// Returns false once the workload is finished.
+typedef bool (*BenchStep)(Raquette &raquette, unsigned frame);
+
+static const char *modeNames[3] = {"interpreter", "blocks", "jit"};
+
+// Idle loop skipping stays off in every mode, so each mode really runs the same instructions
+// and the rates compare execution speed rather than time skipped
+static void setMode(Raquette &raquette, int mode){
+	raquette.useBlockCache = (mode > 0);
+	raquette.useIdleSkip = false;
+	raquette.useJit = (mode > 1);
+}
+
+// Copies a small hand-assembled program to $0400 of an otherwise empty 64K image
+static void loadProgram(uint8_t *dest, const uint8_t *prog, unsigned len){
+	for(unsigned i=0; i < 0x10000; i++){
+		dest[i] = 0;
+	}
+	for(unsigned i=0; i < len; i++){
+		dest[0x400+i] = prog[i];
+	}
+}
+
+// Runs a machine one frame at a time, rendering each frame as the GUI does, until step returns false
+static void runFrames(Raquette &raquette, BenchStep step, bool render, BenchResult &res){
+	uint64_t startInstr = raquette.instructions;
+	uint64_t startCycles = raquette.cycles;
+	auto start = std::chrono::steady_clock::now();
+	for(unsigned frame=0; ; frame++){
+		if(raquette.runCycles(Raquette::FRAME_CYCLES) == Raquette::STOP_HALT) break;
+		if(render && raquette.renderScreen()) res.frames++;
+		if(!step(raquette, frame)) break;
+	}
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	res.seconds += secs.count();
+	res.instructions += raquette.instructions - startInstr;
+	res.cycles += raquette.cycles - startCycles;
+}
+
+// True if the instruction at pc jumps or branches to itself, which is how the functional test stops
+static bool trapped(Raquette &raquette){
+	uint8_t *mem = raquette.memory;
+	int pc = raquette.pc;
+	if(mem[pc] == 0x4C) return (((mem[pc+2] << 8) | mem[pc+1]) == pc); // JMP *
+	if((mem[pc] & 0x1F) == 0x10) return (mem[pc+1] == 0xFE); // Branch to itself
+	return false;
+}
+
+static int functionalPrevPc;
+
+static bool functionalStep(Raquette &raquette, unsigned frame){
+	bool done = (raquette.pc == functionalPrevPc) && trapped(raquette);
+	functionalPrevPc = raquette.pc;
+	return !done;
+}
+
+// The 6502 functional test, from $0400 until it traps
+static void benchFunctional(int mode, BenchResult &res){
+	static uint8_t image[0x10000];
+	std::ifstream infile("../software/raquette/functionalTest/6502_functional_test.bin", std::ios::binary | std::ios::in);
+	if(!infile){
+		std::cout << "Cannot open functional test\n";
+		return;
+	}
+	infile.read((char *)image, sizeof(image));
+
+	Raquette raquette(image, 0xFFFF+1);
+	setMode(raquette, mode);
+	raquette.pc = 0x0400;
+	functionalPrevPc = -1;
+	runFrames(raquette, functionalStep, false, res);
+}
+
+// Stops once the monitor has printed its prompt on the bottom line
+static bool bootStep(Raquette &raquette, unsigned frame){
+	return raquette.memory[0x07D0] != '$';
+}
+
+// Monitor ROM from reset to its first prompt, repeated to get a measurable time
+static void benchBoot(int mode, BenchResult &res){
+	for(int i=0; i<200; i++){
+		Raquette raquette;
+		setMode(raquette, mode);
+		runFrames(raquette, bootStep, true, res);
+	}
+}
+
+// Types lines of digits at the monitor prompt, each CR scrolls the whole screen
+static const std::string scrollLine = "0123456789012345678901234567890\r";
+static unsigned scrollTyped;
+
+static bool scrollStep(Raquette &raquette, unsigned frame){
+	if(raquette.memory[0xC000] & 0b10000000) return true; // Last key not read yet
+	if(scrollTyped == 300 * scrollLine.size()) return false;
+	raquette.keyInput(scrollLine[scrollTyped++ % scrollLine.size()] | 0b10000000);
+	return true;
+}
+
+static void benchScroll(int mode, BenchResult &res){
+	Raquette raquette;
+	setMode(raquette, mode);
+	scrollTyped = 0;
+	runFrames(raquette, scrollStep, true, res);
+}
+
+// Runs for five emulated seconds
+static bool fixedStep(Raquette &raquette, unsigned frame){
+	return frame < 300;
+}
+
+// Fills hi-res page 1 with a new byte pattern over and over
+static void benchHires(int mode, BenchResult &res){
+	static const uint8_t prog[] = {
+		0xAD, 0x50, 0xC0, // 0400 LDA $C050    ; Graphics
+		0xAD, 0x57, 0xC0, // 0403 LDA $C057    ; Hi-res
+		0xAD, 0x52, 0xC0, // 0406 LDA $C052    ; Full screen
+		0xA2, 0x00,       // 0409 LDX #0       ; Pattern
+		0xA9, 0x20,       // 040B LDA #$20     ; Frame: point $00 at $2000
+		0x85, 0x01,       // 040D STA $01
+		0xA9, 0x00,       // 040F LDA #0
+		0x85, 0x00,       // 0411 STA $00
+		0xA8,             // 0413 TAY
+		0x8A,             // 0414 TXA          ; Loop
+		0x91, 0x00,       // 0415 STA ($00),Y
+		0xC8,             // 0417 INY
+		0xD0, 0xFA,       // 0418 BNE $0414
+		0xE6, 0x01,       // 041A INC $01
+		0xA5, 0x01,       // 041C LDA $01
+		0xC9, 0x40,       // 041E CMP #$40
+		0xD0, 0xF2,       // 0420 BNE $0414
+		0xE8,             // 0422 INX
+		0x4C, 0x0B, 0x04  // 0423 JMP $040B
+	};
+	static uint8_t image[0x10000];
+	loadProgram(image, prog, sizeof(prog));
+	Raquette raquette(image, 0xFFFF+1);
+	setMode(raquette, mode);
+	raquette.pc = 0x0400;
+	runFrames(raquette, fixedStep, true, res);
+}
+
+// Sweeps the disk head across all 35 tracks and back through the stepper phases
+// Reading the data is not emulated yet, so this only covers the controller's soft switches
+// and the stepper's settling events.
+static void benchDisk(int mode, BenchResult &res){
+	static const uint8_t prog[] = {
+		0xA9, 0x01,       // 0400 LDA #1
+		0x85, 0x03,       // 0402 STA $03      ; Direction, 1 or -1
+		0xA9, 0x44,       // 0404 LDA #$44     ; Sweep: 68 half tracks
+		0x85, 0x02,       // 0406 STA $02
+		0xA5, 0x04,       // 0408 LDA $04      ; Step: current phase off
+		0x0A,             // 040A ASL A
+		0xAA,             // 040B TAX
+		0xBD, 0xE0, 0xC0, // 040C LDA $C0E0,X
+		0xA5, 0x04,       // 040F LDA $04      ; Next phase on
+		0x18,             // 0411 CLC
+		0x65, 0x03,       // 0412 ADC $03
+		0x29, 0x03,       // 0414 AND #3
+		0x85, 0x04,       // 0416 STA $04
+		0x0A,             // 0418 ASL A
+		0xAA,             // 0419 TAX
+		0xBD, 0xE1, 0xC0, // 041A LDA $C0E1,X
+		0xA0, 0x00,       // 041D LDY #0       ; Let the head settle
+		0x88,             // 041F DEY
+		0xD0, 0xFD,       // 0420 BNE $041F
+		0xC6, 0x02,       // 0422 DEC $02
+		0xD0, 0xE2,       // 0424 BNE $0408
+		0xA5, 0x03,       // 0426 LDA $03      ; Turn around
+		0x49, 0xFE,       // 0428 EOR #$FE
+		0x85, 0x03,       // 042A STA $03
+		0x4C, 0x04, 0x04  // 042C JMP $0404
+	};
+	static uint8_t image[0x10000];
+	loadProgram(image, prog, sizeof(prog));
+	Raquette raquette(image, 0xFFFF+1);
+	setMode(raquette, mode);
+	raquette.pc = 0x0400;
+	runFrames(raquette, fixedStep, true, res);
+}
+
+static void writeJson(std::ostream &out, const std::vector<BenchResult> &results){
+	out << "{\n  \"benchmark\": \"raqbench\",\n  \"results\": [\n";
+	for(size_t i=0; i < results.size(); i++){
+		const BenchResult &r = results[i];
+		double ns = r.instructions ? (r.seconds * 1e9 / r.instructions) : 0;
+		double mhz = r.seconds ? (r.cycles / r.seconds / 1e6) : 0;
+		double fps = r.seconds ? (r.frames / r.seconds) : 0;
+		out << "    {\"workload\": \"" << r.workload << "\", \"mode\": \"" << r.mode << "\""
+			<< ", \"instructions\": " << r.instructions
+			<< ", \"cycles\": " << r.cycles
+			<< ", \"seconds\": " << r.seconds
+			<< ", \"ns_per_instruction\": " << ns
+			<< ", \"emulated_mhz\": " << mhz
+			<< ", \"frames\": " << r.frames
+			<< ", \"fps\": " << fps
+			<< ", \"peak_rss_kb\": " << r.peakRssKb
+			<< "}" << ((i+1 < results.size()) ? "," : "") << "\n";
+	}
+	out << "  ]\n}\n";
+}
+
+// Runs one workload in a child process and fills in res from what it sends back
+// Returns false if the child could not be started or did not finish.
+static bool runChild(void (*run)(int mode, BenchResult &res), int mode, BenchResult &res){
+	int fds[2];
+	if(pipe(fds) != 0){
+		std::cout << "Cannot create a pipe\n";
+		return false;
+	}
+	std::cout.flush(); // Or the child would print it again
+	pid_t pid = fork();
+	if(pid < 0){
+		std::cout << "Cannot start a child process\n";
+		return false;
+	}
+	if(pid == 0){
+		close(fds[0]);
+		run(mode, res);
+		BenchCounts counts = {res.instructions, res.cycles, res.frames, res.seconds};
+		bool sent = (write(fds[1], &counts, sizeof(counts)) == sizeof(counts));
+		std::cout.flush();
+		_exit(sent ? 0 : 1);
+	}
+	close(fds[1]);
+	BenchCounts counts;
+	bool got = (read(fds[0], &counts, sizeof(counts)) == sizeof(counts));
+	close(fds[0]);
+	int status;
+	struct rusage usage;
+	if((wait4(pid, &status, 0, &usage) != pid) || !got){
+		std::cout << res.workload << " (" << res.mode << ") did not finish\n";
+		return false;
+	}
+	res.instructions = counts.instructions;
+	res.cycles = counts.cycles;
+	res.frames = counts.frames;
+	res.seconds = counts.seconds;
+	res.peakRssKb = usage.ru_maxrss; // In KB on Linux
+	return true;
+}
+
+int main(int argc, char **argv) {
+	const char *outName = (argc > 1) ? argv[1] : "raqbench.json";
+	const struct {
+		const char *name;
+		void (*run)(int mode, BenchResult &res);
+	} workloads[] = {
+		{"functional", benchFunctional},
+		{"boot", benchBoot},
+		{"scroll", benchScroll},
+		{"hires", benchHires},
+		{"disk", benchDisk},
+	};
+
+	std::vector<BenchResult> results;
+	for(const auto &w : workloads){
+		for(int mode=0; mode<3; mode++){
+			BenchResult res = {w.name, modeNames[mode], 0, 0, 0, 0.0, 0};
+			if(!runChild(w.run, mode, res)) return 1;
+			results.push_back(res);
+			std::cout << res.workload << " (" << res.mode << "): " << res.instructions << " instructions in "
+				<< res.seconds << " s, " << (res.cycles / res.seconds / 1e6) << " MHz\n";
+		}
+	}
+
+	std::ofstream outfile(outName);
+	if(!outfile){
+		std::cout << "Cannot write " << outName << std::endl;
+		return 1;
+	}
+	writeJson(outfile, results);
+	std::cout << "Wrote " << outName << std::endl;
+	return 0;
+}
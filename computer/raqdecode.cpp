@@ -0,0 +1,42 @@
+// Turns a binary trace written by Raquette::startTrace() into readable disassembly
+// Usage: ./raqdecode trace.bin [first record] [count]
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include "computer.hpp"
+#include "raquette.hpp"
+#include "raqtrace.hpp"
+
+int main(int argc, char **argv) {
+	if(argc < 2){
+		std::cout << "Usage: " << argv[0] << " trace.bin [first record] [count]\n";
+		return 1;
+	}
+	unsigned long long first = (argc > 2) ? std::stoull(argv[2]) : 0;
+	unsigned long long count = (argc > 3) ? std::stoull(argv[3]) : ~0ULL;
+
+	std::ifstream infile(argv[1], std::ios::binary | std::ios::in);
+	if(!infile){
+		std::cout << "Cannot open " << argv[1] << std::endl;
+		return 1;
+	}
+	TraceFileHeader header;
+	if(!infile.read((char *)&header, sizeof(header)) || !std::equal(TRACE_MAGIC, TRACE_MAGIC+8, header.magic)){
+		std::cout << argv[1] << " is not a Raquette trace\n";
+		return 1;
+	}
+	if((header.version != TRACE_VERSION) || (header.recordSize != sizeof(Raquette::TraceRecord))){
+		std::cout << argv[1] << " is trace version " << header.version << " with " << header.recordSize
+			<< " byte records, expected version " << TRACE_VERSION << " with "
+			<< sizeof(Raquette::TraceRecord) << " byte records\n";
+		return 1;
+	}
+
+	infile.seekg(first * sizeof(Raquette::TraceRecord), std::ios::cur);
+	Raquette::TraceRecord rec;
+	for(unsigned long long i=0; (i < count) && infile.read((char *)&rec, sizeof(rec)); i++){
+		Raquette::formatTraceRecord(std::cout, rec);
+	}
+	return 0;
+}
@@ -0,0 +1,767 @@
+#include <iostream>
+#include <cstring>
+#include <cstddef>
+#include <initializer_list>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "computer.hpp"
+#include "raquette.hpp"
+#include "raqjit.hpp"
+
+RaqJit::RaqJit(std::ostream *log) : log(log) {
+	arena = nullptr;
+	arenaUsed = 0;
+	arenaFull = false;
+	protectFailed = false;
+	links.assign(0x10000, {nullptr, 0});
+#if defined(__x86_64__)
+	void *mem = mmap(nullptr, ARENA_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED){
+		*log << "Cannot map memory for the JIT. Continuing with the interpreter.\n";
+	}else{
+		arena = (uint8_t *) mem;
+	}
+#endif
+}
+
+RaqJit::~RaqJit() {
+	if(arena) munmap(arena, ARENA_SIZE);
+}
+
+bool RaqJit::available() {
+	return arena != nullptr;
+}
+
+bool RaqJit::full() {
+	return arenaFull;
+}
+
+void RaqJit::reset() {
+	arenaUsed = 0;
+	arenaFull = false;
+	for(JitLink &link : links){
+		link = {nullptr, 0};
+	}
+}
+
+// Stops other blocks jumping into the translation of the block at start
+void RaqJit::unlink(uint16_t start) {
+	links[start] = {nullptr, 0};
+}
+
+#if defined(__x86_64__)
+
+// Host registers, numbered as in the instruction encoding
+enum HostReg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11 };
+
+// Fixed register use in translated code
+// RAX, RCX, RDX and RBX are scratch. Only RBX is callee-saved, so it is pushed on entry.
+static const int REG_CTX = RDI; // JitContext pointer, as passed by the caller
+static const int REG_MEM = RSI; // ctx->memory
+static const int REG_PAGES = R11; // ctx->pages
+static const int REG_A = R8, REG_X = R9, REG_Y = R10; // Zero extended guest registers
+
+// x86 condition codes, as used in Jcc and SETcc
+enum HostCond { CC_O = 0x0, CC_C = 0x2, CC_NC = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7 };
+
+#define CTX(field) (int32_t(offsetof(JitContext, field)))
+
+// Just enough of an x86-64 assembler for the translator
+// Register arguments are HostReg numbers, or the opcode extension for "/digit" encodings.
+// Byte registers are only ever AL-BL and R8B-R11B, so the REX prefix never changes their meaning.
+struct X86Emitter {
+	std::vector<uint8_t> &buf;
+
+	void b(uint8_t val){
+		buf.push_back(val);
+	}
+	void d(uint32_t val){
+		for(int i=0; i<4; i++){
+			buf.push_back(uint8_t(val >> (8*i)));
+		}
+	}
+	void rex(bool w, int reg, int index, int base){
+		uint8_t prefix = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | (((index >> 3) & 1) << 1) | ((base >> 3) & 1);
+		if(prefix != 0x40) b(prefix);
+	}
+	// Opcode with a [base + index + disp] memory operand
+	void mem(std::initializer_list<uint8_t> opcode, int reg, int base, int32_t disp, bool w = false, int index = -1){
+		rex(w, reg, (index < 0) ? 0 : index, base);
+		for(uint8_t byte : opcode) b(byte);
+		int mod = ((disp == 0) && ((base & 7) != RBP)) ? 0 : (((disp >= -128) && (disp <= 127)) ? 1 : 2);
+		if((index >= 0) || ((base & 7) == RSP)){
+			b((mod << 6) | ((reg & 7) << 3) | 4);
+			b((((index >= 0) ? (index & 7) : 4) << 3) | (base & 7));
+		}else{
+			b((mod << 6) | ((reg & 7) << 3) | (base & 7));
+		}
+		if(mod == 1) b(uint8_t(disp));
+		else if(mod == 2) d(disp);
+	}
+	// Opcode with two register operands
+	void reg(std::initializer_list<uint8_t> opcode, int reg, int rm, bool w = false){
+		rex(w, reg, 0, rm);
+		for(uint8_t byte : opcode) b(byte);
+		b(0xC0 | ((reg & 7) << 3) | (rm & 7));
+	}
+	// Conditional or plain jump with a 32 bit displacement, returns where to patch it
+	size_t jcc(int cond){
+		b(0x0F);
+		b(0x80 | cond);
+		d(0);
+		return buf.size() - 4;
+	}
+	size_t jmp(){
+		b(0xE9);
+		d(0);
+		return buf.size() - 4;
+	}
+	void patch(size_t at, size_t target){
+		int32_t rel = int32_t(target) - int32_t(at + 4);
+		memcpy(&buf[at], &rel, 4);
+	}
+
+	void movImm(int dst, uint32_t imm){ // mov r32, imm32
+		rex(false, 0, 0, dst);
+		b(0xB8 | (dst & 7));
+		d(imm);
+	}
+	void movzxReg8(int dst, int src){ // movzx r32, r8
+		reg({0x0F, 0xB6}, dst, src);
+	}
+	void addImm8(int dst, int8_t imm){ // add r32, imm8
+		reg({0x83}, 0, dst);
+		b(imm);
+	}
+	void subImm8(int dst, int8_t imm){ // sub r32, imm8
+		reg({0x83}, 5, dst);
+		b(imm);
+	}
+	void storeNZ(int src){ // mov [ctx.nz], r16
+		b(0x66);
+		mem({0x89}, src, REG_CTX, CTX(nz));
+	}
+	void statusAnd(uint8_t mask){ // and byte [ctx.status], imm8
+		mem({0x80}, 4, REG_CTX, CTX(status));
+		b(mask);
+	}
+	void statusOr(uint8_t mask){ // or byte [ctx.status], imm8
+		mem({0x80}, 1, REG_CTX, CTX(status));
+		b(mask);
+	}
+	void statusOrReg(int src){ // or byte [ctx.status], r8
+		mem({0x08}, src, REG_CTX, CTX(status));
+	}
+	void statusTest(uint8_t mask){ // test byte [ctx.status], imm8
+		mem({0xF6}, 0, REG_CTX, CTX(status));
+		b(mask);
+	}
+	void carryIn(){ // Guest C flag into the host carry flag, clobbers EDX
+		mem({0x0F, 0xB6}, RDX, REG_CTX, CTX(status));
+		reg({0xD1}, 5, RDX); // shr edx, 1
+	}
+	void addCycles(uint32_t count){ // add qword [ctx.cycles], imm32
+		if(count == 0) return;
+		mem({0x81}, 0, REG_CTX, CTX(cycles), true);
+		d(count);
+	}
+	void addInstructions(uint32_t count){ // add qword [ctx.instructions], imm32
+		if(count == 0) return;
+		mem({0x81}, 0, REG_CTX, CTX(instructions), true);
+		d(count);
+	}
+};
+
+// What the translator does with each handler
+enum JitKind {
+	JK_NONE, // Left to the interpreter
+	JK_LDA, JK_LDX, JK_LDY, JK_STA, JK_STX, JK_STY,
+	JK_AND, JK_ORA, JK_EOR, JK_ADC, JK_SBC, JK_CMP, JK_CPX, JK_CPY, JK_BIT,
+	JK_INC, JK_DEC, JK_ASL, JK_LSR, JK_ROL, JK_ROR, JK_ASLA, JK_LSRA, JK_ROLA, JK_RORA,
+	JK_INX, JK_INY, JK_DEX, JK_DEY, JK_TAX, JK_TAY, JK_TXA, JK_TYA, JK_TSX, JK_TXS,
+	JK_CLC, JK_SEC, JK_CLI, JK_SEI, JK_CLV, JK_CLD, JK_SED, JK_NOP, JK_PHA, JK_PLA, JK_PHP, JK_PLP,
+	JK_BCC, JK_BCS, JK_BEQ, JK_BNE, JK_BMI, JK_BPL, JK_BVC, JK_BVS,
+	JK_JMP, JK_JSR, JK_RTS
+};
+
+static JitKind jitKind(const Raquette::DecodedOp &op){
+	static const struct {
+		void (Raquette::*handler)(int eff_addr);
+		JitKind kind;
+	} kinds[] = {
+		{&Raquette::opLDA, JK_LDA}, {&Raquette::opLDX, JK_LDX}, {&Raquette::opLDY, JK_LDY},
+		{&Raquette::opSTA, JK_STA}, {&Raquette::opSTX, JK_STX}, {&Raquette::opSTY, JK_STY},
+		{&Raquette::opAND, JK_AND}, {&Raquette::opORA, JK_ORA}, {&Raquette::opEOR, JK_EOR},
+		{&Raquette::opADC, JK_ADC}, {&Raquette::opSBC, JK_SBC}, {&Raquette::opCMP, JK_CMP},
+		{&Raquette::opCPX, JK_CPX}, {&Raquette::opCPY, JK_CPY}, {&Raquette::opBIT, JK_BIT},
+		{&Raquette::opINC, JK_INC}, {&Raquette::opDEC, JK_DEC}, {&Raquette::opASL, JK_ASL},
+		{&Raquette::opLSR, JK_LSR}, {&Raquette::opROL, JK_ROL}, {&Raquette::opROR, JK_ROR},
+		{&Raquette::opASLA, JK_ASLA}, {&Raquette::opLSRA, JK_LSRA}, {&Raquette::opROLA, JK_ROLA},
+		{&Raquette::opRORA, JK_RORA}, {&Raquette::opINX, JK_INX}, {&Raquette::opINY, JK_INY},
+		{&Raquette::opDEX, JK_DEX}, {&Raquette::opDEY, JK_DEY}, {&Raquette::opTAX, JK_TAX},
+		{&Raquette::opTAY, JK_TAY}, {&Raquette::opTXA, JK_TXA}, {&Raquette::opTYA, JK_TYA},
+		{&Raquette::opTSX, JK_TSX}, {&Raquette::opTXS, JK_TXS}, {&Raquette::opCLC, JK_CLC},
+		{&Raquette::opSEC, JK_SEC}, {&Raquette::opCLI, JK_CLI}, {&Raquette::opSEI, JK_SEI},
+		{&Raquette::opCLV, JK_CLV}, {&Raquette::opCLD, JK_CLD}, {&Raquette::opSED, JK_SED},
+		{&Raquette::opNOP, JK_NOP}, {&Raquette::opPHA, JK_PHA}, {&Raquette::opPLA, JK_PLA},
+		{&Raquette::opPHP, JK_PHP}, {&Raquette::opPLP, JK_PLP},
+		{&Raquette::opBCC, JK_BCC}, {&Raquette::opBCS, JK_BCS}, {&Raquette::opBEQ, JK_BEQ},
+		{&Raquette::opBNE, JK_BNE}, {&Raquette::opBMI, JK_BMI}, {&Raquette::opBPL, JK_BPL},
+		{&Raquette::opBVC, JK_BVC}, {&Raquette::opBVS, JK_BVS}, {&Raquette::opJSR, JK_JSR},
+		{&Raquette::opRTS, JK_RTS},
+	};
+	if(op.handler == &Raquette::opJMP) return (op.amode == Raquette::AM_ABS) ? JK_JMP : JK_NONE;
+	for(const auto &entry : kinds){
+		if(entry.handler == op.handler) return entry.kind;
+	}
+	return JK_NONE;
+}
+
+// Where an exit leaves the guest, filled in after the body is assembled
+struct JitExit {
+	uint32_t pc;
+	uint32_t cycles; // Cycles of this pass through the block not yet added to ctx.cycles
+	uint32_t instructions; // Same for ctx.instructions
+	bool fallback;
+	std::vector<size_t> patches; // Jumps to this exit
+};
+
+// Translates the block, or as much of it as possible
+// Each instruction is checked before it changes anything, so every exit lands on an instruction boundary.
+JitFunc RaqJit::translate(const Raquette::Block &block, const uint8_t *memory){
+	if(!arena || arenaFull || protectFailed) return nullptr;
+
+	code.clear();
+	X86Emitter e{code};
+	std::vector<JitExit> exits;
+	auto newExit = [&](uint32_t pc, uint32_t cycles, uint32_t instructions, bool fallback){
+		exits.push_back({pc, cycles, instructions, fallback, {}});
+		return exits.size() - 1;
+	};
+	const int32_t pageSize = sizeof(Raquette::MemPage);
+	const int32_t readOffset = offsetof(Raquette::MemPage, read);
+	const int32_t writeOffset = offsetof(Raquette::MemPage, write);
+
+	// Prologue
+	e.b(0x53); // push rbx
+	e.mem({0x8B}, REG_MEM, REG_CTX, CTX(memory), true);
+	e.mem({0x8B}, REG_PAGES, REG_CTX, CTX(pages), true);
+	e.mem({0x0F, 0xB6}, REG_A, REG_CTX, CTX(a));
+	e.mem({0x0F, 0xB6}, REG_X, REG_CTX, CTX(x));
+	e.mem({0x0F, 0xB6}, REG_Y, REG_CTX, CTX(y));
+	size_t loopTop = code.size();
+
+	uint16_t start = block.ops.front().pc;
+	uint32_t passCycles = 0; // Static cycles of the instructions assembled so far
+	unsigned translated = 0;
+	bool ended = false; // Set once the block's control transfer has been assembled
+
+	for(const Raquette::DecodedOp &op : block.ops){
+		JitKind kind = jitKind(op);
+		uint16_t next = op.pc + op.length;
+		size_t fallback = newExit(op.pc, passCycles, translated, true);
+		auto toFallback = [&](int cond){
+			exits[fallback].patches.push_back(e.jcc(cond));
+		};
+		if((op.amode == Raquette::AM_IND) || (kind == JK_NONE)){
+			exits[fallback].patches.push_back(e.jmp());
+			ended = true;
+			break;
+		}
+
+		// Decimal mode arithmetic is left to the interpreter
+		if((kind == JK_ADC) || (kind == JK_SBC)){
+			e.statusTest(Raquette::FLAG_D);
+			toFallback(CC_NE);
+		}
+
+		// Work out the operand address: fixed in fixedAddr, or computed into ECX
+		bool reads = false, writes = false;
+		switch(kind){
+			case JK_STA: case JK_STX: case JK_STY:
+				writes = true;
+				break;
+			case JK_INC: case JK_DEC: case JK_ASL: case JK_LSR: case JK_ROL: case JK_ROR:
+				reads = writes = true;
+				break;
+			case JK_LDA: case JK_LDX: case JK_LDY: case JK_AND: case JK_ORA: case JK_EOR:
+			case JK_ADC: case JK_SBC: case JK_CMP: case JK_CPX: case JK_CPY: case JK_BIT:
+				reads = (op.amode != Raquette::AM_IMM);
+				break;
+			default:
+				break;
+		}
+		int fixedAddr = -1;
+		bool penalty = false; // EBX holds 1 if the indexing crossed a page
+		if(reads || writes){
+			switch(op.amode){
+				case Raquette::AM_ZP:
+				case Raquette::AM_ABS:
+					fixedAddr = op.operand;
+					break;
+				case Raquette::AM_ZPX:
+				case Raquette::AM_ZPY:
+					e.mem({0x8D}, RCX, (op.amode == Raquette::AM_ZPX) ? REG_X : REG_Y, op.operand); // lea ecx, [index + zp]
+					e.movzxReg8(RCX, RCX);
+					break;
+				case Raquette::AM_ABSX:
+				case Raquette::AM_ABSY:
+					{
+						int index = (op.amode == Raquette::AM_ABSX) ? REG_X : REG_Y;
+						e.mem({0x8D}, RCX, index, op.operand); // lea ecx, [index + base]
+						e.reg({0x81}, 4, RCX); // and ecx, 0xFFFF
+						e.d(0xFFFF);
+						if(op.pagePenalty){
+							e.mem({0x8D}, RBX, index, op.operand & 0xFF); // lea ebx, [index + base low byte]
+							e.reg({0xC1}, 5, RBX); // shr ebx, 8
+							e.b(8);
+							penalty = true;
+						}
+					}
+					break;
+				case Raquette::AM_INDX:
+					e.mem({0x8D}, RDX, REG_X, op.operand); // lea edx, [x + zp]
+					e.movzxReg8(RDX, RDX);
+					e.mem({0x0F, 0xB6}, RCX, REG_MEM, 0, false, RDX); // movzx ecx, byte [mem + rdx]
+					e.addImm8(RDX, 1);
+					e.movzxReg8(RDX, RDX);
+					e.mem({0x0F, 0xB6}, RDX, REG_MEM, 0, false, RDX);
+					e.reg({0xC1}, 4, RDX); // shl edx, 8
+					e.b(8);
+					e.reg({0x09}, RDX, RCX); // or ecx, edx
+					break;
+				case Raquette::AM_INDY:
+					e.mem({0x0F, 0xB6}, RCX, REG_MEM, op.operand);
+					e.mem({0x0F, 0xB6}, RDX, REG_MEM, (op.operand + 1) & 0xFF);
+					e.reg({0xC1}, 4, RDX); // shl edx, 8
+					e.b(8);
+					e.reg({0x09}, RDX, RCX); // or ecx, edx
+					if(op.pagePenalty){
+						e.movzxReg8(RBX, RCX);
+						e.reg({0x01}, REG_Y, RBX); // add ebx, y
+						e.reg({0xC1}, 5, RBX); // shr ebx, 8
+						e.b(8);
+						penalty = true;
+					}
+					e.reg({0x01}, REG_Y, RCX); // add ecx, y
+					e.reg({0x81}, 4, RCX); // and ecx, 0xFFFF
+					e.d(0xFFFF);
+					break;
+				default:
+					break;
+			}
+
+			// Accesses outside the zero page and stack must hit a page with a direct pointer
+			if(fixedAddr >= 0x200){
+				int32_t entry = (fixedAddr >> 8) * pageSize;
+				if(reads){
+					e.mem({0x83}, 7, REG_PAGES, entry + readOffset, true); // cmp qword [pages + entry], 0
+					e.b(0);
+					toFallback(CC_E);
+				}
+				if(writes){
+					e.mem({0x83}, 7, REG_PAGES, entry + writeOffset, true);
+					e.b(0);
+					toFallback(CC_E);
+				}
+			}else if(fixedAddr < 0){
+				e.reg({0x89}, RCX, RDX); // mov edx, ecx
+				e.reg({0xC1}, 5, RDX); // shr edx, 8
+				e.b(8);
+				e.reg({0x69}, RDX, RDX); // imul edx, edx, pageSize
+				e.d(pageSize);
+				if(reads){
+					e.mem({0x83}, 7, REG_PAGES, readOffset, true, RDX);
+					e.b(0);
+					toFallback(CC_E);
+				}
+				if(writes){
+					e.mem({0x83}, 7, REG_PAGES, writeOffset, true, RDX);
+					e.b(0);
+					toFallback(CC_E);
+				}
+			}
+			if(penalty){
+				e.mem({0x01}, RBX, REG_CTX, CTX(cycles), true); // add [ctx.cycles], rbx
+			}
+		}
+
+		// Memory operand for the access, either [mem + fixedAddr] or [mem + rcx]
+		auto memOp = [&](std::initializer_list<uint8_t> opcode, int reg){
+			if(fixedAddr >= 0) e.mem(opcode, reg, REG_MEM, fixedAddr);
+			else e.mem(opcode, reg, REG_MEM, 0, false, RCX);
+		};
+		// Operand value into EAX
+		auto loadOperand = [&](){
+			if(op.amode == Raquette::AM_IMM) e.movImm(RAX, memory[op.operand]);
+			else memOp({0x0F, 0xB6}, RAX);
+		};
+		// Shift or rotate by one of a byte register, updating C
+		auto shift = [&](int digit, int target, bool useCarry){
+			if(useCarry) e.carryIn();
+			e.reg({0xD0}, digit, target);
+			e.reg({0x0F, 0x90 | CC_C}, 0, RDX); // setc dl
+			e.movzxReg8(target, target);
+			e.statusAnd(uint8_t(~Raquette::FLAG_C));
+			e.statusOrReg(RDX);
+			e.storeNZ(target);
+		};
+		// Load into a guest register
+		auto load = [&](int dst){
+			loadOperand();
+			e.reg({0x89}, RAX, dst); // mov dst, eax
+			e.storeNZ(dst);
+		};
+		auto transfer = [&](int src, int dst){
+			e.reg({0x89}, src, dst);
+			e.storeNZ(dst);
+		};
+		auto compare = [&](int src){
+			loadOperand();
+			e.reg({0x3A}, src, RAX); // cmp src8, al
+			e.reg({0x0F, 0x90 | CC_NC}, 0, RDX); // setnc dl
+			e.reg({0x89}, src, RBX); // mov ebx, src
+			e.reg({0x29}, RAX, RBX); // sub ebx, eax
+			e.movzxReg8(RBX, RBX);
+			e.storeNZ(RBX);
+			e.statusAnd(uint8_t(~Raquette::FLAG_C));
+			e.statusOrReg(RDX);
+		};
+		auto incdec = [&](int dst, bool inc){
+			if(inc) e.addImm8(dst, 1);
+			else e.subImm8(dst, 1);
+			e.movzxReg8(dst, dst);
+			e.storeNZ(dst);
+		};
+		// Ends the block at a known target
+		// Loops back natively if it is the block's start, or jumps into the target's own native code,
+		// as long as the next block fits before ctx.target just like runCycles() requires.
+		auto exitTo = [&](uint16_t target, uint32_t cycles){
+			e.addCycles(cycles);
+			e.addInstructions(translated + 1);
+			e.mem({0x8B}, RDX, REG_CTX, CTX(cycles), true); // mov rdx, [ctx.cycles]
+			if(target == start){
+				e.reg({0x81}, 0, RDX, true); // add rdx, maxCycles
+				e.d(block.maxCycles);
+				e.mem({0x3B}, RDX, REG_CTX, CTX(target), true); // cmp rdx, [ctx.target]
+				e.patch(e.jcc(CC_BE), loopTop);
+			}else{
+				e.mem({0x8B}, RAX, REG_CTX, CTX(links), true); // mov rax, [ctx.links]
+				e.mem({0x8B}, RCX, RAX, target * sizeof(JitLink) + offsetof(JitLink, entry), true);
+				e.reg({0x85}, RCX, RCX, true); // test rcx, rcx
+				size_t unlinked = e.jcc(CC_E);
+				e.mem({0x03}, RDX, RAX, target * sizeof(JitLink) + offsetof(JitLink, maxCycles), true); // add rdx, [link.maxCycles]
+				e.mem({0x3B}, RDX, REG_CTX, CTX(target), true);
+				size_t tooLong = e.jcc(CC_A);
+				e.reg({0xFF}, 4, RCX); // jmp rcx
+				e.patch(unlinked, code.size());
+				e.patch(tooLong, code.size());
+			}
+			exits[newExit(target, 0, 0, false)].patches.push_back(e.jmp());
+		};
+
+		switch(kind){
+			case JK_LDA: load(REG_A); break;
+			case JK_LDX: load(REG_X); break;
+			case JK_LDY: load(REG_Y); break;
+			case JK_STA: memOp({0x88}, REG_A); break;
+			case JK_STX: memOp({0x88}, REG_X); break;
+			case JK_STY: memOp({0x88}, REG_Y); break;
+			case JK_AND: case JK_ORA: case JK_EOR:
+				loadOperand();
+				e.reg({uint8_t((kind == JK_AND) ? 0x21 : ((kind == JK_ORA) ? 0x09 : 0x31))}, RAX, REG_A);
+				e.storeNZ(REG_A);
+				break;
+			case JK_ADC: case JK_SBC:
+				loadOperand();
+				e.carryIn();
+				if(kind == JK_ADC){
+					e.reg({0x12}, REG_A, RAX); // adc a8, al
+				}else{
+					e.b(0xF5); // cmc, the 6502 carry is an inverted borrow
+					e.reg({0x1A}, REG_A, RAX); // sbb a8, al
+				}
+				e.reg({0x0F, uint8_t(0x90 | ((kind == JK_ADC) ? CC_C : CC_NC))}, 0, RDX);
+				e.reg({0x0F, 0x90 | CC_O}, 0, RBX); // seto bl
+				e.movzxReg8(REG_A, REG_A);
+				e.reg({0xC0}, 4, RBX); // shl bl, 6
+				e.b(6);
+				e.reg({0x08}, RBX, RDX); // or dl, bl
+				e.statusAnd(uint8_t(~(Raquette::FLAG_C | Raquette::FLAG_V)));
+				e.statusOrReg(RDX);
+				e.storeNZ(REG_A);
+				break;
+			case JK_CMP: compare(REG_A); break;
+			case JK_CPX: compare(REG_X); break;
+			case JK_CPY: compare(REG_Y); break;
+			case JK_BIT:
+				loadOperand();
+				e.reg({0x89}, REG_A, RBX); // mov ebx, a
+				e.reg({0x21}, RAX, RBX); // and ebx, eax
+				e.reg({0x89}, RAX, RDX); // mov edx, eax
+				e.reg({0x81}, 4, RDX); // and edx, 0x80
+				e.d(0x80);
+				e.reg({0xD1}, 4, RDX); // shl edx, 1
+				e.reg({0x09}, RDX, RBX); // or ebx, edx
+				e.storeNZ(RBX);
+				e.reg({0x81}, 4, RAX); // and eax, 0x40
+				e.d(0x40);
+				e.statusAnd(uint8_t(~Raquette::FLAG_V));
+				e.statusOrReg(RAX);
+				break;
+			case JK_INC: case JK_DEC:
+				loadOperand();
+				incdec(RAX, kind == JK_INC);
+				memOp({0x88}, RAX);
+				break;
+			case JK_ASL: case JK_LSR: case JK_ROL: case JK_ROR:
+				loadOperand();
+				shift((kind == JK_ASL) ? 4 : ((kind == JK_LSR) ? 5 : ((kind == JK_ROL) ? 2 : 3)), RAX,
+					(kind == JK_ROL) || (kind == JK_ROR));
+				memOp({0x88}, RAX);
+				break;
+			case JK_ASLA: shift(4, REG_A, false); break;
+			case JK_LSRA: shift(5, REG_A, false); break;
+			case JK_ROLA: shift(2, REG_A, true); break;
+			case JK_RORA: shift(3, REG_A, true); break;
+			case JK_INX: incdec(REG_X, true); break;
+			case JK_INY: incdec(REG_Y, true); break;
+			case JK_DEX: incdec(REG_X, false); break;
+			case JK_DEY: incdec(REG_Y, false); break;
+			case JK_TAX: transfer(REG_A, REG_X); break;
+			case JK_TAY: transfer(REG_A, REG_Y); break;
+			case JK_TXA: transfer(REG_X, REG_A); break;
+			case JK_TYA: transfer(REG_Y, REG_A); break;
+			case JK_TSX:
+				e.mem({0x0F, 0xB6}, REG_X, REG_CTX, CTX(sp));
+				e.storeNZ(REG_X);
+				break;
+			case JK_TXS: e.mem({0x88}, REG_X, REG_CTX, CTX(sp)); break;
+			case JK_CLC: e.statusAnd(uint8_t(~Raquette::FLAG_C)); break;
+			case JK_SEC: e.statusOr(Raquette::FLAG_C); break;
+			case JK_CLI: e.statusAnd(uint8_t(~Raquette::FLAG_I)); break;
+			case JK_SEI: e.statusOr(Raquette::FLAG_I); break;
+			case JK_CLV: e.statusAnd(uint8_t(~Raquette::FLAG_V)); break;
+			case JK_CLD: e.statusAnd(uint8_t(~Raquette::FLAG_D)); break;
+			case JK_SED: e.statusOr(Raquette::FLAG_D); break;
+			case JK_NOP: break;
+			case JK_PHA:
+				e.mem({0x0F, 0xB6}, RDX, REG_CTX, CTX(sp));
+				e.mem({0x88}, REG_A, REG_MEM, 0x100, false, RDX);
+				e.subImm8(RDX, 1);
+				e.mem({0x88}, RDX, REG_CTX, CTX(sp));
+				break;
+			case JK_PLA:
+				e.mem({0x0F, 0xB6}, RDX, REG_CTX, CTX(sp));
+				e.addImm8(RDX, 1);
+				e.movzxReg8(RDX, RDX);
+				e.mem({0x88}, RDX, REG_CTX, CTX(sp));
+				e.mem({0x0F, 0xB6}, REG_A, REG_MEM, 0x100, false, RDX);
+				e.storeNZ(REG_A);
+				break;
+			case JK_PHP:
+				// Same as getStatus() | FLAG_B
+				e.mem({0x0F, 0xB6}, RAX, REG_CTX, CTX(status));
+				e.reg({0x81}, 4, RAX); // and eax, ~(N | Z)
+				e.d(uint8_t(~(Raquette::FLAG_N | Raquette::FLAG_Z)));
+				e.reg({0x81}, 1, RAX); // or eax, U | B
+				e.d(Raquette::FLAG_U | Raquette::FLAG_B);
+				e.mem({0x0F, 0xB7}, RDX, REG_CTX, CTX(nz));
+				e.reg({0x84}, RDX, RDX); // test dl, dl
+				e.reg({0x0F, 0x90 | CC_E}, 0, RBX); // sete bl
+				e.reg({0xD0}, 4, RBX); // shl bl, 1
+				e.reg({0x08}, RBX, RAX); // or al, bl
+				e.reg({0x89}, RDX, RCX); // mov ecx, edx
+				e.reg({0xD1}, 5, RCX); // shr ecx, 1
+				e.reg({0x09}, RCX, RDX); // or edx, ecx
+				e.reg({0x81}, 4, RDX); // and edx, 0x80
+				e.d(0x80);
+				e.reg({0x09}, RDX, RAX); // or eax, edx
+				e.mem({0x0F, 0xB6}, RDX, REG_CTX, CTX(sp));
+				e.mem({0x88}, RAX, REG_MEM, 0x100, false, RDX);
+				e.subImm8(RDX, 1);
+				e.mem({0x88}, RDX, REG_CTX, CTX(sp));
+				break;
+			case JK_PLP:
+				// Same as setStatus()
+				e.mem({0x0F, 0xB6}, RDX, REG_CTX, CTX(sp));
+				e.addImm8(RDX, 1);
+				e.movzxReg8(RDX, RDX);
+				e.mem({0x88}, RDX, REG_CTX, CTX(sp));
+				e.mem({0x0F, 0xB6}, RAX, REG_MEM, 0x100, false, RDX);
+				e.reg({0x89}, RAX, RDX); // mov edx, eax
+				e.reg({0x81}, 4, RDX); // and edx, ~(N | Z)
+				e.d(uint8_t(~(Raquette::FLAG_N | Raquette::FLAG_Z)));
+				e.mem({0x88}, RDX, REG_CTX, CTX(status));
+				e.reg({0x89}, RAX, RCX); // mov ecx, eax
+				e.reg({0x81}, 4, RCX); // and ecx, N
+				e.d(Raquette::FLAG_N);
+				e.mem({0x8D}, RBX, RCX, 0, false, RCX); // lea ebx, [rcx + rcx], the result if Z is set
+				e.reg({0x85}, RCX, RCX); // test ecx, ecx
+				e.reg({0x0F, 0x90 | CC_E}, 0, RDX); // sete dl
+				e.movzxReg8(RDX, RDX);
+				e.reg({0x09}, RCX, RDX); // or edx, ecx, the result if Z is clear
+				e.reg({0xF6}, 0, RAX); // test al, Z
+				e.b(Raquette::FLAG_Z);
+				e.reg({0x0F, 0x40 | CC_NE}, RDX, RBX); // cmovne edx, ebx
+				e.storeNZ(RDX);
+				break;
+			case JK_BCC: case JK_BCS: case JK_BVC: case JK_BVS:
+			case JK_BEQ: case JK_BNE: case JK_BMI: case JK_BPL:
+				{
+					bool whenSet = (kind == JK_BCS) || (kind == JK_BVS) || (kind == JK_BEQ) || (kind == JK_BMI);
+					if((kind == JK_BCC) || (kind == JK_BCS)){
+						e.statusTest(Raquette::FLAG_C);
+					}else if((kind == JK_BVC) || (kind == JK_BVS)){
+						e.statusTest(Raquette::FLAG_V);
+					}else if((kind == JK_BEQ) || (kind == JK_BNE)){
+						// Z is clear unless the low byte of nz is zero, so test it the other way round
+						e.mem({0xF6}, 0, REG_CTX, CTX(nz)); // test byte [ctx.nz], 0xFF
+						e.b(0xFF);
+						whenSet = !whenSet;
+					}else{
+						e.mem({0x0F, 0xB7}, RDX, REG_CTX, CTX(nz)); // movzx edx, word [ctx.nz]
+						e.reg({0x89}, RDX, RBX); // mov ebx, edx
+						e.reg({0xD1}, 5, RBX); // shr ebx, 1
+						e.reg({0x09}, RBX, RDX); // or edx, ebx
+						e.reg({0xF6}, 0, RDX); // test dl, 0x80
+						e.b(0x80);
+					}
+					size_t taken = e.jcc(whenSet ? CC_NE : CC_E);
+					exitTo(next, passCycles + op.cycles);
+					e.patch(taken, code.size());
+					exitTo(op.operand, passCycles + op.cycles + 1 + (((next ^ op.operand) & 0xFF00) != 0));
+					ended = true;
+				}
+				break;
+			case JK_JMP:
+				exitTo(op.operand, passCycles + op.cycles);
+				ended = true;
+				break;
+			case JK_JSR:
+				// Push the address of the last byte of the JSR, high byte first
+				e.mem({0x0F, 0xB6}, RDX, REG_CTX, CTX(sp));
+				e.mem({0xC6}, 0, REG_MEM, 0x100, false, RDX); // mov byte [mem + 0x100 + rdx], imm8
+				e.b(uint8_t((next - 1) >> 8));
+				e.subImm8(RDX, 1);
+				e.movzxReg8(RDX, RDX);
+				e.mem({0xC6}, 0, REG_MEM, 0x100, false, RDX);
+				e.b(uint8_t(next - 1));
+				e.subImm8(RDX, 1);
+				e.mem({0x88}, RDX, REG_CTX, CTX(sp));
+				exitTo(op.operand, passCycles + op.cycles);
+				ended = true;
+				break;
+			case JK_RTS:
+				e.mem({0x0F, 0xB6}, RDX, REG_CTX, CTX(sp));
+				e.addImm8(RDX, 1);
+				e.movzxReg8(RDX, RDX);
+				e.mem({0x0F, 0xB6}, RCX, REG_MEM, 0x100, false, RDX);
+				e.addImm8(RDX, 1);
+				e.movzxReg8(RDX, RDX);
+				e.mem({0x0F, 0xB6}, RAX, REG_MEM, 0x100, false, RDX);
+				e.mem({0x88}, RDX, REG_CTX, CTX(sp));
+				e.reg({0xC1}, 4, RAX); // shl eax, 8
+				e.b(8);
+				e.reg({0x09}, RCX, RAX); // or eax, ecx
+				e.addImm8(RAX, 1);
+				e.reg({0x81}, 4, RAX); // and eax, 0xFFFF
+				e.d(0xFFFF);
+				e.mem({0x89}, RAX, REG_CTX, CTX(pc));
+				e.addCycles(passCycles + op.cycles);
+				e.addInstructions(translated + 1);
+				// Same linking as exitTo(), with the link looked up at run time
+				e.reg({0xC1}, 4, RAX, true); // shl rax, 4
+				e.b(4);
+				e.mem({0x03}, RAX, REG_CTX, CTX(links), true); // add rax, [ctx.links]
+				e.mem({0x8B}, RCX, RAX, offsetof(JitLink, entry), true);
+				e.reg({0x85}, RCX, RCX, true);
+				{
+					size_t unlinked = e.jcc(CC_E);
+					e.mem({0x8B}, RDX, REG_CTX, CTX(cycles), true);
+					e.mem({0x03}, RDX, RAX, offsetof(JitLink, maxCycles), true);
+					e.mem({0x3B}, RDX, REG_CTX, CTX(target), true);
+					size_t tooLong = e.jcc(CC_A);
+					e.reg({0xFF}, 4, RCX); // jmp rcx
+					e.patch(unlinked, code.size());
+					e.patch(tooLong, code.size());
+				}
+				exits[newExit(0, 0, 0, false)].patches.push_back(e.jmp());
+				exits.back().pc = 0xFFFFFFFF; // PC already stored
+				ended = true;
+				break;
+			default:
+				break;
+		}
+
+		translated++;
+		passCycles += op.cycles;
+		if(ended) break;
+	}
+	if(translated == 0) return nullptr;
+	if(!ended){
+		// Ran off the end of a block cut short by its length or an uncached page
+		exits[newExit(block.ops.back().pc + block.ops.back().length, passCycles, translated, false)].patches.push_back(e.jmp());
+	}
+
+	// Exit stubs, then the common epilogue
+	std::vector<size_t> toEpilogue;
+	for(JitExit &exit : exits){
+		if(exit.patches.empty()) continue;
+		for(size_t at : exit.patches){
+			e.patch(at, code.size());
+		}
+		if(exit.pc != 0xFFFFFFFF){
+			e.mem({0xC7}, 0, REG_CTX, CTX(pc)); // mov dword [ctx.pc], imm32
+			e.d(exit.pc);
+		}
+		if(exit.fallback){
+			e.mem({0xC6}, 0, REG_CTX, CTX(fallback)); // mov byte [ctx.fallback], 1
+			e.b(1);
+		}
+		e.addCycles(exit.cycles);
+		e.addInstructions(exit.instructions);
+		toEpilogue.push_back(e.jmp());
+	}
+	for(size_t at : toEpilogue){
+		e.patch(at, code.size());
+	}
+	e.mem({0x88}, REG_A, REG_CTX, CTX(a));
+	e.mem({0x88}, REG_X, REG_CTX, CTX(x));
+	e.mem({0x88}, REG_Y, REG_CTX, CTX(y));
+	e.b(0x5B); // pop rbx
+	e.b(0xC3); // ret
+
+	if(arenaUsed + code.size() > ARENA_SIZE){
+		arenaFull = true;
+		return nullptr;
+	}
+	uint8_t *dest = arena + arenaUsed;
+	// Writable only for the copy, and only the pages it touches
+	uintptr_t hostPage = sysconf(_SC_PAGESIZE);
+	uint8_t *first = (uint8_t *)((uintptr_t)dest & ~(hostPage-1));
+	size_t span = ((uintptr_t)(dest + code.size()) - (uintptr_t)first + hostPage - 1) & ~(hostPage-1);
+	if(mprotect(first, span, PROT_READ | PROT_WRITE) != 0){
+		*log << "Cannot make JIT memory writable. Continuing with the interpreter.\n";
+		protectFailed = true;
+		return nullptr;
+	}
+	memcpy(dest, code.data(), code.size());
+	if(mprotect(first, span, PROT_READ | PROT_EXEC) != 0){
+		*log << "Cannot make JIT memory executable. Continuing with the interpreter.\n";
+		protectFailed = true;
+		arenaFull = true; // Translations on these pages can no longer run, so flush them all
+		return nullptr;
+	}
+	arenaUsed = (arenaUsed + code.size() + 15) & ~size_t(15);
+	links[start] = {dest + loopTop, block.maxCycles};
+	return (JitFunc) dest;
+}
+
+#else
+
+JitFunc RaqJit::translate(const Raquette::Block &block, const uint8_t *memory){
+	return nullptr;
+}
+
+#endif
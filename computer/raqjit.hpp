@@ -0,0 +1,56 @@
+#pragma once
+
+#include <ostream>
+#include <vector>
+
+// Dynamic recompiler for hot Raquette blocks (x86-64 hosts only)
+// Translated code works on a JitContext rather than on the Raquette itself.
+// It keeps A, X and Y in host registers and writes them back when it exits.
+// Any instruction it cannot run natively is left for the interpreter:
+// the code exits with pc pointing at it and fallback set.
+
+// Guest state seen by translated code
+struct JitContext {
+	uint8_t *memory;
+	const Raquette::MemPage *pages;
+	uint64_t cycles;
+	uint64_t instructions;
+	uint64_t target; // Same as in runCycles(), a block is only entered if it fits before this
+	const struct JitLink *links; // Indexed by guest address
+	uint32_t pc; // Next instruction when the code exits
+	uint16_t nz; // Same as Raquette::nzResult
+	uint8_t a, x, y, sp, status;
+	uint8_t fallback; // Set if the instruction at pc must be run by the interpreter
+};
+
+typedef void (*JitFunc)(JitContext *ctx);
+
+// Lets translated code jump straight into the translation of the next block
+struct JitLink {
+	void *entry; // Past the prologue, with the guest registers already loaded
+	uint64_t maxCycles; // Of the block, see Raquette::Block
+};
+static_assert(sizeof(JitLink) == 16, "translated code indexes links with a shift by 4");
+
+class RaqJit {
+	public:
+	RaqJit(std::ostream *log); // Where to report that executable memory was refused
+	~RaqJit();
+	bool available(); // False if the host is not x86-64 or executable memory was refused
+	bool full(); // Set once a translation did not fit, see reset()
+	void reset(); // Forgets all translations, every JitFunc handed out becomes invalid
+	void unlink(uint16_t start);
+	std::vector<JitLink> links;
+	JitFunc translate(const Raquette::Block &block, const uint8_t *memory);
+
+	private:
+	static const size_t ARENA_SIZE = 8 << 20; // Bytes of executable memory
+	// The arena is never writable and executable at once: it is executable except while
+	// translate() copies a block into it, when only the pages being written are made writable.
+	uint8_t *arena;
+	std::ostream *log;
+	size_t arenaUsed;
+	bool arenaFull;
+	bool protectFailed; // Translation stops for good if the arena's protection cannot be changed
+	std::vector<uint8_t> code; // Block being assembled
+};
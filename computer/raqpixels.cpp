@@ -0,0 +1,133 @@
+#include <cstdint>
+#include <cstring>
+#include "computer.hpp"
+#include "raquette.hpp"
+#include "raqpixels.hpp"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static bool alwaysSupported(){
+	return true;
+}
+
+static void expandRowScalar(uint32_t *dest, const uint8_t *src, unsigned count, unsigned scale, const uint32_t *palette){
+	for(unsigned i=0; i<count; i++){
+		uint32_t colour = palette[src[i]];
+		for(unsigned k=0; k<scale; k++){
+			*dest++ = colour;
+		}
+	}
+}
+
+#if defined(__x86_64__)
+
+// SSE2 is part of x86-64, so this kernel needs no check
+// There is no gather, so the lookups stay scalar and the vectors do the replication.
+static void expandRowSSE2(uint32_t *dest, const uint8_t *src, unsigned count, unsigned scale, const uint32_t *palette){
+	unsigned i = 0;
+	if(scale == 1){
+		for(; i+4 <= count; i+=4, dest+=4){
+			__m128i v = _mm_set_epi32(palette[src[i+3]], palette[src[i+2]], palette[src[i+1]], palette[src[i]]);
+			_mm_storeu_si128((__m128i *)dest, v);
+		}
+	}else if(scale == 2){
+		for(; i+4 <= count; i+=4, dest+=8){
+			__m128i v = _mm_set_epi32(palette[src[i+3]], palette[src[i+2]], palette[src[i+1]], palette[src[i]]);
+			_mm_storeu_si128((__m128i *)dest, _mm_unpacklo_epi32(v, v)); // 0 0 1 1
+			_mm_storeu_si128((__m128i *)(dest+4), _mm_unpackhi_epi32(v, v)); // 2 2 3 3
+		}
+	}else if(scale == 3){
+		for(; i+4 <= count; i+=4, dest+=12){
+			__m128i v = _mm_set_epi32(palette[src[i+3]], palette[src[i+2]], palette[src[i+1]], palette[src[i]]);
+			_mm_storeu_si128((__m128i *)dest, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+			_mm_storeu_si128((__m128i *)(dest+4), _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+			_mm_storeu_si128((__m128i *)(dest+8), _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+		}
+	}else{
+		// Whole vectors of one colour, the last one overlapping the one before if scale is not a multiple of 4
+		for(; i < count; i++, dest+=scale){
+			__m128i v = _mm_set1_epi32(palette[src[i]]);
+			for(unsigned k=0; k+4 < scale; k+=4){
+				_mm_storeu_si128((__m128i *)(dest+k), v);
+			}
+			_mm_storeu_si128((__m128i *)(dest+scale-4), v);
+		}
+	}
+	expandRowScalar(dest, src+i, count-i, scale, palette);
+}
+
+static bool avx2Supported(){
+	return __builtin_cpu_supports("avx2");
+}
+
+// Looks up 8 values at a time with a gather and spreads them with lane permutes
+__attribute__((target("avx2")))
+static void expandRowAVX2(uint32_t *dest, const uint8_t *src, unsigned count, unsigned scale, const uint32_t *palette){
+	unsigned i = 0;
+	if(scale <= 3){
+		for(; i+8 <= count; i+=8, dest+=8*scale){
+			__m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src+i)));
+			__m256i v = _mm256_i32gather_epi32((const int *)palette, idx, 4);
+			if(scale == 1){
+				_mm256_storeu_si256((__m256i *)dest, v);
+			}else if(scale == 2){
+				_mm256_storeu_si256((__m256i *)dest, _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3)));
+				_mm256_storeu_si256((__m256i *)(dest+8), _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7)));
+			}else{
+				_mm256_storeu_si256((__m256i *)dest, _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2)));
+				_mm256_storeu_si256((__m256i *)(dest+8), _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5)));
+				_mm256_storeu_si256((__m256i *)(dest+16), _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7)));
+			}
+		}
+	}else if(scale >= 8){
+		for(; i < count; i++, dest+=scale){
+			__m256i v = _mm256_set1_epi32(palette[src[i]]);
+			for(unsigned k=0; k+8 < scale; k+=8){
+				_mm256_storeu_si256((__m256i *)(dest+k), v);
+			}
+			_mm256_storeu_si256((__m256i *)(dest+scale-8), v);
+		}
+	}else{
+		return expandRowSSE2(dest, src, count, scale, palette);
+	}
+	expandRowScalar(dest, src+i, count-i, scale, palette);
+}
+
+#endif
+
+const RaqExpandKernel raqExpandKernels[] = {
+#if defined(__x86_64__)
+	{"avx2", avx2Supported, expandRowAVX2},
+	{"sse2", alwaysSupported, expandRowSSE2},
+#endif
+	{"scalar", alwaysSupported, expandRowScalar}
+};
+const unsigned RAQ_EXPAND_KERNELS = sizeof(raqExpandKernels) / sizeof(raqExpandKernels[0]);
+
+static const RaqExpandKernel *pickKernelHelper(){
+	for(unsigned i=0; i < RAQ_EXPAND_KERNELS-1; i++){
+		if(raqExpandKernels[i].supported()) return &raqExpandKernels[i];
+	}
+	return &raqExpandKernels[RAQ_EXPAND_KERNELS-1];
+}
+
+const RaqExpandKernel &raqExpandBest(){
+	static const RaqExpandKernel *best = pickKernelHelper(); // Initialised once, even with several threads
+	return *best;
+}
+
+// Each row is expanded once and copied for the rest of its scale, while it is still in cache
+void raqExpandRect(const RaqExpandKernel &kernel, const char (*src)[280], const Raquette::DirtyRect &rect,
+	uint32_t *dest, size_t pitch, unsigned scale, const uint32_t *palette){
+	size_t rowBytes = size_t(rect.w) * scale * sizeof(uint32_t);
+	uint8_t *out = (uint8_t *)dest;
+	for(unsigned y=rect.y; y < unsigned(rect.y + rect.h); y++){
+		kernel.expandRow((uint32_t *)out, (const uint8_t *)&src[y][rect.x], rect.w, scale, palette);
+		for(unsigned k=1; k<scale; k++){
+			memcpy(out + (k*pitch), out, rowBytes);
+		}
+		out += scale * pitch;
+	}
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Palette expansion of Raquette::dispBuf into 32-bit pixels for a frontend texture
+// Each dispBuf value is looked up in a 256 entry palette and becomes a scale x scale square, so
+// frames can be uploaded at the window's size instead of scaled by the renderer.
+// A kernel expands one row horizontally; raqExpandRect() repeats each row for the vertical scale.
+// The kernels give identical results, the fastest one the host supports is picked at runtime.
+
+struct RaqExpandKernel {
+	const char *name;
+	bool (*supported)();
+	// Writes count * scale pixels to dest, scale of each src value
+	void (*expandRow)(uint32_t *dest, const uint8_t *src, unsigned count, unsigned scale, const uint32_t *palette);
+};
+
+extern const RaqExpandKernel raqExpandKernels[]; // Fastest first, the last one (scalar) always works
+extern const unsigned RAQ_EXPAND_KERNELS;
+const RaqExpandKernel &raqExpandBest(); // Fastest supported kernel, chosen on the first call
+
+// Expands rect (in dispBuf pixels) of src, a 192x280 dispBuf, into dest
+// dest points at the output pixel for the top left corner of rect and pitch is in bytes, which is
+// what SDL_LockTexture() gives for the same rect scaled up.
+void raqExpandRect(const RaqExpandKernel &kernel, const char (*src)[280], const Raquette::DirtyRect &rect,
+	uint32_t *dest, size_t pitch, unsigned scale, const uint32_t *palette);
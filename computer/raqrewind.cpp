@@ -0,0 +1,210 @@
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <cstddef>
+#include <assert.h>
+#include "computer.hpp"
+#include "raquette.hpp"
+#include "raqrewind.hpp"
+
+// Deltas keep everything before memory as it is and encode memory and disk, which are adjacent
+static const size_t HEAD_BYTES = offsetof(Raquette::SaveState, events) + sizeof(Raquette::SaveState::events);
+static const size_t BULK_OFFSET = offsetof(Raquette::SaveState, memory);
+static const size_t BULK_BYTES = sizeof(Raquette::SaveState) - BULK_OFFSET;
+static_assert(offsetof(Raquette::SaveState, disk) == BULK_OFFSET + 0x10000, "disk must follow memory");
+static_assert(BULK_BYTES == 0x10000 + sizeof(Raquette::SaveState::disk), "nothing may follow disk");
+
+static void putVarint(std::vector<uint8_t> &out, size_t val){
+	while(val >= 0x80){
+		out.push_back(uint8_t(val) | 0x80);
+		val >>= 7;
+	}
+	out.push_back(uint8_t(val));
+}
+
+static size_t getVarint(const uint8_t *&in){
+	size_t val = 0;
+	for(int shift=0; ; shift += 7){
+		uint8_t byte = *in++;
+		val |= size_t(byte & 0x7F) << shift;
+		if(!(byte & 0x80)) return val;
+	}
+}
+
+static uint64_t load64(const uint8_t *p){
+	uint64_t val;
+	memcpy(&val, p, 8);
+	return val;
+}
+
+// Encodes cur XOR key as runs of (bytes to skip, bytes that differ, the differing bytes XORed)
+// Short stretches of equal bytes stay inside a run, a run ends at 8 equal bytes in a row.
+static void xorEncode(const uint8_t *cur, const uint8_t *key, size_t len, std::vector<uint8_t> &out){
+	size_t i = 0;
+	while(i < len){
+		size_t start = i;
+		while((i+8 <= len) && (load64(cur+i) == load64(key+i))) i += 8;
+		while((i < len) && (cur[i] == key[i])) i++;
+		if(i == len) break;
+
+		size_t first = i;
+		unsigned same = 0;
+		while((i < len) && (same < 8)){
+			same = (cur[i] == key[i]) ? (same + 1) : 0;
+			i++;
+		}
+		size_t end = i - same;
+		putVarint(out, first - start);
+		putVarint(out, end - first);
+		for(size_t j=first; j<end; j++){
+			out.push_back(cur[j] ^ key[j]);
+		}
+		i = end;
+	}
+}
+
+// Applies a delta from xorEncode() to dest, which must hold a copy of the key
+static void xorDecode(const std::vector<uint8_t> &delta, uint8_t *dest, size_t len){
+	const uint8_t *in = delta.data();
+	const uint8_t *end = in + delta.size();
+	size_t pos = 0;
+	while(in < end){
+		pos += getVarint(in);
+		size_t count = getVarint(in);
+		assert(pos + count <= len);
+		for(size_t j=0; j<count; j++){
+			dest[pos++] ^= *in++;
+		}
+	}
+}
+
+RaqRewind::RaqRewind(Raquette &raquette, unsigned interval, unsigned keyInterval, unsigned maxKeyframes)
+	: raq(raquette), interval(interval), keyInterval(keyInterval), maxKeyframes(maxKeyframes) {
+	lastSnapshotUs = 0;
+	worstSnapshotUs = 0;
+	lastRewindUs = 0;
+	lastFrame = 0;
+	scratch = new Raquette::SaveState();
+}
+
+RaqRewind::~RaqRewind(){
+	for(Group &group : groups){
+		delete group.key;
+	}
+	delete scratch;
+}
+
+void RaqRewind::update(){
+	if(groups.empty() || (raq.frames - lastFrame >= interval)) snapshot();
+}
+
+// Records the machine as it is now
+void RaqRewind::snapshot(){
+	auto start = std::chrono::steady_clock::now();
+	lastFrame = raq.frames;
+	if(groups.empty() || (groups.back().deltas.size() + 1 >= keyInterval)){
+		// New keyframe, dropping the oldest one and its deltas if we have too many
+		Raquette::SaveState *key = new Raquette::SaveState();
+		raq.captureState(*key);
+		groups.push_back({key, {}});
+		if(groups.size() > maxKeyframes){
+			delete groups.front().key;
+			groups.pop_front();
+		}
+	}else{
+		Group &group = groups.back();
+		raq.captureState(*scratch);
+		group.deltas.emplace_back();
+		Delta &delta = group.deltas.back();
+		delta.cycles = scratch->cycles;
+		delta.head.assign((const uint8_t *)scratch, (const uint8_t *)scratch + HEAD_BYTES);
+		xorEncode((const uint8_t *)scratch + BULK_OFFSET, (const uint8_t *)group.key + BULK_OFFSET, BULK_BYTES, delta.bulk);
+		delta.bulk.shrink_to_fit();
+	}
+	std::chrono::duration<double, std::micro> usecs = std::chrono::steady_clock::now() - start;
+	lastSnapshotUs = usecs.count();
+	if(lastSnapshotUs > worstSnapshotUs) worstSnapshotUs = lastSnapshotUs;
+}
+
+// Restores the newest snapshot at or before cycle, then runs forward to cycle
+// Snapshots newer than the one restored are dropped, since history now takes another path.
+// Returns false, leaving the machine untouched, if cycle is older than the oldest snapshot.
+bool RaqRewind::rewindTo(uint64_t cycle){
+	auto start = std::chrono::steady_clock::now();
+	if(groups.empty() || (groups.front().key->cycles > cycle)){
+		*raq.log << "Cannot rewind to cycle " << cycle << ", it is older than the rewind buffer\n";
+		return false;
+	}
+	while(groups.back().key->cycles > cycle){
+		delete groups.back().key;
+		groups.pop_back();
+	}
+	Group &group = groups.back();
+	while(!group.deltas.empty() && (group.deltas.back().cycles > cycle)){
+		group.deltas.pop_back();
+	}
+
+	// Rebuild the snapshot on a copy of its keyframe
+	memcpy((void *)scratch, group.key, sizeof(Raquette::SaveState));
+	if(!group.deltas.empty()){
+		const Delta &delta = group.deltas.back();
+		memcpy((void *)scratch, delta.head.data(), HEAD_BYTES);
+		xorDecode(delta.bulk, (uint8_t *)scratch + BULK_OFFSET, BULK_BYTES);
+	}
+	if(!raq.restoreState(*scratch)) return false;
+	lastFrame = raq.frames;
+
+	// Whole instructions only, so this stops on the first instruction boundary at or after cycle
+	if(cycle > raq.cycles){
+		raq.runCycles(cycle - raq.cycles + raq.overshoot);
+	}
+	std::chrono::duration<double, std::micro> usecs = std::chrono::steady_clock::now() - start;
+	lastRewindUs = usecs.count();
+	return true;
+}
+
+bool RaqRewind::rewindFrames(unsigned count){
+	uint64_t back = uint64_t(count) * Raquette::FRAME_CYCLES;
+	uint64_t oldest = oldestCycle();
+	if(raq.cycles < oldest + back) return rewindTo(oldest);
+	return rewindTo(raq.cycles - back);
+}
+
+unsigned RaqRewind::snapshots(){
+	unsigned count = 0;
+	for(const Group &group : groups){
+		count += 1 + group.deltas.size();
+	}
+	return count;
+}
+
+uint64_t RaqRewind::oldestCycle(){
+	return groups.empty() ? raq.cycles : groups.front().key->cycles;
+}
+
+size_t RaqRewind::memoryUsed(){
+	size_t bytes = sizeof(Raquette::SaveState) * (groups.size() + 1); // Keyframes and scratch
+	for(const Group &group : groups){
+		for(const Delta &delta : group.deltas){
+			bytes += sizeof(Delta) + delta.head.capacity() + delta.bulk.capacity();
+		}
+	}
+	return bytes;
+}
+
+void RaqRewind::report(std::ostream &out){
+	unsigned count = snapshots();
+	unsigned deltas = count - groups.size();
+	size_t deltaBytes = 0;
+	for(const Group &group : groups){
+		for(const Delta &delta : group.deltas){
+			deltaBytes += delta.head.size() + delta.bulk.size();
+		}
+	}
+	out << "Rewind buffer: " << count << " snapshots (" << groups.size() << " keyframes) covering "
+		<< (raq.cycles - oldestCycle()) / double(Raquette::FRAME_CYCLES) << " frames\n";
+	out << "Memory used: " << memoryUsed() / 1024 << " KB, " << (deltas ? deltaBytes / deltas : 0)
+		<< " bytes per delta on average\n";
+	out << "Snapshot: " << lastSnapshotUs << " us last, " << worstSnapshotUs << " us worst. Last rewind: "
+		<< lastRewindUs << " us\n";
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <ostream>
+#include <vector>
+
+// Rewind buffer for a Raquette
+// Snapshots are taken every few frames. Most are stored as the XOR of memory and disk against
+// the last keyframe (a full Raquette::SaveState), run length encoded so the unchanged bytes cost
+// almost nothing. Each delta only needs its own keyframe, so any snapshot is rebuilt in one step.
+// Old history is dropped a whole keyframe at a time, which keeps memory use bounded.
+//
+// Call update() once per slice, after host input has been applied and before running the machine,
+// so that re-running forward from a snapshot sees the same input as the first time.
+
+class RaqRewind {
+	public:
+	// interval: frames between snapshots
+	// keyInterval: snapshots per keyframe, including the keyframe itself
+	// maxKeyframes: keyframes kept, history covers about interval * keyInterval * maxKeyframes frames
+	RaqRewind(Raquette &raquette, unsigned interval = 1, unsigned keyInterval = 60, unsigned maxKeyframes = 10);
+	~RaqRewind();
+	void update(); // Takes a snapshot if interval frames have passed since the last one
+	void snapshot();
+	bool rewindTo(uint64_t cycle); // Back to the first instruction boundary at or after cycle
+	bool rewindFrames(unsigned count);
+	unsigned snapshots();
+	uint64_t oldestCycle(); // Earliest cycle that can be rewound to
+	size_t memoryUsed(); // Bytes held by keyframes, deltas and scratch space
+	void report(std::ostream &out);
+
+	double lastSnapshotUs; // Time taken by the last snapshot()
+	double worstSnapshotUs;
+	double lastRewindUs; // Time taken by the last rewind, re-running forward included
+
+	private:
+	struct Delta {
+		uint64_t cycles;
+		std::vector<uint8_t> head; // SaveState fields before memory, stored as they are
+		std::vector<uint8_t> bulk; // Memory and disk, XORed against the keyframe and run length encoded
+	};
+	struct Group {
+		Raquette::SaveState *key;
+		std::vector<Delta> deltas; // Newer snapshots taken against key
+	};
+	Raquette &raq;
+	unsigned interval, keyInterval, maxKeyframes;
+	uint64_t lastFrame; // raq.frames at the last snapshot
+	std::deque<Group> groups; // Oldest first
+	Raquette::SaveState *scratch; // Snapshots are captured and rebuilt here
+};
@@ -0,0 +1,154 @@
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include "computer.hpp"
+#include "raquette.hpp"
+#include "raqrewind.hpp"
+#include "raqrunner.hpp"
+
+static const size_t MAX_RECTS = 64; // Beyond this many rects a frame is sent whole
+
+RaqRunner::RaqRunner(Raquette &raquette, RaqRewind *history) : raq(raquette), rewinder(history), running(false), latch(0), appliedShown(0) {
+	paced = true;
+	runAheadFrames = 0;
+	runAheadMs = 0;
+	frameCount = 0;
+	applied = 0;
+	sent = 0;
+	sentLatch = 0;
+	sentRepeat = false;
+}
+
+RaqRunner::~RaqRunner(){
+	stop();
+}
+
+void RaqRunner::start(){
+	if(running) return;
+	latch = raq.memory[0xC000];
+	sentLatch = latch;
+	appliedShown = applied;
+	sent = applied;
+	running = true;
+	thread = std::thread(&RaqRunner::run, this);
+}
+
+void RaqRunner::stop(){
+	if(!running) return;
+	running = false;
+	thread.join();
+	// Anything still queued is applied, so the machine has seen every key the host sent
+	Command cmd;
+	while(commands.pop(cmd)){
+		applyHelper(cmd);
+	}
+}
+
+bool RaqRunner::keyInput(uint8_t val){
+	if(!commands.push({CMD_KEY, val})) return false;
+	sent++;
+	sentLatch = val;
+	return true;
+}
+
+bool RaqRunner::setRepeat(bool held){
+	if(held == sentRepeat) return true;
+	if(!commands.push({CMD_REPEAT, held})) return false;
+	sent++;
+	sentRepeat = held;
+	return true;
+}
+
+bool RaqRunner::rewind(unsigned frames){
+	if(!commands.push({CMD_REWIND, uint8_t(frames > 255 ? 255 : frames)})) return false;
+	sent++;
+	return true;
+}
+
+// Until the machine has caught up with every command sent, the last key sent is what the latch
+// will hold. Comparing against an older latch would send the same key twice, and the guest
+// could read it in between and see two key presses.
+uint8_t RaqRunner::keyLatch(){
+	if(appliedShown.load(std::memory_order_acquire) != sent) return sentLatch;
+	return latch.load(std::memory_order_relaxed);
+}
+
+const RaqRunner::Frame *RaqRunner::takeFrame(){
+	return frames.take();
+}
+
+void RaqRunner::applyHelper(const Command &cmd){
+	switch(cmd.type){
+		case CMD_KEY:
+			raq.keyInput(cmd.value);
+			if(cmd.value & 0b10000000) lastKey = std::chrono::steady_clock::now();
+			break;
+		case CMD_REPEAT:
+			raq.setRepeat(cmd.value);
+			break;
+		case CMD_REWIND:
+			if(rewinder && rewinder->rewindFrames(cmd.value)) rewinder->report(std::cout);
+			break;
+	}
+	applied++;
+}
+
+// Copies the frame just rendered into the back buffer and publishes it
+// The host only uploads the rects of the frames it takes, so the rects of frames it skipped are
+// carried into the next one until it is known to have taken a frame.
+void RaqRunner::publishHelper(){
+	Frame &frame = frames.back();
+	frame.dirtyRects = unseen;
+	frame.dirtyRects.insert(frame.dirtyRects.end(), raq.dirtyRects.begin(), raq.dirtyRects.end());
+	if(frame.dirtyRects.size() > MAX_RECTS){
+		frame.dirtyRects.clear();
+		frame.dirtyRects.push_back({0, 0, 280, 192});
+	}
+	if(!frame.dirtyRects.empty()){
+		memcpy(frame.pixels, raq.dispBuf, sizeof(frame.pixels));
+	}
+	frame.number = frameCount;
+	frame.cycles = raq.cycles;
+	// If the frame this one replaces is never taken, this one carries its rects as well
+	unseen = frame.dirtyRects; // frame belongs to the host once published
+	if(frames.publish()){
+		// The frame before this one was taken, so only this frame's changes might go unseen
+		unseen = raq.dirtyRects;
+	}
+}
+
+void RaqRunner::run(){
+	const std::chrono::nanoseconds frameTime(1000000000 / 60);
+	auto next = std::chrono::steady_clock::now();
+	while(running.load(std::memory_order_relaxed)){
+		Command cmd;
+		while(commands.pop(cmd)){
+			applyHelper(cmd);
+		}
+		if(rewinder) rewinder->update(); // After input and before running, see raqrewind.hpp
+		raq.runCycles(Raquette::FRAME_CYCLES);
+		latch.store(raq.memory[0xC000], std::memory_order_relaxed);
+		appliedShown.store(applied, std::memory_order_release);
+
+		// Shortly after a key press, show the frame the machine will draw a little later
+		// so the key's effect appears sooner (see Raquette::renderAhead())
+		auto now = std::chrono::steady_clock::now();
+		if(runAheadFrames && (now - lastKey < std::chrono::milliseconds(runAheadMs))){
+			raq.renderAhead(runAheadFrames);
+		}else{
+			raq.renderScreen();
+		}
+		publishHelper();
+		frameCount++;
+
+		if(paced){
+			next += frameTime;
+			now = std::chrono::steady_clock::now();
+			if(now > next + (FRAMES_BEHIND * frameTime)){
+				next = now; // Too far behind to catch up, carry on from here at normal speed
+			}else{
+				std::this_thread::sleep_until(next);
+			}
+		}
+	}
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+class RaqRewind;
+
+// Runs a Raquette on its own thread, paced to 60 frames per second
+// The host's thread only reads input and presents frames, so a slow present does not slow the
+// machine down and a slow burst of emulation does not hold up the display.
+// Input goes to the machine through a command queue and finished frames come back through a
+// triple buffer. Neither side ever waits for the other, and once started the Raquette belongs to
+// the emulation thread until stop().
+
+// Lock-free queue with one producer thread and one consumer thread
+// SIZE must be a power of two. The indexes only ever count up, so full and empty are told apart.
+template <class T, unsigned SIZE> class RaqQueue {
+	public:
+	RaqQueue() : head(0), tail(0) {}
+	bool push(const T &item){ // Producer, returns false if the queue is full
+		unsigned t = tail.load(std::memory_order_relaxed);
+		if(t - head.load(std::memory_order_acquire) == SIZE) return false;
+		items[t & (SIZE-1)] = item;
+		tail.store(t+1, std::memory_order_release);
+		return true;
+	}
+	bool pop(T &item){ // Consumer, returns false if the queue is empty
+		unsigned h = head.load(std::memory_order_relaxed);
+		if(h == tail.load(std::memory_order_acquire)) return false;
+		item = items[h & (SIZE-1)];
+		head.store(h+1, std::memory_order_release);
+		return true;
+	}
+
+	private:
+	static_assert((SIZE & (SIZE-1)) == 0, "RaqQueue size must be a power of two");
+	T items[SIZE];
+	alignas(64) std::atomic<unsigned> head; // Next item to pop, written by the consumer
+	alignas(64) std::atomic<unsigned> tail; // Next slot to push, written by the producer
+};
+
+// Lock-free triple buffer with one producer thread and one consumer thread
+// The producer fills back() and publishes it, the consumer takes the newest published slot. The
+// third slot sits between them, so either side can swap with it at any time. Frames the consumer
+// was too slow to take are replaced by newer ones.
+template <class T> class RaqTripleBuffer {
+	public:
+	RaqTripleBuffer() : middle(1), backSlot(0), frontSlot(2) {}
+	T &back(){ // Producer
+		return slots[backSlot];
+	}
+	// Producer, hands back() to the consumer and gets a slot to fill next
+	// Returns false if the slot it replaced had never been taken.
+	bool publish(){
+		uint8_t old = middle.exchange(backSlot | FRESH, std::memory_order_acq_rel);
+		backSlot = old & SLOT;
+		return !(old & FRESH);
+	}
+	// Consumer, returns the newest published slot, or nullptr if there is nothing new since the last call
+	// The slot stays valid until the next call.
+	T *take(){
+		if(!(middle.load(std::memory_order_relaxed) & FRESH)) return nullptr; // Only the consumer clears FRESH
+		uint8_t old = middle.exchange(frontSlot, std::memory_order_acq_rel);
+		frontSlot = old & SLOT;
+		return &slots[frontSlot];
+	}
+
+	private:
+	static const uint8_t SLOT = 0b11;
+	static const uint8_t FRESH = 0b100; // Set while middle holds a slot the consumer has not taken
+	T slots[3];
+	alignas(64) std::atomic<uint8_t> middle;
+	alignas(64) uint8_t backSlot; // Only the producer touches this
+	alignas(64) uint8_t frontSlot; // Only the consumer touches this
+};
+
+class RaqRunner {
+	public:
+	// A finished frame
+	// Only dirtyRects need uploading to keep a copy of the screen up to date. They cover everything
+	// that changed since the last frame the host took, including frames it never saw.
+	struct Frame {
+		char pixels[192][280]; // Current inside dirtyRects, anything else may be stale
+		std::vector<Raquette::DirtyRect> dirtyRects;
+		uint64_t number; // Frames run before this one, gaps show frames the host skipped
+		uint64_t cycles;
+	};
+
+	// history, if given, gets update() every frame and serves rewind()
+	RaqRunner(Raquette &raquette, RaqRewind *history = nullptr);
+	~RaqRunner(); // Stops the thread if it is running
+	void start();
+	void stop(); // Returns once the thread has finished its frame, the Raquette is then the host's again
+
+	// Host thread
+	// These queue a command for the start of the next frame, and return false if the queue is full.
+	bool keyInput(uint8_t val); // See Raquette::keyInput()
+	bool setRepeat(bool held); // See Raquette::setRepeat(), only changes are sent
+	bool rewind(unsigned frames); // See RaqRewind::rewindFrames()
+	uint8_t keyLatch(); // The keyboard latch at 0xC000, as of the last frame or the last key sent
+	const Frame *takeFrame(); // Newest finished frame, or nullptr if none since the last call
+
+	// Set before start()
+	bool paced; // False runs frames back to back, as fast as the host allows
+	unsigned runAheadFrames; // Frames shown ahead after a key press, see Raquette::renderAhead(), 0 to turn off
+	unsigned runAheadMs; // How long after the last key press to keep running ahead
+
+	private:
+	enum CommandType : uint8_t {
+		CMD_KEY,
+		CMD_REPEAT,
+		CMD_REWIND
+	};
+	struct Command {
+		CommandType type;
+		uint8_t value;
+	};
+	static const unsigned FRAMES_BEHIND = 6; // Frames the machine may fall behind before it gives up catching up
+
+	Raquette &raq;
+	RaqRewind *rewinder;
+	std::thread thread;
+	std::atomic<bool> running;
+	RaqQueue<Command, 256> commands;
+	RaqTripleBuffer<Frame> frames;
+
+	// Emulation thread
+	uint64_t frameCount;
+	uint64_t applied; // Commands applied so far
+	std::chrono::steady_clock::time_point lastKey; // When the last new key was latched
+	std::vector<Raquette::DirtyRect> unseen; // Published since the host last took a frame
+	void run();
+	void applyHelper(const Command &cmd);
+	void publishHelper();
+
+	// Shared, written by the emulation thread after each frame
+	alignas(64) std::atomic<uint8_t> latch;
+	std::atomic<uint64_t> appliedShown; // Value of applied when latch was stored
+
+	// Host thread
+	alignas(64) uint64_t sent; // Commands queued so far
+	uint8_t sentLatch; // Last key sent
+	bool sentRepeat;
+};
@@ -0,0 +1,59 @@
+#include <iostream>
+#include <chrono>
+#include "computer.hpp"
+#include "raquette.hpp"
+#include "raqtrace.hpp"
+
+RaqTraceWriter::RaqTraceWriter(Raquette &raquette, const char *fileName)
+	: raq(raquette), outfile(fileName, std::ios::binary | std::ios::out | std::ios::trunc), stopping(false) {
+	if(!outfile){
+		*raq.log << "Cannot create trace file " << fileName << std::endl;
+		return;
+	}
+	TraceFileHeader header;
+	for(int i=0; i<8; i++){
+		header.magic[i] = TRACE_MAGIC[i];
+	}
+	header.version = TRACE_VERSION;
+	header.recordSize = sizeof(Raquette::TraceRecord);
+	outfile.write((const char *)&header, sizeof(header));
+
+	raq.traceTail.store(raq.traceHead.load());
+	thread = std::thread(&RaqTraceWriter::run, this);
+}
+
+RaqTraceWriter::~RaqTraceWriter(){
+	if(thread.joinable()){
+		stopping.store(true);
+		thread.join();
+	}
+}
+
+bool RaqTraceWriter::ok(){
+	return thread.joinable();
+}
+
+// Writes out everything between traceTail and traceHead, returning the number of records
+unsigned RaqTraceWriter::drain(){
+	unsigned head = raq.traceHead.load(std::memory_order_acquire);
+	unsigned tail = raq.traceTail.load(std::memory_order_relaxed);
+	unsigned count = head - tail;
+	while(tail != head){
+		// Up to the end of the ring, then the rest from its start
+		unsigned at = tail & (Raquette::TRACE_LEN-1);
+		unsigned run = Raquette::TRACE_LEN - at;
+		if(run > head - tail) run = head - tail;
+		outfile.write((const char *)&raq.traceBuf[at], run * sizeof(Raquette::TraceRecord));
+		tail += run;
+		raq.traceTail.store(tail, std::memory_order_release);
+	}
+	return count;
+}
+
+void RaqTraceWriter::run(){
+	while(!stopping.load()){
+		if(!drain()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	drain();
+	outfile.flush();
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <atomic>
+#include <fstream>
+#include <thread>
+
+// Drains Raquette's trace ring to a binary file on its own thread
+// The emulator thread is the only producer and this is the only consumer, so the ring needs
+// no locks: the producer publishes traceHead and we publish traceTail once records are saved.
+// While a writer is attached the producer waits instead of overwriting unsaved records.
+//
+// File layout: a TraceFileHeader, then Raquette::TraceRecord structs in host byte order.
+// raqdecode turns a trace file back into disassembly.
+
+struct TraceFileHeader {
+	char magic[8]; // TRACE_MAGIC
+	uint32_t version;
+	uint32_t recordSize; // sizeof(Raquette::TraceRecord)
+};
+
+static const char TRACE_MAGIC[8] = {'R', 'A', 'Q', 'T', 'R', 'A', 'C', 'E'};
+static const uint32_t TRACE_VERSION = 1;
+
+class RaqTraceWriter {
+	public:
+	RaqTraceWriter(Raquette &raquette, const char *fileName);
+	~RaqTraceWriter(); // Saves every record traced so far, then closes the file
+	bool ok(); // False if the file could not be created
+
+	private:
+	Raquette &raq;
+	std::ofstream outfile;
+	std::atomic<bool> stopping;
+	std::thread thread;
+	void run();
+	unsigned drain();
+};
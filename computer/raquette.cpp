@@ -1,47 +1,47 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <assert.h>
 #include <tuple>
+#include <array>
+#include <string>
+#include <algorithm>
+#include <map>
+#include <iterator>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <ncurses.h>
 #include "computer.hpp"
 #include "raquette.hpp"
+#include "raqjit.hpp"
+#include "raqtrace.hpp"
+#include "raqpixels.hpp"
 
-#define RAQ_MASK_OPC uint8_t(0b11100011)
 #define RAQ_ACC (regs[0])
 #define RAQ_X (regs[1])
 #define RAQ_Y (regs[2])
 #define RAQ_STACK (regs[3])
-#define ROM_LO (0xC000)
 
-Raquette::RaqDisk::RaqDisk() {
-	std::ifstream infile("../software/raquette/foo.DSK", std::ios::binary | std::ios::in);
-	if(!infile){
-		std::cout << "Cannot open DSK file. Continuing with no disk.\n";
-	}else{
-		//get length of file
-		infile.seekg(0, std::ios::end);
-		size_t length = infile.tellg();
-		infile.seekg(0, std::ios::beg);
-
-		std::cout << "Opened disk of length " << length << std::endl;
-		if (length != 143360){
-			std::cout << "DSK file wrong size\n";
-			exit(-1);
-		}
-		char * buffer = new char[length];
-		infile.read(buffer, length);
-
-		// Copy into array representing disk sectors
-		for (int track =0; track < 35; track++){
-			for(int sector=0; sector<16; sector++){
-				for (int byte=0; byte<256; byte++){
-					disk[track][sector][byte] = buffer[(track*16*256)+(sector*256)+byte];
-				}
-			}
-		}
-		delete [] buffer;
-	}
+// Maps length bytes of a file copy-on-write over dest, which must be page aligned
+// Reads see the file's pages, shared with every other mapping of it. The first write to a page
+// gives this mapping its own copy. Returns false if the file cannot be mapped.
+static bool mapFileHelper(void *dest, const std::string &fileName, size_t length){
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if(fd < 0) return false;
+	void *mapped = mmap(dest, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+	close(fd);
+	return mapped != MAP_FAILED;
+}
 
+Raquette::RaqDisk::RaqDisk() {
+	// Fresh anonymous pages read as zero
+	void *mapped = mmap(nullptr, DISK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(mapped != MAP_FAILED);
+	disk = (uint8_t (*)[16][256])mapped;
 	stepperPhase = 0; // TODO random
 	halftrack = 0; //TODO random
 	stepper_p0 = false;
@@ -52,6 +52,35 @@ Raquette::RaqDisk::RaqDisk() {
 	drive = 1; // TODO support 2nd drive
 };
 
+Raquette::RaqDisk::~RaqDisk() {
+	munmap(disk, DISK_BYTES);
+}
+
+// Maps a DSK image into the drive, messages go to log
+// A missing file leaves the drive empty, which is not an error. Returns false if the file is unusable.
+bool Raquette::RaqDisk::load(const std::string &fileName, std::ostream &log) {
+	std::ifstream infile(fileName, std::ios::binary | std::ios::in);
+	if(!infile){
+		log << "Cannot open DSK file. Continuing with no disk.\n";
+		return true;
+	}
+	//get length of file
+	infile.seekg(0, std::ios::end);
+	size_t length = infile.tellg();
+
+	log << "Opened disk of length " << length << std::endl;
+	if (length != DISK_BYTES){
+		log << "DSK file wrong size\n";
+		return false;
+	}
+	// The DSK layout is track by track, sector by sector, which is how disk[][][] is laid out too
+	if(!mapFileHelper(disk, fileName, DISK_BYTES)){
+		log << "Cannot map DSK file\n";
+		return false;
+	}
+	return true;
+}
+
 // Cause the stepper rotor to react to the magnets, updating the phase and track
 // Track can be 0-34
 uint8_t Raquette::RaqDisk::stepper() {
@@ -112,15 +141,28 @@ uint8_t Raquette::RaqDisk::stepper() {
 			return halftrack;
 		}
 	}else{
-		std::cout << "Error: disk stepper out of bounds\n";
-		exit(-1);
+		// restoreState() refuses states with any other phase
+		assert(0);
+		return halftrack;
 	}
 }
 
+// Config for a machine started from a memory image rather than the ROM file
+static Raquette::Config imageConfig(uint8_t *init_contents, int len_contents){
+	Raquette::Config config;
+	config.image = init_contents;
+	config.imageLen = len_contents;
+	return config;
+}
+
+// init_contents, if given, is copied to memory from address 0 instead of loading the ROM file
+Raquette::Raquette(uint8_t *init_contents, int len_contents) : Raquette(imageConfig(init_contents, len_contents)) {
+}
+
 // TODO support smaller memory configurations than 64k
 // TODO Add some assertions on memory bounds, contents, etc
-// init_contents can be used to restore saved state
-Raquette::Raquette(uint8_t *init_contents, int len_contents) {
+// Check loaded afterwards, a machine whose ROM or disk failed to load should not be run
+Raquette::Raquette(const Config &config) : nullLog(nullptr) {
 	unsigned tmp; // For intermediate values below
 	int eff_addr = 0; // Effective address of interrupt vector
 	width_bytes = 1;
@@ -130,17 +172,48 @@ Raquette::Raquette(uint8_t *init_contents, int len_contents) {
 	delete [] regs;
 	delete [] memory;
 	regs = new uint8_t[(width_bytes) * (num_regs)];
-	memory = new uint8_t[(width_bytes) * (num_words)];
+	// Mapped rather than allocated, so pages that are never written cost nothing (see mapFileHelper())
+	memory = (uint8_t *)mmap(nullptr, num_words, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(memory != MAP_FAILED);
 	pc = 0;
 
-	// 7 processor flags
-	flag_c = false;
-	flag_z = false;
-	flag_i = false;
-	flag_d = false;
-	flag_b = false;
-	flag_v = false;
-	flag_n = false;
+	log = config.log ? config.log : &nullLog;
+	loaded = true;
+	cycles = 0;
+	overshoot = 0;
+	instructions = 0;
+	traceHead = 0;
+	traceTail = 0;
+	traceWriter = nullptr;
+	tracing = false;
+	profiling = false;
+	useBlockCache = true; // test_raq_blocks() reports how much faster than the interpreter it is
+	std::fill(blockIndex, blockIndex+256, nullptr);
+	blockCount = 0;
+	blockEpoch = 0;
+	useIdleSkip = true;
+	useJit = false;
+	jit = nullptr;
+	aheadState = nullptr;
+	idle = false;
+	idleSkipped = 0;
+	frames = 0;
+	repeatHeld = false;
+	blockStop = false;
+	runLimit = 0;
+	irqLines = 0;
+	nmiPending = false;
+	inputStart = 0;
+	recordingInput = false;
+	replayingInput = false;
+	replaySession = false;
+	replayPos = 0;
+	for(int page=0; page<0x100; page++){
+		codeOverlaid[page] = false;
+	}
+
+	// Processor status, all flags clear
+	setStatus(FLAG_U);
 
 	// Zero regs
 	for (int i=0; i < (num_regs * width_bytes); i++) {
@@ -150,322 +223,370 @@ Raquette::Raquette(uint8_t *init_contents, int len_contents) {
 	// RAQ_STACK should be FF for 01FF stack base (and it decrements)
 	RAQ_STACK = 0xFF;
 
-	//  Zero all mem to start with
-	// Note that this include the reset vector
-	for(int i=0; i < (width_bytes * num_words); i++){
-		memory[i] = uint8_t(0);
-	}
+	// Memory starts out zero, including the reset vector, as fresh anonymous pages read as zero
 
-	if (init_contents) {
-		std::cout << "Restoring memory contents\n";
+	if (config.image) {
+		*log << "Restoring memory contents\n";
 		// TODO replace with improved helper that supports load to any location
-		for(int i=0; i < len_contents; i++){
-			memory[i] = init_contents[i];
+		for(int i=0; i < config.imageLen; i++){
+			memory[i] = config.image[i];
 		}
 	}else{
-		std::ifstream infile("../software/raquette/rom/raq_rom.bin", std::ios::binary | std::ios::in);
-//		std::ifstream infile("../software/raquette/rom/A2ROM.BIN", std::ios::binary | std::ios::in);
-//		std::ifstream infile("../software/raquette/rom/APPLE2.ROM", std::ios::binary | std::ios::in);
+		std::ifstream infile(config.romFile, std::ios::binary | std::ios::in);
 		if(!infile){
-			std::cout << "Cannot open ROM file\n";
-			exit(0);
-		}
-		//get length of file
-		infile.seekg(0, std::ios::end);
-		size_t length = infile.tellg();
-		infile.seekg(0, std::ios::beg);
-
-		char * buffer = new char[length];
-		std::cout << "Opened ROM file of length " << length << std::endl;
-		infile.read(buffer, length);
-
-		// ROM goes at end of mem
-		for (unsigned i=0; i < length; i++) {
-			memory[1+i+(0xFFFF-length)] = buffer[i];
+			*log << "Cannot open ROM file " << config.romFile << std::endl;
+			loaded = false;
+		}else{
+			//get length of file
+			infile.seekg(0, std::ios::end);
+			size_t length = infile.tellg();
+			infile.seekg(0, std::ios::beg);
+
+			*log << "Opened ROM file of length " << length << std::endl;
+			if(length > 0x10000 - ROM_LO){
+				*log << "ROM file is larger than the " << (0x10000 - ROM_LO) << " bytes above the I/O page\n";
+				loaded = false;
+				length = 0;
+			}
+			// ROM goes at end of mem
+			// A ROM of whole host pages is mapped from its file, so every machine shares one copy
+			if((length % sysconf(_SC_PAGESIZE)) || !mapFileHelper(&memory[0x10000-length], config.romFile, length)){
+				char * buffer = new char[length];
+				infile.read(buffer, length);
+				for (unsigned i=0; i < length; i++) {
+					memory[1+i+(0xFFFF-length)] = buffer[i];
+				}
+				delete [] buffer;
+			}
 		}
-		delete [] buffer;
 	}
+	if(!config.diskFile.empty() && !disk.load(config.diskFile, *log)){
+		loaded = false;
+	}
+
+	mapMemory();
 
-	// TODO Add way of restoring reg states from saved snapshot
+	// Saved machines are restored over a fresh one with loadState()
 	// Now initialize PC by reading reset vector from FFFC-FFFD
 	tmp = memory[0xFFFD]; // tmp is an unsigned int with room for shifts
 	eff_addr = (tmp << 8) + memory[0xFFFC];
 	pc = eff_addr;
 
-	// Totally clear display
-	for(int i=0; i<192; i++){
-		for(int j=0; j<280; j++){
-			dispBuf[i][j] = 0;
+	dispBuf = nullptr; // Machines that are never shown never need it
+	screen_update = true; // Force rendering first iteration
+	displayDirty = false;
+	flashShown = false;
+	for(int row=0; row<24; row++){
+		for(int col=0; col<40; col++){
+			cellDirty[row][col] = false;
 		}
 	}
-	screen_update = true; // Force rendering first iteration
+	for(int line=0; line<192; line++){
+		lineDirty[line] = false;
+	}
 	graphics_mode = false; // Start in text mode
 	full_screen = true; // Default to full screen mode
 	page_two = false; // Default to page 1
 	hi_res = false; // Default to low res
+
+	schedule(EV_VBL, FRAME_CYCLES);
 }
 
-// Takes the current byte with the opcode part masked out
-// Determines the addressing mode
+Raquette::~Raquette() {
+	stopTrace();
+	delete jit;
+	for(Block *blocks : blockIndex){
+		delete [] blocks;
+	}
+	delete aheadState;
+	delete [] dispBuf;
+	munmap(memory, num_words);
+	memory = nullptr; // So ~Computer() does not free it again
+}
+
+// Resolves the operand of the instruction at pc for the given addressing mode
 // Returns a tuple of:
-//     The effective address of the current instruction
-//     The amount to increase pc
-std::tuple<int, int> Raquette::aModeHelper(uint8_t thisbyte) {
-	uint8_t amode = (thisbyte & ~RAQ_MASK_OPC); // Zero-mask opcode bits
-	int opbytes = 0; // Remember how much to increase PC
+//     The effective address of the current instruction (branch/jump target for REL and IND)
+//     Whether indexing crossed a page boundary
+std::tuple<int, bool> Raquette::aModeHelper(uint8_t amode) {
 	int eff_addr = 0; // Effective address of current instruction
+	bool crossed = false; // Set if an index carried into the high byte
 	unsigned tmp, tmp2; // For intermediate values below
 
 	switch (amode){
-		case uint8_t(0b00001000): // 08 Immediate
+		case AM_IMP: // Implied, no operand
+		case AM_ACC: // Accumulator, no operand
+			break;
+
+		case AM_IMM: // Immediate
 			// The next byte is the operand
-			assert(pc+1 <= 0xFFFF);
-			eff_addr = pc+1;
-			assert(eff_addr <= 0xFFFF);
-			opbytes = 2;
+			eff_addr = (pc+1) & 0xFFFF;
 			break;
 
-		case uint8_t(0b00000100): // 04 Zero page
+		case AM_ZP: // Zero page
 			// The next byte is an address. Prepend it with 00.
-			assert(pc+1 <= 0xFFFF);
-			eff_addr = memory[pc+1];
-			assert(eff_addr <= 0xFF);
-			opbytes = 2;
+			eff_addr = memory[(pc+1) & 0xFFFF];
 			break;
 
-		case uint8_t(0b00010100): // 14 Zero page, X
+		case AM_ZPX: // Zero page, X
 			// The next byte is an address. Prepend it with 00 and add the contents of the X register to it.
-			assert(pc+1 <= 0xFFFF);
-			eff_addr = ((memory[pc+1] + RAQ_X) & 0xFF); // Wrap around if sum of base and reg exceeds 0xFF
-			assert(eff_addr <= 0xFF);
-			opbytes = 2;
+			eff_addr = ((memory[(pc+1) & 0xFFFF] + RAQ_X) & 0xFF); // Wrap around if sum of base and reg exceeds 0xFF
+			break;
+
+		case AM_ZPY: // Zero page, Y
+			// The next byte is an address. Prepend it with 00 and add the contents of the Y register to it.
+			eff_addr = ((memory[(pc+1) & 0xFFFF] + RAQ_Y) & 0xFF); // Wrap around if sum of base and reg exceeds 0xFF
 			break;
 
-		case uint8_t(0b00001100): // 0C Absolute
+		case AM_ABS: // Absolute
 			// The next two bytes specify a little endian address.
-			assert(pc+2 <= 0xFFFF);
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			assert(eff_addr <= 0xFFFF);
-			opbytes = 3;
+			tmp = memory[(pc+2) & 0xFFFF]; // tmp is an unsigned int with room for shifts
+			eff_addr = (tmp << 8) + memory[(pc+1) & 0xFFFF];
 			break;
 
-		case uint8_t(0b00011100): // 1C Absolute, X
-			assert(pc+2 <= 0xFFFF);
+		case AM_ABSX: // Absolute, X
 			// The next two bytes specify an address. Add the contents of the X register to it. (Little Endian!)
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1] + RAQ_X;
-			assert(eff_addr <= 0xFFFF);
-			opbytes = 3;
+			tmp = memory[(pc+2) & 0xFFFF]; // tmp is an unsigned int with room for shifts
+			tmp2 = memory[(pc+1) & 0xFFFF] + RAQ_X;
+			crossed = (tmp2 > 0xFF);
+			eff_addr = ((tmp << 8) + tmp2) & 0xFFFF;
 			break;
 
-		case uint8_t(0b00011000): // 18 Absolute, Y
-			assert(pc+2 <= 0xFFFF);
+		case AM_ABSY: // Absolute, Y
 			// The next two bytes specify an address. Add the contents of the Y register to it. (Little Endian!)
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1] + RAQ_Y;
-			assert(eff_addr <= 0xFFFF);
-			opbytes = 3;
+			tmp = memory[(pc+2) & 0xFFFF]; // tmp is an unsigned int with room for shifts
+			tmp2 = memory[(pc+1) & 0xFFFF] + RAQ_Y;
+			crossed = (tmp2 > 0xFF);
+			eff_addr = ((tmp << 8) + tmp2) & 0xFFFF;
 			break;
 
-		case uint8_t(0b00000000): // 00 (Indirect, X)
-			assert(pc+1 <= 0xFFFF);
+		case AM_IND: // (Indirect), only used by JMP
+			// The next two bytes specify a little endian address containing a little endian address
+			tmp = memory[(pc+2) & 0xFFFF]; // tmp is an unsigned int with room for shifts
+			tmp2 = (tmp << 8) + memory[(pc+1) & 0xFFFF];
+			tmp = memory[(tmp2+1) & 0xFFFF]; // MSB of target
+			eff_addr = (tmp << 8) + memory[tmp2]; // Plus LSB of target
+			break;
+
+		case AM_INDX: // (Indirect, X)
 			// The next byte is an address. Prepend it with 00, add the contents of X to it, and get the two-byte address from that memory location.
-			tmp = ((memory[pc+1] + RAQ_X) & 0xFF); // First address
-			tmp2 = memory[tmp+1]; // MSB of second address
+			tmp = ((memory[(pc+1) & 0xFFFF] + RAQ_X) & 0xFF); // First address
+			tmp2 = memory[(tmp+1) & 0xFF]; // MSB of second address, wrapping within zero page
 			eff_addr = (tmp2 << 8) + memory[tmp]; // Plus LSB of second address
-			assert(eff_addr <= 0xFFFF);
-			opbytes = 2;
 			break;
 
-		case uint8_t(0b00010000): // 10 (Indirect), Y
-			assert(pc+1 <= 0xFFFF);
+		case AM_INDY: // (Indirect), Y
 			// The next byte is an address. Prepend it with 00, get the two-byte address from that memory location, and add the contents of Y to it.
-			tmp = memory[pc+1]; // tmp is addr of 2-byte addr
-			assert(tmp+1 <= 0xFFFF);
-			tmp2 = memory[tmp+1]; // MSB
-			eff_addr = (tmp2 << 8) + memory[tmp]; // Add LSB for full two-byte address
-			eff_addr += RAQ_Y; // Add Y
-			assert(eff_addr <= 0xFFFF);
-			opbytes = 2;
+			tmp = memory[(pc+1) & 0xFFFF]; // tmp is addr of 2-byte addr
+			tmp2 = memory[(tmp+1) & 0xFF]; // MSB, wrapping within zero page
+			tmp = memory[tmp] + RAQ_Y; // LSB plus Y
+			crossed = (tmp > 0xFF);
+			eff_addr = ((tmp2 << 8) + tmp) & 0xFFFF;
+			break;
+
+		case AM_REL: // Relative, only used by branches
+			// The next byte is a signed offset from the following instruction
+			// Page crossing only costs a cycle when taken, so branchHelper() accounts for it
+			eff_addr = (pc + 2 + int8_t(memory[(pc+1) & 0xFFFF])) & 0xFFFF;
 			break;
 
 		default: // Literally impossible
 			assert(0);
 			break;
 	}
-	return std::make_tuple(eff_addr, opbytes);
-}
-
-// Uses opcode to determine cycles needed for instruction
-// Does not account for page boundary crossings.
-// Do that in step() for each instruction.
-uint8_t Raquette::cycleCountHelper(uint8_t opcode) {
-/*
-*/
-	switch(opcode){
-		case 0xEA: // NOP
-		case 0xAA: // TAX
-		case 0x8A: // TXA
-		case 0xCA: // DEX
-		case 0xE8: // INX
-		case 0xA8: // TAY
-		case 0x98: // TYA
-		case 0x88: // DEY
-		case 0xC8: // INY
-		case 0x18: // CLC
-		case 0x38: // SEC
-		case 0x58: // CLI
-		case 0x78: // SEI
-		case 0xB8: // CLV
-		case 0xD8: // CLD
-		case 0xF8: // SED
-		case 0x69: // ADC IMM
-		case 0x29: // AND IMM
-		case 0xC9: // CMP IMM
-		case 0xE0: // CPX IMM
-		case 0xC0: // CPY IMM
-		case 0x49: // EOR IMM
-		case 0xA9: // LDA IMM
-		case 0xA2: // LDX IMM
-		case 0xA0: // LDY IMM
-		case 0x09: // ORA IMM
-		case 0xE9: // SBC IMM
-		case 0x4A: // LSR ACC
-		case 0x2A: // ROL ACC
-		case 0x6A: // ROR ACC
-		case 0x10: // BPL (2 cycles if not taken)
-		case 0x30: // BMI (2 cycles if not taken)
-		case 0x50: // BVC (2 cycles if not taken) // FIXME some sources say always 3 cycles for BVC
-		case 0x70: // BVS (2 cycles if not taken)
-		case 0x90: // BCC (2 cycles if not taken)
-		case 0xB0: // BCS (2 cycles if not taken)
-		case 0xD0: // BNE (2 cycles if not taken)
-		case 0xF0: // BEQ (2 cycles if not taken)
-		case 0x0A: // ASL A // TODO Not totally sure on this one
-		case 0x9A: // TXS   // TODO Not totally sure on this one
-		case 0xBA: // TSX   // TODO Not totally sure on this one
-			return 2;
-		case 0x65: // ADC ZP
-		case 0x25: // AND ZP
-		case 0x24: // BIT ZP
-		case 0xC5: // CMP ZP
-		case 0xE4: // CPX ZP
-		case 0xC4: // CPY ZP
-		case 0x45: // EOR ZP
-		case 0xA5: // LDA ZP
-		case 0xA6: // LDX ZP
-		case 0xA4: // LDY ZP
-		case 0x05: // ORA ZP
-		case 0xE5: // SBC ZP
-		case 0x85: // STA ZP
-		case 0x86: // STX ZP
-		case 0x84: // STY ZP
-		case 0x4C: // JMP ABS
-		case 0x48: // PHA // TODO Not totally sure on this one
-		case 0x68: // PLA // TODO Not totally sure on this one
-		case 0x08: // PHP // TODO Not totally sure on this one
-			return 3;
-		case 0x75: // ADC ZP,X
-		case 0x6D: // ADC ABS
-		case 0x7D: // ADC ,X
-		case 0x79: // ADC ,Y
-		case 0x35: // AND ZP,X
-		case 0x2D: // AND ABS
-		case 0x3D: // AND ,X
-		case 0x39: // AND ,Y
-		case 0x2C: // BIT ABS
-		case 0xD5: // CMP ZP,X
-		case 0xCD: // CMP ABS
-		case 0xDD: // CMP ,X
-		case 0xD9: // CMP ,Y
-		case 0xEC: // CPX ABS
-		case 0xCC: // CPY ABS
-		case 0x55: // EOR ZP,X
-		case 0x4D: // EOR ABS
-		case 0x5D: // EOR ,X
-		case 0x59: // EOR ,Y
-		case 0xB5: // LDA ZP,X
-		case 0xAD: // LDA ABS
-		case 0xBD: // LDA ,X
-		case 0xB9: // LDA ,Y
-		case 0xB6: // LDX ZP,Y
-		case 0xAE: // LDX ABS
-		case 0xBE: // LDX ,Y
-		case 0xB4: // LDY ZP,X
-		case 0xAC: // LDY ABS
-		case 0xBC: // LDY ,X
-		case 0x15: // ORA ZP,X
-		case 0x0D: // ORA ABS
-		case 0x1D: // ORA ,X
-		case 0x19: // ORA ,Y
-		case 0xF5: // SBC ZP,X
-		case 0xED: // SBC ABS
-		case 0xFD: // SBC ,X
-		case 0xF9: // SBC ,Y
-		case 0x95: // STA ZP,X
-		case 0x8D: // STA ABS
-		case 0x96: // STX, ZP,Y
-		case 0x8E: // STX, ABS
-		case 0x94: // STY ZP,X
-		case 0x8C: // STY ABS
-		case 0x28: // PLP // TODO not totally sure about this one
-			return 4;
-		case 0x06: // ASL ZP
-		case 0xC6: // DEC ZP
-		case 0xE6: // INC ZP
-		case 0x46: // LSR ZP
-		case 0x26: // ROL ZP
-		case 0x66: // ROR ZP
-		case 0x9D: // STA ,X
-		case 0x99: // STA ,Y
-		case 0x6C: // JMP IND
-		case 0x71: // ADC IND,Y
-		case 0x31: // AND IND,Y
-		case 0xD1: // CMP IND,Y
-		case 0x51: // EOR IND,Y
-		case 0xB1: // LDA IND,Y
-		case 0x11: // ORA IND,Y
-		case 0xF1: // SBC IND,Y
-			return 5;
-		case 0x40: // RTI IMP
-		case 0x60: // RTS IMP
-		case 0x16: // ASL ZP,X
-		case 0xD6: // DEC ZP,X
-		case 0xF6: // INC ZP,X
-		case 0x56: // LSR ZP,X
-		case 0x36: // ROL ZP,X
-		case 0x76: // ROR ZP,X
-		case 0x0E: // ASL ABS
-		case 0xCE: // DEC ABS
-		case 0xEE: // INC ABS
-		case 0x20: // JSR ABS
-		case 0x4E: // LSR ABS
-		case 0x2E: // ROL ABS
-		case 0x6E: // ROR ABS
-		case 0x61: // ADC IND,X
-		case 0x21: // AND IND,X
-		case 0xC1: // CMP IND,X
-		case 0x41: // EOR IND,X
-		case 0xA1: // LDA IND,X
-		case 0x01: // ORA IND,X
-		case 0xE1: // SBC IND,X
-		case 0x81: // STA IND,X
-		case 0x91: // STA IND,Y
-			return 6;
-		case 0x00: // BRK
-		case 0x1E: // ASL ABS,X
-		case 0xDE: // DEC ABS,X
-		case 0xFE: // INC ABS,X
-		case 0x5E: // LSR ABS,X
-		case 0x3E: // ROL ABS,X
-		case 0x7E: // ROR ABS,X
-			return 7;
-		default:
-			return 0;
+	return std::make_tuple(eff_addr, crossed);
+}
+
+// Builds the opcode descriptor table at compile time.
+// Cycle counts are for the NMOS 6502. Branches take one more cycle when taken,
+// and pagePenalty marks the instructions that take one more when indexing crosses a page.
+// Opcodes not listed here are left as "???" with no handler, which step() treats as invalid.
+static constexpr std::array<Raquette::OpInfo, 256> buildOpTable(){
+	std::array<Raquette::OpInfo, 256> t{};
+	for (auto &op : t){
+		op = {"???", Raquette::AM_IMP, 1, 0, 0, nullptr};
 	}
+
+	// Loads
+	t[0xA9] = {"LDA", Raquette::AM_IMM,  2, 2, 0, &Raquette::opLDA};
+	t[0xA5] = {"LDA", Raquette::AM_ZP,   2, 3, 0, &Raquette::opLDA};
+	t[0xB5] = {"LDA", Raquette::AM_ZPX,  2, 4, 0, &Raquette::opLDA};
+	t[0xAD] = {"LDA", Raquette::AM_ABS,  3, 4, 0, &Raquette::opLDA};
+	t[0xBD] = {"LDA", Raquette::AM_ABSX, 3, 4, 1, &Raquette::opLDA};
+	t[0xB9] = {"LDA", Raquette::AM_ABSY, 3, 4, 1, &Raquette::opLDA};
+	t[0xA1] = {"LDA", Raquette::AM_INDX, 2, 6, 0, &Raquette::opLDA};
+	t[0xB1] = {"LDA", Raquette::AM_INDY, 2, 5, 1, &Raquette::opLDA};
+	t[0xA2] = {"LDX", Raquette::AM_IMM,  2, 2, 0, &Raquette::opLDX};
+	t[0xA6] = {"LDX", Raquette::AM_ZP,   2, 3, 0, &Raquette::opLDX};
+	t[0xB6] = {"LDX", Raquette::AM_ZPY,  2, 4, 0, &Raquette::opLDX};
+	t[0xAE] = {"LDX", Raquette::AM_ABS,  3, 4, 0, &Raquette::opLDX};
+	t[0xBE] = {"LDX", Raquette::AM_ABSY, 3, 4, 1, &Raquette::opLDX};
+	t[0xA0] = {"LDY", Raquette::AM_IMM,  2, 2, 0, &Raquette::opLDY};
+	t[0xA4] = {"LDY", Raquette::AM_ZP,   2, 3, 0, &Raquette::opLDY};
+	t[0xB4] = {"LDY", Raquette::AM_ZPX,  2, 4, 0, &Raquette::opLDY};
+	t[0xAC] = {"LDY", Raquette::AM_ABS,  3, 4, 0, &Raquette::opLDY};
+	t[0xBC] = {"LDY", Raquette::AM_ABSX, 3, 4, 1, &Raquette::opLDY};
+
+	// Stores
+	t[0x85] = {"STA", Raquette::AM_ZP,   2, 3, 0, &Raquette::opSTA};
+	t[0x95] = {"STA", Raquette::AM_ZPX,  2, 4, 0, &Raquette::opSTA};
+	t[0x8D] = {"STA", Raquette::AM_ABS,  3, 4, 0, &Raquette::opSTA};
+	t[0x9D] = {"STA", Raquette::AM_ABSX, 3, 5, 0, &Raquette::opSTA};
+	t[0x99] = {"STA", Raquette::AM_ABSY, 3, 5, 0, &Raquette::opSTA};
+	t[0x81] = {"STA", Raquette::AM_INDX, 2, 6, 0, &Raquette::opSTA};
+	t[0x91] = {"STA", Raquette::AM_INDY, 2, 6, 0, &Raquette::opSTA};
+	t[0x86] = {"STX", Raquette::AM_ZP,   2, 3, 0, &Raquette::opSTX};
+	t[0x96] = {"STX", Raquette::AM_ZPY,  2, 4, 0, &Raquette::opSTX};
+	t[0x8E] = {"STX", Raquette::AM_ABS,  3, 4, 0, &Raquette::opSTX};
+	t[0x84] = {"STY", Raquette::AM_ZP,   2, 3, 0, &Raquette::opSTY};
+	t[0x94] = {"STY", Raquette::AM_ZPX,  2, 4, 0, &Raquette::opSTY};
+	t[0x8C] = {"STY", Raquette::AM_ABS,  3, 4, 0, &Raquette::opSTY};
+
+	// Register transfers
+	t[0xAA] = {"TAX", Raquette::AM_IMP,  1, 2, 0, &Raquette::opTAX};
+	t[0xA8] = {"TAY", Raquette::AM_IMP,  1, 2, 0, &Raquette::opTAY};
+	t[0x8A] = {"TXA", Raquette::AM_IMP,  1, 2, 0, &Raquette::opTXA};
+	t[0x98] = {"TYA", Raquette::AM_IMP,  1, 2, 0, &Raquette::opTYA};
+	t[0x9A] = {"TXS", Raquette::AM_IMP,  1, 2, 0, &Raquette::opTXS};
+	t[0xBA] = {"TSX", Raquette::AM_IMP,  1, 2, 0, &Raquette::opTSX};
+
+	// Stack
+	t[0x48] = {"PHA", Raquette::AM_IMP,  1, 3, 0, &Raquette::opPHA};
+	t[0x08] = {"PHP", Raquette::AM_IMP,  1, 3, 0, &Raquette::opPHP};
+	t[0x68] = {"PLA", Raquette::AM_IMP,  1, 4, 0, &Raquette::opPLA};
+	t[0x28] = {"PLP", Raquette::AM_IMP,  1, 4, 0, &Raquette::opPLP};
+
+	// Increments and decrements
+	t[0xE6] = {"INC", Raquette::AM_ZP,   2, 5, 0, &Raquette::opINC};
+	t[0xF6] = {"INC", Raquette::AM_ZPX,  2, 6, 0, &Raquette::opINC};
+	t[0xEE] = {"INC", Raquette::AM_ABS,  3, 6, 0, &Raquette::opINC};
+	t[0xFE] = {"INC", Raquette::AM_ABSX, 3, 7, 0, &Raquette::opINC};
+	t[0xC6] = {"DEC", Raquette::AM_ZP,   2, 5, 0, &Raquette::opDEC};
+	t[0xD6] = {"DEC", Raquette::AM_ZPX,  2, 6, 0, &Raquette::opDEC};
+	t[0xCE] = {"DEC", Raquette::AM_ABS,  3, 6, 0, &Raquette::opDEC};
+	t[0xDE] = {"DEC", Raquette::AM_ABSX, 3, 7, 0, &Raquette::opDEC};
+	t[0xE8] = {"INX", Raquette::AM_IMP,  1, 2, 0, &Raquette::opINX};
+	t[0xC8] = {"INY", Raquette::AM_IMP,  1, 2, 0, &Raquette::opINY};
+	t[0xCA] = {"DEX", Raquette::AM_IMP,  1, 2, 0, &Raquette::opDEX};
+	t[0x88] = {"DEY", Raquette::AM_IMP,  1, 2, 0, &Raquette::opDEY};
+
+	// Arithmetic
+	t[0x69] = {"ADC", Raquette::AM_IMM,  2, 2, 0, &Raquette::opADC};
+	t[0x65] = {"ADC", Raquette::AM_ZP,   2, 3, 0, &Raquette::opADC};
+	t[0x75] = {"ADC", Raquette::AM_ZPX,  2, 4, 0, &Raquette::opADC};
+	t[0x6D] = {"ADC", Raquette::AM_ABS,  3, 4, 0, &Raquette::opADC};
+	t[0x7D] = {"ADC", Raquette::AM_ABSX, 3, 4, 1, &Raquette::opADC};
+	t[0x79] = {"ADC", Raquette::AM_ABSY, 3, 4, 1, &Raquette::opADC};
+	t[0x61] = {"ADC", Raquette::AM_INDX, 2, 6, 0, &Raquette::opADC};
+	t[0x71] = {"ADC", Raquette::AM_INDY, 2, 5, 1, &Raquette::opADC};
+	t[0xE9] = {"SBC", Raquette::AM_IMM,  2, 2, 0, &Raquette::opSBC};
+	t[0xE5] = {"SBC", Raquette::AM_ZP,   2, 3, 0, &Raquette::opSBC};
+	t[0xF5] = {"SBC", Raquette::AM_ZPX,  2, 4, 0, &Raquette::opSBC};
+	t[0xED] = {"SBC", Raquette::AM_ABS,  3, 4, 0, &Raquette::opSBC};
+	t[0xFD] = {"SBC", Raquette::AM_ABSX, 3, 4, 1, &Raquette::opSBC};
+	t[0xF9] = {"SBC", Raquette::AM_ABSY, 3, 4, 1, &Raquette::opSBC};
+	t[0xE1] = {"SBC", Raquette::AM_INDX, 2, 6, 0, &Raquette::opSBC};
+	t[0xF1] = {"SBC", Raquette::AM_INDY, 2, 5, 1, &Raquette::opSBC};
+
+	// Comparisons
+	t[0xC9] = {"CMP", Raquette::AM_IMM,  2, 2, 0, &Raquette::opCMP};
+	t[0xC5] = {"CMP", Raquette::AM_ZP,   2, 3, 0, &Raquette::opCMP};
+	t[0xD5] = {"CMP", Raquette::AM_ZPX,  2, 4, 0, &Raquette::opCMP};
+	t[0xCD] = {"CMP", Raquette::AM_ABS,  3, 4, 0, &Raquette::opCMP};
+	t[0xDD] = {"CMP", Raquette::AM_ABSX, 3, 4, 1, &Raquette::opCMP};
+	t[0xD9] = {"CMP", Raquette::AM_ABSY, 3, 4, 1, &Raquette::opCMP};
+	t[0xC1] = {"CMP", Raquette::AM_INDX, 2, 6, 0, &Raquette::opCMP};
+	t[0xD1] = {"CMP", Raquette::AM_INDY, 2, 5, 1, &Raquette::opCMP};
+	t[0xE0] = {"CPX", Raquette::AM_IMM,  2, 2, 0, &Raquette::opCPX};
+	t[0xE4] = {"CPX", Raquette::AM_ZP,   2, 3, 0, &Raquette::opCPX};
+	t[0xEC] = {"CPX", Raquette::AM_ABS,  3, 4, 0, &Raquette::opCPX};
+	t[0xC0] = {"CPY", Raquette::AM_IMM,  2, 2, 0, &Raquette::opCPY};
+	t[0xC4] = {"CPY", Raquette::AM_ZP,   2, 3, 0, &Raquette::opCPY};
+	t[0xCC] = {"CPY", Raquette::AM_ABS,  3, 4, 0, &Raquette::opCPY};
+
+	// Logic
+	t[0x29] = {"AND", Raquette::AM_IMM,  2, 2, 0, &Raquette::opAND};
+	t[0x25] = {"AND", Raquette::AM_ZP,   2, 3, 0, &Raquette::opAND};
+	t[0x35] = {"AND", Raquette::AM_ZPX,  2, 4, 0, &Raquette::opAND};
+	t[0x2D] = {"AND", Raquette::AM_ABS,  3, 4, 0, &Raquette::opAND};
+	t[0x3D] = {"AND", Raquette::AM_ABSX, 3, 4, 1, &Raquette::opAND};
+	t[0x39] = {"AND", Raquette::AM_ABSY, 3, 4, 1, &Raquette::opAND};
+	t[0x21] = {"AND", Raquette::AM_INDX, 2, 6, 0, &Raquette::opAND};
+	t[0x31] = {"AND", Raquette::AM_INDY, 2, 5, 1, &Raquette::opAND};
+	t[0x49] = {"EOR", Raquette::AM_IMM,  2, 2, 0, &Raquette::opEOR};
+	t[0x45] = {"EOR", Raquette::AM_ZP,   2, 3, 0, &Raquette::opEOR};
+	t[0x55] = {"EOR", Raquette::AM_ZPX,  2, 4, 0, &Raquette::opEOR};
+	t[0x4D] = {"EOR", Raquette::AM_ABS,  3, 4, 0, &Raquette::opEOR};
+	t[0x5D] = {"EOR", Raquette::AM_ABSX, 3, 4, 1, &Raquette::opEOR};
+	t[0x59] = {"EOR", Raquette::AM_ABSY, 3, 4, 1, &Raquette::opEOR};
+	t[0x41] = {"EOR", Raquette::AM_INDX, 2, 6, 0, &Raquette::opEOR};
+	t[0x51] = {"EOR", Raquette::AM_INDY, 2, 5, 1, &Raquette::opEOR};
+	t[0x09] = {"ORA", Raquette::AM_IMM,  2, 2, 0, &Raquette::opORA};
+	t[0x05] = {"ORA", Raquette::AM_ZP,   2, 3, 0, &Raquette::opORA};
+	t[0x15] = {"ORA", Raquette::AM_ZPX,  2, 4, 0, &Raquette::opORA};
+	t[0x0D] = {"ORA", Raquette::AM_ABS,  3, 4, 0, &Raquette::opORA};
+	t[0x1D] = {"ORA", Raquette::AM_ABSX, 3, 4, 1, &Raquette::opORA};
+	t[0x19] = {"ORA", Raquette::AM_ABSY, 3, 4, 1, &Raquette::opORA};
+	t[0x01] = {"ORA", Raquette::AM_INDX, 2, 6, 0, &Raquette::opORA};
+	t[0x11] = {"ORA", Raquette::AM_INDY, 2, 5, 1, &Raquette::opORA};
+	t[0x24] = {"BIT", Raquette::AM_ZP,   2, 3, 0, &Raquette::opBIT};
+	t[0x2C] = {"BIT", Raquette::AM_ABS,  3, 4, 0, &Raquette::opBIT};
+
+	// Shifts and rotates
+	t[0x0A] = {"ASL", Raquette::AM_ACC,  1, 2, 0, &Raquette::opASLA};
+	t[0x06] = {"ASL", Raquette::AM_ZP,   2, 5, 0, &Raquette::opASL};
+	t[0x16] = {"ASL", Raquette::AM_ZPX,  2, 6, 0, &Raquette::opASL};
+	t[0x0E] = {"ASL", Raquette::AM_ABS,  3, 6, 0, &Raquette::opASL};
+	t[0x1E] = {"ASL", Raquette::AM_ABSX, 3, 7, 0, &Raquette::opASL};
+	t[0x4A] = {"LSR", Raquette::AM_ACC,  1, 2, 0, &Raquette::opLSRA};
+	t[0x46] = {"LSR", Raquette::AM_ZP,   2, 5, 0, &Raquette::opLSR};
+	t[0x56] = {"LSR", Raquette::AM_ZPX,  2, 6, 0, &Raquette::opLSR};
+	t[0x4E] = {"LSR", Raquette::AM_ABS,  3, 6, 0, &Raquette::opLSR};
+	t[0x5E] = {"LSR", Raquette::AM_ABSX, 3, 7, 0, &Raquette::opLSR};
+	t[0x2A] = {"ROL", Raquette::AM_ACC,  1, 2, 0, &Raquette::opROLA};
+	t[0x26] = {"ROL", Raquette::AM_ZP,   2, 5, 0, &Raquette::opROL};
+	t[0x36] = {"ROL", Raquette::AM_ZPX,  2, 6, 0, &Raquette::opROL};
+	t[0x2E] = {"ROL", Raquette::AM_ABS,  3, 6, 0, &Raquette::opROL};
+	t[0x3E] = {"ROL", Raquette::AM_ABSX, 3, 7, 0, &Raquette::opROL};
+	t[0x6A] = {"ROR", Raquette::AM_ACC,  1, 2, 0, &Raquette::opRORA};
+	t[0x66] = {"ROR", Raquette::AM_ZP,   2, 5, 0, &Raquette::opROR};
+	t[0x76] = {"ROR", Raquette::AM_ZPX,  2, 6, 0, &Raquette::opROR};
+	t[0x6E] = {"ROR", Raquette::AM_ABS,  3, 6, 0, &Raquette::opROR};
+	t[0x7E] = {"ROR", Raquette::AM_ABSX, 3, 7, 0, &Raquette::opROR};
+
+	// Jumps and calls
+	t[0x4C] = {"JMP", Raquette::AM_ABS,  3, 3, 0, &Raquette::opJMP};
+	t[0x6C] = {"JMP", Raquette::AM_IND,  3, 5, 0, &Raquette::opJMP};
+	t[0x20] = {"JSR", Raquette::AM_ABS,  3, 6, 0, &Raquette::opJSR};
+	t[0x60] = {"RTS", Raquette::AM_IMP,  1, 6, 0, &Raquette::opRTS};
+	t[0x00] = {"BRK", Raquette::AM_IMP,  2, 7, 0, &Raquette::opBRK}; // Second byte is ignored
+	t[0x40] = {"RTI", Raquette::AM_IMP,  1, 6, 0, &Raquette::opRTI};
+
+	// Branches (page penalty applies to the destination when taken)
+	t[0x90] = {"BCC", Raquette::AM_REL,  2, 2, 1, &Raquette::opBCC};
+	t[0xB0] = {"BCS", Raquette::AM_REL,  2, 2, 1, &Raquette::opBCS};
+	t[0xF0] = {"BEQ", Raquette::AM_REL,  2, 2, 1, &Raquette::opBEQ};
+	t[0x30] = {"BMI", Raquette::AM_REL,  2, 2, 1, &Raquette::opBMI};
+	t[0xD0] = {"BNE", Raquette::AM_REL,  2, 2, 1, &Raquette::opBNE};
+	t[0x10] = {"BPL", Raquette::AM_REL,  2, 2, 1, &Raquette::opBPL};
+	t[0x50] = {"BVC", Raquette::AM_REL,  2, 2, 1, &Raquette::opBVC};
+	t[0x70] = {"BVS", Raquette::AM_REL,  2, 2, 1, &Raquette::opBVS};
+
+	// Status flag changes
+	t[0x18] = {"CLC", Raquette::AM_IMP,  1, 2, 0, &Raquette::opCLC};
+	t[0x38] = {"SEC", Raquette::AM_IMP,  1, 2, 0, &Raquette::opSEC};
+	t[0x58] = {"CLI", Raquette::AM_IMP,  1, 2, 0, &Raquette::opCLI};
+	t[0x78] = {"SEI", Raquette::AM_IMP,  1, 2, 0, &Raquette::opSEI};
+	t[0xB8] = {"CLV", Raquette::AM_IMP,  1, 2, 0, &Raquette::opCLV};
+	t[0xD8] = {"CLD", Raquette::AM_IMP,  1, 2, 0, &Raquette::opCLD};
+	t[0xF8] = {"SED", Raquette::AM_IMP,  1, 2, 0, &Raquette::opSED};
+
+	t[0xEA] = {"NOP", Raquette::AM_IMP,  1, 2, 0, &Raquette::opNOP};
+	return t;
 }
 
+constexpr std::array<Raquette::OpInfo, 256> Raquette::opTable = buildOpTable();
+
 // Performs common steps of ROL instructions
 uint8_t Raquette::rolHelper(uint8_t byte) {
 	unsigned tmp, tmp2; // For intermediate values below
@@ -473,10 +594,9 @@ uint8_t Raquette::rolHelper(uint8_t byte) {
 	// Rotate tmp left, carry goes into bit 0, bit 7 becomes new carry flag
 	tmp2 = tmp;
 	tmp <<=1;
-	tmp +=(flag_c ? 0x1 : 0x0);
-	flag_c = ((tmp2 & 0b10000000) != 0);
-	flag_n = ((tmp & 0b10000000) != 0);
-	flag_z = (tmp == 0); // Zero flag if zero
+	tmp +=(flagC() ? 0x1 : 0x0);
+	setFlag(FLAG_C, (tmp2 & 0b10000000) != 0);
+	nzResult = uint8_t(tmp); // N and Z flags come from the result
 	return tmp;
 }
 
@@ -487,23 +607,100 @@ uint8_t Raquette::rorHelper(uint8_t byte) {
 	// Rotate tmp right, carry goes into bit 7, bit 0 becomes new carry flag
 	tmp2 = tmp;
 	tmp >>=1;
-	tmp +=(flag_c ? 0b10000000 : 0x0);
-	flag_c = ((tmp2 & 0b00000001) != 0);
-	flag_n = ((tmp & 0b10000000) != 0);
-	flag_z = (tmp == 0); // Zero flag if zero
+	tmp +=(flagC() ? 0b10000000 : 0x0);
+	setFlag(FLAG_C, (tmp2 & 0b00000001) != 0);
+	nzResult = uint8_t(tmp); // N and Z flags come from the result
 	return tmp;
 }
 
 
-// Records display updates to force redraw
-// TODO Partition screen for efficiency
-// TODO consider current mode to avoid useless redraws
-void Raquette::dispHelper(int eff_addr) {
-	if(((eff_addr >= 0x0400) && ( eff_addr <= 0x0BFF)) || ((eff_addr >= 0x2000) && ( eff_addr <= 0x5fff))){
+// Builds the page table for the Raquette memory map
+// RAM and ROM pages are accessed directly through their pointers.
+// Only the I/O page and the display pages trap to a handler.
+// Any cached code is dropped along with the old mapping.
+void Raquette::mapMemory() {
+	flushBlockCache();
+	for(int page=0; page<0x100; page++){
+		uint8_t *base = &memory[page<<8];
+		if(page < (ROM_LO>>8)){
+			// RAM
+			pages[page] = {base, base, nullptr, nullptr};
+		}else if(page == (ROM_LO>>8)){
+			// I/O and soft switches at C0xx
+			pages[page] = {nullptr, nullptr, &Raquette::ioRead, &Raquette::ioWrite};
+		}else{
+			// ROM, writes are ignored
+			pages[page] = {base, nullptr, nullptr, nullptr};
+		}
+	}
+
+	// Text/lo-res pages 1 and 2, then hi-res pages 1 and 2
+	for(int page=0x04; page<0x0C; page++){
+		pages[page].write = nullptr;
+		pages[page].writeHandler = &Raquette::dispWrite;
+	}
+	for(int page=0x20; page<0x60; page++){
+		pages[page].write = nullptr;
+		pages[page].writeHandler = &Raquette::dispWrite;
+	}
+}
+
+// Write handler for display memory, marks the cell or scanline the write changes if it is being shown
+// Text and lo-res bytes are laid out as in renderScreen(): 128 bytes hold three 40 byte rows, 8 rows
+// apart on screen, and the last 8 bytes are not shown. Hi-res repeats that for each of the 8
+// scanlines of a row, 1K apart.
+void Raquette::dispWrite(int eff_addr, uint8_t val) {
+	if(memory[eff_addr] == val) return;
+	memory[eff_addr] = val;
+	if(eff_addr < 0x0C00){
+		if((eff_addr >= 0x0800) != page_two) return;
+		int offset = eff_addr & 0x3FF;
+		int within = offset & 0x7F;
+		if(within >= 120) return;
+		int row = (within/40)*8 + (offset>>7);
+		if(cellRowHelper(row)){
+			cellDirty[row][within%40] = true;
+			displayDirty = true;
+		}
+	}else{
+		if((eff_addr >= 0x4000) != page_two) return;
+		int offset = eff_addr & 0x1FFF;
+		int within = offset & 0x7F;
+		if(within >= 120) return;
+		int row = (within/40)*8 + ((offset>>7) & 7);
+		if(!cellRowHelper(row)){
+			lineDirty[(row*8) + (offset>>10)] = true;
+			displayDirty = true;
+		}
+	}
+}
+
+// True if the given text row shows text or lo-res cells, false if it shows hi-res scanlines
+bool Raquette::cellRowHelper(int row){
+	return !(graphics_mode && hi_res) || (!full_screen && (row > 19));
+}
+
+// Sets a video soft switch, redrawing the whole screen if it changed
+void Raquette::setDisplayHelper(bool &flag, bool val){
+	if(flag != val){
+		flag = val;
 		screen_update = true;
 	}
 }
 
+// Read handler for the I/O page
+uint8_t Raquette::ioRead(int eff_addr) {
+	uint8_t val = memory[eff_addr];
+	softSwitchesHelper(eff_addr);
+	return val;
+}
+
+// Write handler for the I/O page
+// Nothing is stored, but soft switches react to writes as well as reads
+void Raquette::ioWrite(int eff_addr, uint8_t val) {
+	softSwitchesHelper(eff_addr);
+}
+
 // Zero page acceses ignored
 // Branch, Jump ignored
 // pc ignored
@@ -515,59 +712,56 @@ void Raquette::softSwitchesHelper(int eff_addr){
 	}
 	else if(eff_addr == 0xc050){
 		// GR
-		graphics_mode = true;
-		screen_update = true;
+		setDisplayHelper(graphics_mode, true);
 	}else if(eff_addr == 0xc051){
 		// TEXT
-		graphics_mode = false;
-		screen_update = true;
+		setDisplayHelper(graphics_mode, false);
 	}else if(eff_addr == 0xc052){
 		// MIXCLR (full screen)
-		full_screen = true;
+		setDisplayHelper(full_screen, true);
 	}else if(eff_addr == 0xc053){
 		// MIXSET (split screen)
-		full_screen = false;
+		setDisplayHelper(full_screen, false);
 	}else if(eff_addr == 0xc054){
 		// TXTPAGE1
-		page_two = false;
+		setDisplayHelper(page_two, false);
 	}else if(eff_addr == 0xc055){
 		// TXTPAGE2
-		page_two = true;
+		setDisplayHelper(page_two, true);
 	}else if(eff_addr == 0xc056){
 		// LO-RES
-		hi_res = false;
+		setDisplayHelper(hi_res, false);
 	}else if(eff_addr == 0xc057){
 		// HI_RES
-		hi_res = true;
+		setDisplayHelper(hi_res, true);
 	// There are 7 possible slots and the slot determines the address of the soft switches.
 	// C09x thru C0Fx
 	// For now we assume there is one controller in slot 6 only: C0Ex
 	// But looking forward, we want a general way to handle other expansion boards in arbitrary slots.
 	}else if(eff_addr == 0xc0e0){ // Stepper Phase 0 off
-std::cout<<".\n";
 		disk.stepper_p0 = false;
-		disk.stepper();
+		stepperHelper();
 	}else if(eff_addr == 0xc0e1){ // Stepper Phase 0 on
 		disk.stepper_p0 = true;
-		disk.stepper();
+		stepperHelper();
 	}else if(eff_addr == 0xc0e2){ // Stepper Phase 1 off
 		disk.stepper_p1 = false;
-		disk.stepper();
+		stepperHelper();
 	}else if(eff_addr == 0xc0e3){ // Stepper Phase 1 on
 		disk.stepper_p1 = true;
-		disk.stepper();
+		stepperHelper();
 	}else if(eff_addr == 0xc0e4){ // Stepper Phase 2 off
 		disk.stepper_p2 = false;
-		disk.stepper();
+		stepperHelper();
 	}else if(eff_addr == 0xc0e5){ // Stepper Phase 2 on
 		disk.stepper_p2 = true;
-		disk.stepper();
+		stepperHelper();
 	}else if(eff_addr == 0xc0e6){ // Stepper Phase 3 off
 		disk.stepper_p3 = false;
-		disk.stepper();
+		stepperHelper();
 	}else if(eff_addr == 0xc0e7){ // Stepper Phase 3 on
 		disk.stepper_p3 = true;
-		disk.stepper();
+		stepperHelper();
 	}else if(eff_addr == 0xc0e8){ // Disk off
 		disk.spinning = false;
 	}else if(eff_addr == 0xc0e9){ // Disk on
@@ -597,1224 +791,1471 @@ std::cout<<".\n";
 	return;
 }
 
-// Sets new value of pc (without increment by 2)
-void Raquette::branchHelper(){
-	int tmp;
-	if (memory[pc+1]&0b10000000){ // It is negative
-		tmp = pc - (((~memory[pc+1])+1) & 0b11111111);
-		pc = tmp;
-	}else{ // It is positive
-		tmp = pc + (memory[pc+1] & 0b01111111);
-		pc = tmp;
-	}
+// Instruction handlers, dispatched through opTable by step()
+// pc already points at the next instruction when these run.
+// eff_addr is the resolved operand address (or branch/jump target).
+
+void Raquette::opLDA(int eff_addr) {
+	RAQ_ACC = memRead(eff_addr);
+	nzResult = RAQ_ACC; // N and Z flags come from the result
 }
 
-// ISA based on MOS 6502
-// aaabbbcc. The aaa and cc bits determine the opcode, and the bbb bits determine the addressing mode.
-// Instruction format: bits 0-2 and 6-7 determine opcode. bits 3-5 determine addressing mode.
-// Little-endian (least sig byte first)
-// 7 processor flags: flag_c flag_z flag_i flag_d flag_b flag_v flag_n
-int Raquette::step(bool verbose) {
-	assert(pc >= 0);
-	if (pc >= num_words) {
-		if(verbose) std::cout << "PC out of bounds\n";
-		return 1; // Already out of bounds
-	}
+void Raquette::opLDX(int eff_addr) {
+	RAQ_X = memRead(eff_addr);
+	nzResult = RAQ_X; // N and Z flags come from the result
+}
 
-	unsigned tmp, tmp2; // For intermediate values below
-	int eff_addr, opbytes, opcycles;
-	uint8_t thisbyte = memory[pc];
-	uint8_t tmpbyte;
+void Raquette::opLDY(int eff_addr) {
+	RAQ_Y = memRead(eff_addr);
+	nzResult = RAQ_Y; // N and Z flags come from the result
+}
 
-	opcycles = cycleCountHelper(thisbyte);
-	if(opcycles==0){
-		std::cout << "Error: unrecognized opcode: " << std::hex << (unsigned)thisbyte << " at " << pc << std::endl;
-		return 1;
-	}
-	// TODO add 1 if any branch taken
-	// TODO add 1 if page boundary crossed for certain instructions, but not all.
-	// For example some (all?) branch instructions when dest is a different page
-	// Many indexed operations when index crosses a page
-	// May want to write a helper macro diffpage(addr1, addr2)
-
-	opbytes = 0;
-	switch (thisbyte) {
-		case uint8_t(0x00): // BRK
-			if(verbose) std::cout << "BRK\n";
-			flag_b = true;
-
-			// Note: BRK is a 2-byte op with the second byte ignored. Much documentation is incorrect.
-			// Push MSB of PC
-			memory[0x100+RAQ_STACK--] = (((pc+2)>>8) & 0b11111111);
-			// Push LSB of PC
-			memory[0x100+RAQ_STACK--] = ((pc+2) & 0b11111111);
-
-			// Note: flag_b bit pushed is always 1 from BRK or PHP instruction
-			tmp = (flag_n<<7) + (flag_v<<6) + (0x1<<5) + (0x1<<4) + (flag_d<<3) + (flag_i<<2) + (flag_z<<1) + (flag_c);
-			memory[0x100+RAQ_STACK--] = tmp;
-
-			// Set interrupt disable
-			flag_i = true;
-
-			// Load PC from IRQ interrupt vector at 0xFFFE and 0xFFFF
-			tmp = memory[0xFFFF]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[0xFFFE];
-			pc = eff_addr;
-
-			opbytes = 0;
-			break;
+void Raquette::opSTA(int eff_addr) {
+	memWrite(eff_addr, RAQ_ACC);
+}
 
-		case uint8_t(0xEA): // NOP
-			if(verbose) std::cout << "NOP\n";
-			opbytes = 1;
-			break;
+void Raquette::opSTX(int eff_addr) {
+	memWrite(eff_addr, RAQ_X);
+}
 
-		case uint8_t(0xA9): // LDA
-		case uint8_t(0xA5):
-		case uint8_t(0xB5):
-		case uint8_t(0xAD):
-		case uint8_t(0xBD):
-		case uint8_t(0xB9):
-		case uint8_t(0xA1):
-		case uint8_t(0xB1):
-			std::tie(eff_addr, opbytes) = aModeHelper(thisbyte);
-			if(verbose) std::cout << "LDA " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			RAQ_ACC = memory[eff_addr];
-			flag_z = (RAQ_ACC == 0); // Zero flag if zero
-			flag_n = ((RAQ_ACC & 0b10000000) != 0); // Negative flag if sign bit set
-			softSwitchesHelper(eff_addr);
-			break;
+void Raquette::opSTY(int eff_addr) {
+	memWrite(eff_addr, RAQ_Y);
+}
 
-		case uint8_t(0xA2): // LDX Immediate
-			opbytes=2;
-			eff_addr = pc+1;
-			if(verbose) std::cout << "LDX Immediate " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			RAQ_X = memory[eff_addr];
-			flag_z = (RAQ_X == 0); // Zero flag if zero
-			flag_n = ((RAQ_X & 0b10000000) != 0); // Negative flag if sign bit set
-			softSwitchesHelper(eff_addr);
-			break;
+void Raquette::opTAX(int eff_addr) {
+	RAQ_X = RAQ_ACC;
+	nzResult = RAQ_X; // N and Z flags come from the result
+}
 
-		case uint8_t(0xA6): // LDX Zero Page
-			opbytes = 2;
-			// The next byte is an address. Prepend it with 00.
-			eff_addr = memory[pc+1];
-			if(verbose) std::cout << "LDX zero page " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			RAQ_X = memory[eff_addr];
-			flag_z = (RAQ_X == 0); // Zero flag if zero
-			flag_n = ((RAQ_X & 0b10000000) != 0); // Negative flag if sign bit set
-			break;
+void Raquette::opTAY(int eff_addr) {
+	RAQ_Y = RAQ_ACC;
+	nzResult = RAQ_Y; // N and Z flags come from the result
+}
 
-		case uint8_t(0xB6): // LDX Zero Page, Y
-			opbytes = 2;
-			// The next byte is an address. Prepend it with 00 and add Y to it.
-			eff_addr = ((memory[pc+1] + RAQ_Y) & 0xFF); // Wrap around if sum of base and reg exceeds 0xFF
-			if(verbose) std::cout << "LDX zero page, y " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			RAQ_X = memory[eff_addr];
-			flag_z = (RAQ_X == 0); // Zero flag if zero
-			flag_n = ((RAQ_X & 0b10000000) != 0); // Negative flag if sign bit set
-			break;
+void Raquette::opTXA(int eff_addr) {
+	RAQ_ACC = RAQ_X;
+	nzResult = RAQ_ACC; // N and Z flags come from the result
+}
 
-		case uint8_t(0xAE): // LDX Absolute
-			opbytes = 3;
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			if(verbose) std::cout << "LDX Absolute " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			RAQ_X = memory[eff_addr];
-			flag_z = (RAQ_X == 0); // Zero flag if zero
-			flag_n = ((RAQ_X & 0b10000000) != 0); // Negative flag if sign bit set
-			softSwitchesHelper(eff_addr);
-			break;
+void Raquette::opTYA(int eff_addr) {
+	RAQ_ACC = RAQ_Y;
+	nzResult = RAQ_ACC; // N and Z flags come from the result
+}
 
-		case uint8_t(0xBE): // LDX Absolute, Y
-			// TODO check bounds
-			opbytes = 3;
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1] + RAQ_Y;
-			if(verbose) std::cout << "LDX Absolute, Y " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			RAQ_X = memory[eff_addr];
-			flag_z = (RAQ_X == 0); // Zero flag if zero
-			flag_n = ((RAQ_X & 0b10000000) != 0); // Negative flag if sign bit set
-			softSwitchesHelper(eff_addr);
-			break;
+void Raquette::opTXS(int eff_addr) {
+	RAQ_STACK = RAQ_X;
+}
 
-		case uint8_t(0xA0): // LDY Immediate
-			opbytes=2;
-			eff_addr = pc+1;
-			if(verbose) std::cout << "LDY Immediate " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			RAQ_Y = memory[eff_addr];
-			flag_z = (RAQ_Y == 0); // Zero flag if zero
-			flag_n = ((RAQ_Y & 0b10000000) != 0); // Negative flag if sign bit set
-			softSwitchesHelper(eff_addr);
-			break;
+void Raquette::opTSX(int eff_addr) {
+	RAQ_X = RAQ_STACK;
+	nzResult = RAQ_X; // N and Z flags come from the result
+}
 
-		case uint8_t(0xA4): // LDY Zero Page
-			opbytes = 2;
-			// The next byte is an address. Prepend it with 00.
-			eff_addr = memory[pc+1];
-			if(verbose) std::cout << "LDY zero page " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			RAQ_Y = memory[eff_addr];
-			flag_z = (RAQ_Y == 0); // Zero flag if zero
-			flag_n = ((RAQ_Y & 0b10000000) != 0); // Negative flag if sign bit set
-			break;
+void Raquette::opPHA(int eff_addr) {
+	memory[0x100+RAQ_STACK--] = RAQ_ACC;
+}
 
-		case uint8_t(0xB4): // LDY Zero Page, X
-			opbytes = 2;
-			// The next byte is an address. Prepend it with 0 and add X to it.
-			eff_addr = ((memory[pc+1] + RAQ_X) & 0xFF); // Wrap around if sum of base and reg exceeds 0xFF
-			if(verbose) std::cout << "LDY zero page " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			RAQ_Y = memory[eff_addr];
-			flag_z = (RAQ_Y == 0); // Zero flag if zero
-			flag_n = ((RAQ_Y & 0b10000000) != 0); // Negative flag if sign bit set
-			break;
+void Raquette::opPHP(int eff_addr) {
+	// Note: B bit pushed is always 1 from BRK or PHP instruction
+	memory[0x100+RAQ_STACK--] = getStatus() | FLAG_B;
+}
 
-		case uint8_t(0xAC): // LDY Absolute
-			opbytes = 3;
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			if(verbose) std::cout << "LDY Absolute " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			RAQ_Y = memory[eff_addr];
-			flag_z = (RAQ_Y == 0); // Zero flag if zero
-			flag_n = ((RAQ_Y & 0b10000000) != 0); // Negative flag if sign bit set
-			softSwitchesHelper(eff_addr);
-			break;
+void Raquette::opPLA(int eff_addr) {
+	RAQ_STACK += 1;
+	RAQ_ACC = (memory[0x100+RAQ_STACK]);
+	nzResult = RAQ_ACC; // N and Z flags come from the result
+}
 
-		case uint8_t(0xBC): // LDY Absolute, X
-			opbytes = 3;
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1] + RAQ_X;
-			if(verbose) std::cout << "LDY Absolute, X " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			RAQ_Y = memory[eff_addr];
-			flag_z = (RAQ_Y == 0); // Zero flag if zero
-			flag_n = ((RAQ_Y & 0b10000000) != 0); // Negative flag if sign bit set
-			softSwitchesHelper(eff_addr);
-			break;
+void Raquette::opPLP(int eff_addr) {
+	RAQ_STACK += 1;
+	setStatus(memory[0x100+RAQ_STACK]);
+	irqUnmaskHelper();
+}
 
-		case uint8_t(0x86): // STX Zero Page
-			// The next byte is an address. Prepend it with 00.
-			eff_addr = memory[pc+1];
-			memory[eff_addr] = RAQ_X;
-			if(verbose) std::cout << "STX zero page " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			opbytes = 2;
-			break;
+void Raquette::opINC(int eff_addr) {
+	uint8_t tmpbyte = memRead(eff_addr) + 1;
+	nzResult = tmpbyte; // N and Z flags come from the result
+	memWrite(eff_addr, tmpbyte);
+}
 
-		case uint8_t(0x96): // STX Zero Page, Y
-			// The next byte is an address. Prepend it with 00 and add the contents of the Y register to it.
-			eff_addr = ((memory[pc+1] + RAQ_Y) & 0xFF); // Wrap around if sum of base and reg exceeds 0xFF
-			memory[eff_addr] = RAQ_X;
-			if(verbose) std::cout << "STX zero page, Y " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			opbytes = 2;
-			break;
+void Raquette::opDEC(int eff_addr) {
+	uint8_t tmpbyte = memRead(eff_addr) - 1;
+	nzResult = tmpbyte; // N and Z flags come from the result
+	memWrite(eff_addr, tmpbyte);
+}
 
-		case uint8_t(0x8E): // STX Absolute
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = RAQ_X;
-			}
-			softSwitchesHelper(eff_addr);
-			dispHelper(eff_addr);
-			if(verbose) std::cout << "STY Absolute" << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			opbytes = 3;
-			break;
+void Raquette::opINX(int eff_addr) {
+	RAQ_X += 1;
+	nzResult = RAQ_X; // N and Z flags come from the result
+}
 
-		case uint8_t(0x84): // STY Zero Page
-			// The next byte is an address. Prepend it with 00.
-			eff_addr = memory[pc+1];
-			memory[eff_addr] = RAQ_Y;
-			opbytes = 2;
-			if(verbose) std::cout << "STY zero page " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			// No need to check for text/graphics output in zero page
-			break;
+void Raquette::opINY(int eff_addr) {
+	RAQ_Y += 1;
+	nzResult = RAQ_Y; // N and Z flags come from the result
+}
 
-		case uint8_t(0x94): // STY Zero Page, X
-			// The next byte is an address. Prepend it with 00 and add the contents of the X register to it.
-			eff_addr = ((memory[pc+1] + RAQ_X) & 0xFF); // Wrap around if sum of base and reg exceeds 0xFF
-			memory[eff_addr] = RAQ_Y;
-			opbytes = 2;
-			if(verbose) std::cout << "STY zero page, X " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			// No need to check for text/graphics output in zero page
-			break;
+void Raquette::opDEX(int eff_addr) {
+	RAQ_X = RAQ_X - 1;
+	nzResult = RAQ_X; // N and Z flags come from the result
+}
 
-		case uint8_t(0x8C): // STY Absolute
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = RAQ_Y;
-			}
-			softSwitchesHelper(eff_addr);
-			dispHelper(eff_addr);
-			if(verbose) std::cout << "STY Absolute" << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			opbytes = 3;
-			break;
+void Raquette::opDEY(int eff_addr) {
+	RAQ_Y = RAQ_Y - 1;
+	nzResult = RAQ_Y; // N and Z flags come from the result
+}
 
-		case uint8_t(0xAA): // TAX
-			if(verbose) std::cout << "TAX\n";
-			RAQ_X = RAQ_ACC;
-			flag_z = (RAQ_X == 0);
-			flag_n = ((RAQ_X & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 1;
-			break;
+void Raquette::opADC(int eff_addr) {
+	uint8_t operand = memRead(eff_addr);
+	unsigned tmp;
+
+	// Handle decimal mode
+	if(status & FLAG_D) {
+		uint8_t acc_lo = (RAQ_ACC & 0x0F);
+		uint8_t acc_hi = ((RAQ_ACC & 0xF0)>>4);
+		uint8_t op_lo = (operand & 0x0F);
+		uint8_t op_hi = ((operand & 0xF0)>>4);
+		uint8_t res_lo = acc_lo + op_lo + (flagC() ? 1 : 0);
+		uint8_t res_hi = acc_hi + op_hi;
+		bool carry = false;
+
+		if(res_lo > 9){
+			// Carry lo to hi
+			res_lo -= 10;
+			res_hi += 1;
+		}
+		if(res_hi > 9){
+			// Carry out
+			res_hi -= 10;
+			carry = true;
+		}
+		setFlag(FLAG_C, carry);
+		RAQ_ACC = (res_hi<<4) + res_lo;
+		nzResult = RAQ_ACC; // N and Z flags come from the result
+		return;
+	}
+	tmp = RAQ_ACC + operand + (flagC() ? 1 : 0);
+	setFlag(FLAG_C, tmp > 0xFF); // Carry flag
+	setFlag(FLAG_V, ((RAQ_ACC ^ tmp) & (operand ^ tmp) & 0x80) != 0); // Overflow flag if sign bit is incorrect
+	RAQ_ACC = tmp & 0xFF; // Assign final value
+	nzResult = RAQ_ACC; // N and Z flags come from the result
+}
 
-		case uint8_t(0xA8): // TAY
-			if(verbose) std::cout << "TAY\n";
-			RAQ_Y = RAQ_ACC;
-			flag_z = (RAQ_Y == 0);
-			flag_n = ((RAQ_Y & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 1;
-			break;
+void Raquette::opSBC(int eff_addr) {
+	// Note, we assume that carry is set unless the previous SBC needed a borrow
+	uint8_t operand = memRead(eff_addr);
+	unsigned tmp;
+
+	// Handle decimal mode
+	if(status & FLAG_D) {
+		int8_t acc_lo = (RAQ_ACC & 0x0F);
+		int8_t acc_hi = ((RAQ_ACC & 0xF0)>>4);
+		int8_t op_lo = (operand & 0x0F);
+		int8_t op_hi = ((operand & 0xF0)>>4);
+		int8_t res_lo = acc_lo - op_lo;
+		int8_t res_hi = acc_hi - op_hi;
+
+		if(!flagC()) res_lo = res_lo - 1;
+
+		// carry flag set
+		bool carry = true;
+		if(res_lo < 0){
+			// Carry lo to hi
+			res_lo += 10;
+			res_hi -= 1;
+		}
+		if(res_hi < 0){
+			// Carry out
+			res_hi += 10;
+			carry = false;
+		}
+		setFlag(FLAG_C, carry);
+		res_lo = res_lo & 0xF;
+		res_hi = res_hi & 0xF;
+		RAQ_ACC = (res_hi<<4) + res_lo;
+		nzResult = RAQ_ACC; // N and Z flags come from the result
+		return;
+	}
+	tmp = RAQ_ACC - operand - (flagC() ? 0 : 1);
+	setFlag(FLAG_C, tmp < 0x100); // Carry flag
+	setFlag(FLAG_V, ((RAQ_ACC ^ tmp) & (~operand ^ tmp) & 0x80) != 0); // This is the same overflow formula for ADC except operand is flipped
+	RAQ_ACC = tmp & 0xFF; // Assign final value
+	nzResult = RAQ_ACC; // N and Z flags come from the result
+}
 
-		case uint8_t(0x8A): // TXA
-			if(verbose) std::cout << "TXA\n";
-			RAQ_ACC = RAQ_X;
-			flag_z = (RAQ_ACC == 0);
-			flag_n = ((RAQ_ACC & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 1;
-			break;
+void Raquette::opCMP(int eff_addr) {
+	uint8_t operand = memRead(eff_addr);
+	nzResult = uint8_t(RAQ_ACC - operand); // Zero if equal, negative if sign bit set
+	setFlag(FLAG_C, RAQ_ACC >= operand); // Carry flag
+}
 
-		case uint8_t(0x98): // TYA
-			if(verbose) std::cout << "TYA\n";
-			RAQ_ACC = RAQ_Y;
-			flag_z = (RAQ_ACC == 0);
-			flag_n = ((RAQ_ACC & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 1;
-			break;
+void Raquette::opCPX(int eff_addr) {
+	uint8_t operand = memRead(eff_addr);
+	nzResult = uint8_t(RAQ_X - operand); // Zero if equal, negative if sign bit set
+	setFlag(FLAG_C, RAQ_X >= operand); // Carry flag
+}
 
-		case uint8_t(0x9A): // TXS
-			if(verbose) std::cout << "TXS\n";
-			RAQ_STACK = RAQ_X;
-			opbytes = 1;
-			break;
+void Raquette::opCPY(int eff_addr) {
+	uint8_t operand = memRead(eff_addr);
+	nzResult = uint8_t(RAQ_Y - operand); // Zero if equal, negative if sign bit set
+	setFlag(FLAG_C, RAQ_Y >= operand); // Carry flag
+}
 
-		case uint8_t(0xBA): // TSX
-			if(verbose) std::cout << "TSX\n";
-			RAQ_X = RAQ_STACK;
-			flag_z = (RAQ_X == 0);
-			flag_n = ((RAQ_X & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 1;
-			break;
+void Raquette::opAND(int eff_addr) {
+	RAQ_ACC = RAQ_ACC & memRead(eff_addr);
+	nzResult = RAQ_ACC; // N and Z flags come from the result
+}
 
-		case uint8_t(0xCA): // DEX
-			if(verbose) std::cout << "DEX\n";
-			RAQ_X = RAQ_X - 1;
-			flag_z = (RAQ_X == 0);
-			flag_n = ((RAQ_X & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 1;
-			break;
+void Raquette::opEOR(int eff_addr) {
+	RAQ_ACC = RAQ_ACC ^ memRead(eff_addr);
+	nzResult = RAQ_ACC; // N and Z flags come from the result
+}
 
-		case uint8_t(0x88): // DEY
-			if(verbose) std::cout << "DEY\n";
-			RAQ_Y = RAQ_Y - 1;
-			flag_z = (RAQ_Y == 0);
-			flag_n = ((RAQ_Y & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 1;
-			break;
+void Raquette::opORA(int eff_addr) {
+	RAQ_ACC = RAQ_ACC | memRead(eff_addr);
+	nzResult = RAQ_ACC; // N and Z flags come from the result
+}
 
-		case uint8_t(0xE6): // INC Zero Page
-			if(verbose) std::cout << "INC Zero Page\n";
-			eff_addr = memory[pc+1];
-			memory[eff_addr] += 1;
-			flag_z = (memory[eff_addr] == 0); // Zero flag if zero
-			flag_n = ((memory[eff_addr] & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 2;
-			break;
+void Raquette::opBIT(int eff_addr) {
+	// & with ACC for zero, and map bits of word in memory to flags
+	uint8_t operand = memRead(eff_addr);
+	// bit 7 maps to N, kept in bit 8 so that Z still comes from the AND
+	nzResult = (RAQ_ACC & operand) | ((operand & 0b10000000) << 1);
+	setFlag(FLAG_V, (operand & 0b01000000) != 0); // bit 6 maps to V
+}
 
-		case uint8_t(0xF6): // INC Zero Page, X
-			if(verbose) std::cout << "INC Zero Page, X\n";
-			eff_addr = ((memory[pc+1] + RAQ_X) & 0xFF); // Wrap around if sum of base and reg exceeds 0xFF
-			memory[eff_addr] += 1;
-			flag_z = (memory[eff_addr] == 0); // Zero flag if zero
-			flag_n = ((memory[eff_addr] & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 2;
-			break;
+void Raquette::opASLA(int eff_addr) {
+	setFlag(FLAG_C, RAQ_ACC & 0b10000000);
+	RAQ_ACC = RAQ_ACC << 1;
+	nzResult = RAQ_ACC;
+}
 
-		case uint8_t(0xEE): // INC Absolute
-			if(verbose) std::cout << "INC Absolute\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			assert(eff_addr <= 0xFFFF);
+void Raquette::opASL(int eff_addr) {
+	unsigned tmp = memRead(eff_addr);
+	setFlag(FLAG_C, tmp & 0b10000000);
+	tmp = (tmp << 1) & 0xFF;
+	nzResult = tmp;
+	memWrite(eff_addr, tmp);
+}
 
-			tmpbyte = memory[eff_addr] + 1;
-			flag_z = (tmpbyte == 0); // Zero flag if zero
-			flag_n = ((tmpbyte & 0b10000000) != 0); // Negative flag if sign bit set
+void Raquette::opLSRA(int eff_addr) {
+	setFlag(FLAG_C, RAQ_ACC & 0x1);
+	RAQ_ACC = RAQ_ACC >> 1;
+	nzResult = RAQ_ACC; // N is always clear
+}
 
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = tmpbyte;
-				dispHelper(eff_addr);
-			}
-			softSwitchesHelper(eff_addr);
-			opbytes = 3;
-			break;
+void Raquette::opLSR(int eff_addr) {
+	unsigned tmp = memRead(eff_addr);
+	setFlag(FLAG_C, tmp & 0x1);
+	tmp = tmp >> 1;
+	nzResult = tmp; // N is always clear
+	memWrite(eff_addr, tmp);
+}
 
-		case uint8_t(0xFE): // INC Absolute, X
-			if(verbose) std::cout << "INC Absolute, X\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1] + RAQ_X;
-			assert(eff_addr <= 0xFFFF);
+void Raquette::opROLA(int eff_addr) {
+	RAQ_ACC = rolHelper(RAQ_ACC);
+}
 
-			tmpbyte = memory[eff_addr] + 1;
-			flag_z = (tmpbyte == 0); // Zero flag if zero
-			flag_n = ((tmpbyte & 0b10000000) != 0); // Negative flag if sign bit set
+void Raquette::opROL(int eff_addr) {
+	memWrite(eff_addr, rolHelper(memRead(eff_addr)));
+}
 
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = tmpbyte;
-				dispHelper(eff_addr);
-			}
-			softSwitchesHelper(eff_addr);
-			opbytes = 3;
-			break;
+void Raquette::opRORA(int eff_addr) {
+	RAQ_ACC = rorHelper(RAQ_ACC);
+}
 
-		case uint8_t(0xC6): // DEC Zero Page
-			if(verbose) std::cout << "DEC Zero Page\n";
-			eff_addr = memory[pc+1];
-			memory[eff_addr] = memory[eff_addr]-1;
-			flag_z = (memory[eff_addr] == 0); // Zero flag if zero
-			flag_n = ((memory[eff_addr] & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 2;
-			break;
+void Raquette::opROR(int eff_addr) {
+	memWrite(eff_addr, rorHelper(memRead(eff_addr)));
+}
 
-		case uint8_t(0xD6): // DEC Zero Page, X
-			if(verbose) std::cout << "DEC Zero Page, X\n";
-			eff_addr = ((memory[pc+1] + RAQ_X) & 0xFF); // Wrap around if sum of base and reg exceeds 0xFF
-			memory[eff_addr] = memory[eff_addr]-1;
-			flag_z = (memory[eff_addr] == 0); // Zero flag if zero
-			flag_n = ((memory[eff_addr] & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 2;
-			break;
+void Raquette::opJMP(int eff_addr) {
+	pc = eff_addr;
+}
 
-		case uint8_t(0xCE): // DEC Absolute
-			if(verbose) std::cout << "DEC AbsoluteX\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			assert(eff_addr <= 0xFFFF);
+void Raquette::opJSR(int eff_addr) {
+	// Push pc of next instruction minus 1 onto stack (msb first, little endian since stack is upside down)
+	memory[0x100+RAQ_STACK--] = (((pc-1)>>8) & 0b11111111);
+	memory[0x100+RAQ_STACK--] = ((pc-1) & 0b11111111);
+	pc = eff_addr;
+}
 
-			tmpbyte = memory[eff_addr]-1;
-			flag_z = (tmpbyte == 0); // Zero flag if zero
-			flag_n = ((tmpbyte & 0b10000000) != 0); // Negative flag if sign bit set
+void Raquette::opRTS(int eff_addr) {
+	pc = (( ((memory[0x100+((RAQ_STACK+2)&0xFF)])<<8) | (memory[0x100+((RAQ_STACK+1)&0xFF)]) ) +1) & 0xFFFF; // The +1 is important and easy to miss
+	RAQ_STACK += 2;
+}
 
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = tmpbyte;
-				dispHelper(eff_addr);
-			}
-			softSwitchesHelper(eff_addr);
-			opbytes = 3;
-			break;
+void Raquette::opBRK(int eff_addr) {
+	unsigned tmp;
+	status |= FLAG_B;
 
-		case uint8_t(0xDE): // DEC Absolute, X
-			if(verbose) std::cout << "DEC Absolute, X\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1] + RAQ_X;
-			assert(eff_addr <= 0xFFFF);
+	// Note: BRK is a 2-byte op with the second byte ignored. Much documentation is incorrect.
+	// Push MSB of PC
+	memory[0x100+RAQ_STACK--] = ((pc>>8) & 0b11111111);
+	// Push LSB of PC
+	memory[0x100+RAQ_STACK--] = (pc & 0b11111111);
 
-			tmpbyte = memory[eff_addr]-1;
-			flag_z = (tmpbyte == 0); // Zero flag if zero
-			flag_n = ((tmpbyte & 0b10000000) != 0); // Negative flag if sign bit set
+	// Note: B bit pushed is always 1 from BRK or PHP instruction
+	memory[0x100+RAQ_STACK--] = getStatus() | FLAG_B;
 
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = tmpbyte;
-				dispHelper(eff_addr);
-			}
-			softSwitchesHelper(eff_addr);
-			opbytes = 3;
-			break;
+	// Set interrupt disable
+	status |= FLAG_I;
 
-		case uint8_t(0xE8): // INX
-			if(verbose) std::cout << "INX\n";
-			RAQ_X += 1;
-			flag_z = (RAQ_X == 0); // Zero flag if zero
-			flag_n = ((RAQ_X & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 1;
-			break;
+	// Load PC from IRQ interrupt vector at 0xFFFE and 0xFFFF
+	tmp = memory[0xFFFF]; // tmp is an unsigned int with room for shifts
+	pc = (tmp << 8) + memory[0xFFFE];
+}
 
-		case uint8_t(0xC8): // INY
-			if(verbose) std::cout << "INY\n";
-			RAQ_Y += 1;
-			flag_z = (RAQ_Y == 0); // Zero flag if zero
-			flag_n = ((RAQ_Y & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 1;
-			break;
+void Raquette::opRTI(int eff_addr) {
+	// Pop status from stack
+	opPLP(eff_addr);
 
-		case uint8_t(0x69): // ADC
-		case uint8_t(0x65):
-		case uint8_t(0x75):
-		case uint8_t(0x6D):
-		case uint8_t(0x7D):
-		case uint8_t(0x79):
-		case uint8_t(0x61):
-		case uint8_t(0x71):
-			std::tie(eff_addr, opbytes) = aModeHelper(thisbyte);
-			if(verbose) std::cout << "ADC " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-
-			// Handle decimal mode
-			if(flag_d) {
-				uint8_t acc_lo = (RAQ_ACC & 0x0F);
-				uint8_t acc_hi = ((RAQ_ACC & 0xF0)>>4);
-				uint8_t op_lo = (memory[eff_addr] & 0x0F);
-				uint8_t op_hi = ((memory[eff_addr] & 0xF0)>>4);
-				uint8_t res_lo = acc_lo + op_lo + (flag_c ? 1 : 0);
-				uint8_t res_hi = acc_hi + op_hi;
-
-				flag_c = false;
-				if(res_lo > 9){
-					// Carry lo to hi
-					res_lo -= 10;
-					res_hi += 1;
-				}
-				if(res_hi > 9){
-					// Carry out
-					res_hi -= 10;
-					flag_c = true;
-				}
-				RAQ_ACC = (res_hi<<4) + res_lo;
-				flag_z = (RAQ_ACC == 0); // Zero flag if zero
-				softSwitchesHelper(eff_addr);
-				break;
-			}
-			tmp = RAQ_ACC + memory[eff_addr] + (flag_c ? 1 : 0);
-			flag_c = (tmp > 0xFF); // Carry flag
-			flag_v = (((RAQ_ACC ^ tmp) & (memory[eff_addr] ^ tmp) & 0x80) != 0); // Overflow flag if sign bit is incorrect
-			RAQ_ACC = tmp & 0xFF; // Assign final value
-			flag_z = (RAQ_ACC == 0); // Zero flag if zero
-			flag_n = ((RAQ_ACC & 0b10000000) != 0); // Negative flag if sign bit set
-			softSwitchesHelper(eff_addr);
-			break;
+	// Pop program counter from stack
+	pc = ( ((memory[0x100+((RAQ_STACK+2)&0xFF)])<<8) | (memory[0x100+((RAQ_STACK+1)&0xFF)]) ); // Unlike RTS, no +1
+	RAQ_STACK += 2;
+}
 
-		case uint8_t(0xE9): // SBC
-		case uint8_t(0xE5):
-		case uint8_t(0xF5):
-		case uint8_t(0xED):
-		case uint8_t(0xFD):
-		case uint8_t(0xF9):
-		case uint8_t(0xE1):
-		case uint8_t(0xF1):
-			// Note, we assume that carry is set unless the previous SBC needed a borrow
-			std::tie(eff_addr, opbytes) = aModeHelper(thisbyte);
-			if(verbose) std::cout << "SBC " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-
-			// Handle decimal mode
-			if(flag_d) {
-				int8_t acc_lo = (RAQ_ACC & 0x0F);
-				int8_t acc_hi = ((RAQ_ACC & 0xF0)>>4);
-				int8_t op_lo = (memory[eff_addr] & 0x0F);
-				int8_t op_hi = ((memory[eff_addr] & 0xF0)>>4);
-				int8_t res_lo = acc_lo - op_lo;
-				int8_t res_hi = acc_hi - op_hi;
-
-				if(flag_c == false) res_lo = res_lo - 1;
-
-				// carry flag set
-				flag_c = true;
-				if(res_lo < 0){
-					// Carry lo to hi
-					res_lo += 10;
-					res_hi -= 1;
-				}
-				if(res_hi < 0){
-					// Carry out
-					res_hi += 10;
-					flag_c = false;
-				}
-				res_lo = res_lo & 0xF;
-				res_hi = res_hi & 0xF;
-				RAQ_ACC = (res_hi<<4) + res_lo;
-				flag_z = (RAQ_ACC == 0); // Zero flag if zero
-				softSwitchesHelper(eff_addr);
-				break;
-			}
-			tmp = RAQ_ACC - memory[eff_addr] - (flag_c ? 0 : 1);
-			flag_c = (tmp < 0x100); // Carry flag
-			flag_v = (((RAQ_ACC ^ tmp) & (~memory[eff_addr] ^ tmp) & 0x80) != 0); // This is the same overflow formula for ADC except operand is flipped
-			RAQ_ACC = tmp & 0xFF; // Assign final value
-			flag_z = (RAQ_ACC == 0); // Zero flag if zero
-			flag_n = ((RAQ_ACC & 0b10000000) != 0); // Negative flag if sign bit set
-			softSwitchesHelper(eff_addr);
-			break;
+// Takes a branch to eff_addr
+// A taken branch costs one extra cycle, plus another if the target is on a different page
+void Raquette::branchHelper(int eff_addr) {
+	cycles += 1 + (((pc ^ eff_addr) & 0xFF00) != 0);
+	pc = eff_addr;
+}
 
-		case uint8_t(0x24): // BIT Zero Page
-			if(verbose) std::cout << "BIT Zero Page\n";
-			eff_addr = memory[pc+1];
-			// & with ACC for zero, and map bits of word in memory to flags
-			tmp = RAQ_ACC & memory[eff_addr];
-			flag_z = (tmp == 0); // Zero flag if zero
-			flag_v = ((memory[eff_addr] & 0b01000000) != 0); // bit 6 maps to V
-			flag_n = ((memory[eff_addr] & 0b10000000) != 0); // bit 7 maps to N
-			opbytes = 2;
-			break;
+void Raquette::opBCC(int eff_addr) {
+	if(!flagC()) branchHelper(eff_addr);
+}
 
-		case uint8_t(0x2C): // BIT Absolute
-			if(verbose) std::cout << "BIT Absolute\n";
-			// Next two bytes are little endian address
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			// & with ACC for zero, and map bits of word in memory to flags
-			tmp = RAQ_ACC & memory[eff_addr];
-			flag_z = (tmp == 0); // Zero flag if zero
-			flag_v = ((memory[eff_addr] & 0b01000000) != 0); // bit 6 maps to V
-			flag_n = ((memory[eff_addr] & 0b10000000) != 0); // bit 7 maps to N
-			softSwitchesHelper(eff_addr);
-			opbytes = 3;
-			break;
+void Raquette::opBCS(int eff_addr) {
+	if(flagC()) branchHelper(eff_addr);
+}
 
-		case uint8_t(0xC9): // CMP
-		case uint8_t(0xC5):
-		case uint8_t(0xD5):
-		case uint8_t(0xCD):
-		case uint8_t(0xDD):
-		case uint8_t(0xD9):
-		case uint8_t(0xC1):
-		case uint8_t(0xD1):
-			std::tie(eff_addr, opbytes) = aModeHelper(thisbyte);
-			if(verbose) std::cout << "CMP addr:" << std::hex << eff_addr << " val:" << (int) memory[eff_addr] << std::dec << " pc+=" << opbytes << std::endl;
-			tmp = RAQ_ACC - memory[eff_addr];
-			flag_z = (RAQ_ACC == memory[eff_addr]); // Zero flag if equal
-			flag_n = ((tmp & 0b10000000) != 0); // Negative flag if sign bit set
-			flag_c = (RAQ_ACC >= memory[eff_addr]); // Carry flag
-			softSwitchesHelper(eff_addr);
-			break;
+void Raquette::opBEQ(int eff_addr) {
+	if(flagZ()) branchHelper(eff_addr);
+}
 
-		case uint8_t(0xE0): // CPX Immediate
-			if(verbose) std::cout << "CPX Immediate\n";
-			eff_addr = pc+1;
-			tmp = RAQ_X - memory[eff_addr];
-			flag_z = (tmp == 0); // Zero flag if zero
-			flag_n = ((tmp & 0b10000000) != 0); // Negative flag if sign bit set
-			flag_c = (RAQ_X >= memory[eff_addr]); // Carry flag
-			opbytes = 2;
-			softSwitchesHelper(eff_addr);
-			break;
+void Raquette::opBMI(int eff_addr) {
+	if(flagN()) branchHelper(eff_addr);
+}
 
-		case uint8_t(0xE4): // CPX Zero Page
-			if(verbose) std::cout << "CPX Zero Page\n";
-			eff_addr = memory[pc+1];
-			tmp = RAQ_X - memory[eff_addr];
-			flag_z = (tmp == 0); // Zero flag if zero
-			flag_n = ((tmp & 0b10000000) != 0); // Negative flag if sign bit set
-			flag_c = (RAQ_X >= memory[eff_addr]); // Carry flag
-			opbytes = 2;
-			break;
+void Raquette::opBNE(int eff_addr) {
+	if(!flagZ()) branchHelper(eff_addr);
+}
 
-		case uint8_t(0xEC): // CPX Absolute
-			if(verbose) std::cout << "CPX Absolute\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			assert(eff_addr <= 0xFFFF);
-			tmp = RAQ_X - memory[eff_addr];
-			flag_z = (tmp == 0); // Zero flag if zero
-			flag_n = ((tmp & 0b10000000) != 0); // Negative flag if sign bit set
-			flag_c = (RAQ_X >= memory[eff_addr]); // Carry flag
-			opbytes = 3;
-			softSwitchesHelper(eff_addr);
-			break;
+void Raquette::opBPL(int eff_addr) {
+	if(!flagN()) branchHelper(eff_addr);
+}
 
-		case uint8_t(0xC0): // CPY Immediate
-			if(verbose) std::cout << "CPY Immediate\n";
-			eff_addr = pc+1;
-			tmp = RAQ_Y - memory[eff_addr];
-			flag_z = (tmp == 0); // Zero flag if zero
-			flag_n = ((tmp & 0b10000000) != 0); // Negative flag if sign bit set
-			flag_c = (RAQ_Y >= memory[eff_addr]); // Carry flag
-			opbytes = 2;
-			softSwitchesHelper(eff_addr);
-			break;
+void Raquette::opBVC(int eff_addr) {
+	if(!(status & FLAG_V)) branchHelper(eff_addr);
+}
 
-		case uint8_t(0xC4): // CPY Zero Page
-			if(verbose) std::cout << "CPY Zero Page\n";
-			eff_addr = memory[pc+1];
-			tmp = RAQ_Y - memory[eff_addr];
-			flag_z = (tmp == 0); // Zero flag if zero
-			flag_n = ((tmp & 0b10000000) != 0); // Negative flag if sign bit set
-			flag_c = (RAQ_Y >= memory[eff_addr]); // Carry flag
-			opbytes = 2;
-			break;
+void Raquette::opBVS(int eff_addr) {
+	if(status & FLAG_V) branchHelper(eff_addr);
+}
 
-		case uint8_t(0xCC): // CPY Absolute
-			if(verbose) std::cout << "CPY Absolute\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			assert(eff_addr <= 0xFFFF);
-			tmp = RAQ_Y - memory[eff_addr];
-			flag_z = (tmp == 0); // Zero flag if zero
-			flag_n = ((tmp & 0b10000000) != 0); // Negative flag if sign bit set
-			flag_c = (RAQ_Y >= memory[eff_addr]); // Carry flag
-			opbytes = 3;
-			softSwitchesHelper(eff_addr);
-			break;
+void Raquette::opCLC(int eff_addr) {
+	status &= ~FLAG_C;
+}
 
-		case uint8_t(0x0A): // ASL Accumulator
-			if(verbose) std::cout << "ASL Accumulator\n";
-			flag_c = RAQ_ACC & 0b10000000;
-			tmp = RAQ_ACC;
-			tmp <<= 1;
-			RAQ_ACC = tmp;
-			flag_z = (RAQ_ACC == 0x0);
-			flag_n = RAQ_ACC & 0b10000000;
-			opbytes = 1;
-			break;
+void Raquette::opSEC(int eff_addr) {
+	status |= FLAG_C;
+}
 
-		case uint8_t(0x06): // ASL Zero Page
-			if(verbose) std::cout << "ASL Zero Page\n";
-			eff_addr = memory[pc+1];
-
-			tmp = memory[eff_addr];
-			flag_c = tmp & 0b10000000;
-			tmp <<= 1;
-			memory[eff_addr] = tmp;
-			flag_z = (tmp == 0x0);
-			flag_n = tmp & 0b10000000;
-			opbytes = 2;
-			break;
+void Raquette::opCLI(int eff_addr) {
+	status &= ~FLAG_I;
+	irqUnmaskHelper();
+}
 
-		case uint8_t(0x16): // ASL Zero Page, X
-			if(verbose) std::cout << "ASL Zero Page, X\n";
-			eff_addr = ((memory[pc+1] + RAQ_X) & 0xFF); // Wrap around if sum of base and reg exceeds 0xFF
-
-			tmp = memory[eff_addr];
-			flag_c = tmp & 0b10000000;
-			tmp <<= 1;
-			memory[eff_addr] = tmp;
-			flag_z = (tmp == 0x0);
-			flag_n = tmp & 0b10000000;
-			opbytes = 2;
-			break;
+void Raquette::opSEI(int eff_addr) {
+	status |= FLAG_I;
+}
 
-		case uint8_t(0x0E): // ASL Absolute
-			if(verbose) std::cout << "ASL Absolute\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			assert(eff_addr <= 0xFFFF);
-
-			tmp = memory[eff_addr];
-			flag_c = tmp & 0b10000000;
-			tmp <<= 1;
-			flag_z = (tmp == 0x0);
-			flag_n = tmp & 0b10000000;
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = tmp;
-				dispHelper(eff_addr);
-			}
-			softSwitchesHelper(eff_addr);
-			opbytes = 3;
-			break;
+void Raquette::opCLV(int eff_addr) {
+	status &= ~FLAG_V;
+}
 
-		case uint8_t(0x1E): // ASL Absolute, X
-			if(verbose) std::cout << "ASL Absolute, X\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1] + RAQ_X;
-			assert(eff_addr <= 0xFFFF);
-
-			tmp = memory[eff_addr];
-			flag_c = tmp & 0b10000000;
-			tmp <<= 1;
-			flag_z = (tmp == 0x0);
-			flag_n = tmp & 0b10000000;
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = tmp;
-				dispHelper(eff_addr);
-			}
-			softSwitchesHelper(eff_addr);
-			opbytes = 3;
-			break;
+void Raquette::opCLD(int eff_addr) {
+	status &= ~FLAG_D;
+}
 
-		case uint8_t(0x4A): // LSR Accumulator
-			if(verbose) std::cout << "LSR Accumulator\n";
-			flag_c = RAQ_ACC & 0x1;
-			tmp = RAQ_ACC;
-			tmp = tmp>>1;
-			RAQ_ACC = tmp;
-			flag_z = (RAQ_ACC == 0x0);
-			flag_n = false;
-			opbytes = 1;
-			break;
+void Raquette::opSED(int eff_addr) {
+	status |= FLAG_D;
+}
 
-		case uint8_t(0x46): // LSR Zero Page
-			if(verbose) std::cout << "LSR Zero Page\n";
-			eff_addr = memory[pc+1];
-			tmp = memory[eff_addr];
-			flag_c = tmp & 0x1;
-			tmp2 = tmp>>1;
-			flag_z = (tmp2 == 0x0);
-			flag_n = false;
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = tmp2;
-			}
-			softSwitchesHelper(eff_addr);
-			opbytes = 2;
-			break;
+void Raquette::opNOP(int eff_addr) {
+}
 
-		case uint8_t(0x56): // LSR Zero Page, X
-			if(verbose) std::cout << "LSR Zero Page, X\n";
-			eff_addr = ((memory[pc+1] + RAQ_X) & 0xFF); // Wrap around if sum of base and reg exceeds 0xFF
-			tmp = memory[eff_addr];
-			flag_c = tmp & 0x1;
-			tmp2 = tmp>>1;
-			memory[eff_addr] = tmp2;
-			flag_z = (memory[eff_addr] == 0x0);
-			flag_n = false;
-			opbytes = 2;
-			break;
+// Reports an invalid opcode at pc
+void Raquette::badOpcodeHelper() {
+	*log << "Error: unrecognized opcode: " << std::hex << (unsigned)memory[pc] << " at " << pc << std::dec << std::endl;
+}
 
-		case uint8_t(0x4E): // LSR Absolute
-			if(verbose) std::cout << "LSR Absolute\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			assert(eff_addr <= 0xFFFF);
-
-			tmp = memory[eff_addr];
-			flag_c = tmp & 0x1;
-			tmp2 = tmp>>1;
-			flag_z = (tmp2 == 0x0);
-			flag_n = false;
-
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = tmp2;
-				dispHelper(eff_addr);
-			}
-			softSwitchesHelper(eff_addr);
-			opbytes = 3;
-			break;
+// Records the instruction at pc in the trace ring before it executes
+// Kept out of line so that untraced builds of stepT() stay small.
+void Raquette::traceHelper() {
+	if(traceBuf.empty()){
+		traceBuf.resize(TRACE_LEN);
+	}
+	unsigned head = traceHead.load(std::memory_order_relaxed);
+	if(traceWriter){
+		// Wait for the writer rather than overwrite records it has not saved
+		while(head - traceTail.load(std::memory_order_acquire) == TRACE_LEN){
+			std::this_thread::yield();
+		}
+	}
+	TraceRecord &rec = traceBuf[head & (TRACE_LEN-1)];
+	rec.cycles = uint32_t(cycles);
+	rec.cyclesHigh = uint16_t(cycles >> 32);
+	rec.pc = pc;
+	rec.opcode = memory[pc];
+	rec.op1 = memory[(pc+1) & 0xFFFF];
+	rec.op2 = memory[(pc+2) & 0xFFFF];
+	rec.a = RAQ_ACC;
+	rec.x = RAQ_X;
+	rec.y = RAQ_Y;
+	rec.sp = RAQ_STACK;
+	rec.p = getStatus();
+	traceHead.store(head + 1, std::memory_order_release);
+}
 
-		case uint8_t(0x5E): // LSR Absolute, X
-			if(verbose) std::cout << "LSR Absolute, X\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1] + RAQ_X;
-			assert(eff_addr <= 0xFFFF);
-
-			tmp = memory[eff_addr];
-			flag_c = tmp & 0x1;
-			tmp2 = tmp>>1;
-			flag_z = (tmp2 == 0x0);
-			flag_n = false;
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = tmp2;
-				dispHelper(eff_addr);
-			}
-			softSwitchesHelper(eff_addr);
-			opbytes = 3;
-			break;
+// Traces every instruction run by runCycles() to a binary file, see raqtrace.hpp
+// Returns false if the file cannot be created.
+bool Raquette::startTrace(const char *fileName){
+	stopTrace();
+	if(traceBuf.empty()){
+		traceBuf.resize(TRACE_LEN); // Before the writer thread can look at it
+	}
+	traceWriter = new RaqTraceWriter(*this, fileName);
+	if(!traceWriter->ok()){
+		stopTrace();
+		return false;
+	}
+	tracing = true;
+	return true;
+}
 
-		case uint8_t(0x2A): // ROL Accumulator
-			if(verbose) std::cout << "ROL Accumulator\n";
-			RAQ_ACC = rolHelper(RAQ_ACC);
-			opbytes = 1;
-			break;
+// Stops tracing once every record so far is in the file
+void Raquette::stopTrace(){
+	tracing = false;
+	delete traceWriter;
+	traceWriter = nullptr;
+}
 
-		case uint8_t(0x26): // ROL Zero Page
-			if(verbose) std::cout << "ROL Zero Page\n";
-			eff_addr = memory[pc+1];
-			memory[eff_addr] = rolHelper(memory[eff_addr]);
-			opbytes = 2;
-			break;
+// Formats one instruction as assembly text, e.g. "LDA ($12),Y"
+std::string Raquette::disassemble(uint16_t addr, uint8_t opcode, uint8_t op1, uint8_t op2) {
+	const OpInfo &op = opTable[opcode];
+	char buf[32];
+	unsigned abs = (op2 << 8) + op1;
+	switch(op.amode){
+		case AM_ACC:  snprintf(buf, sizeof(buf), "%s A", op.mnemonic); break;
+		case AM_IMM:  snprintf(buf, sizeof(buf), "%s #$%02X", op.mnemonic, op1); break;
+		case AM_ZP:   snprintf(buf, sizeof(buf), "%s $%02X", op.mnemonic, op1); break;
+		case AM_ZPX:  snprintf(buf, sizeof(buf), "%s $%02X,X", op.mnemonic, op1); break;
+		case AM_ZPY:  snprintf(buf, sizeof(buf), "%s $%02X,Y", op.mnemonic, op1); break;
+		case AM_ABS:  snprintf(buf, sizeof(buf), "%s $%04X", op.mnemonic, abs); break;
+		case AM_ABSX: snprintf(buf, sizeof(buf), "%s $%04X,X", op.mnemonic, abs); break;
+		case AM_ABSY: snprintf(buf, sizeof(buf), "%s $%04X,Y", op.mnemonic, abs); break;
+		case AM_IND:  snprintf(buf, sizeof(buf), "%s ($%04X)", op.mnemonic, abs); break;
+		case AM_INDX: snprintf(buf, sizeof(buf), "%s ($%02X,X)", op.mnemonic, op1); break;
+		case AM_INDY: snprintf(buf, sizeof(buf), "%s ($%02X),Y", op.mnemonic, op1); break;
+		case AM_REL:  snprintf(buf, sizeof(buf), "%s $%04X", op.mnemonic, (addr + 2 + int8_t(op1)) & 0xFFFF); break;
+		default:      snprintf(buf, sizeof(buf), "%s", op.mnemonic); break;
+	}
+	return buf;
+}
 
-		case uint8_t(0x36): // ROL Zero Page, X
-			if(verbose) std::cout << "ROL Zero Page, X\n";
-			eff_addr = ((memory[pc+1] + RAQ_X) & 0xFF);
-			memory[eff_addr] = rolHelper(memory[eff_addr]);
-			opbytes = 2;
-			break;
+// Prints one trace record as a line of disassembly with the register state
+void Raquette::formatTraceRecord(std::ostream &out, const TraceRecord &rec) {
+	const OpInfo &op = opTable[rec.opcode];
+	char bytes[12];
+	char line[112];
+	uint64_t cyc = (uint64_t(rec.cyclesHigh) << 32) + rec.cycles;
+
+	if(op.length == 3){
+		snprintf(bytes, sizeof(bytes), "%02X %02X %02X", rec.opcode, rec.op1, rec.op2);
+	}else if(op.length == 2){
+		snprintf(bytes, sizeof(bytes), "%02X %02X", rec.opcode, rec.op1);
+	}else{
+		snprintf(bytes, sizeof(bytes), "%02X", rec.opcode);
+	}
+	snprintf(line, sizeof(line), "%04X  %-8s  %-14s A:%02X X:%02X Y:%02X SP:%02X P:%02X CYC:%llu",
+		rec.pc, bytes, disassemble(rec.pc, rec.opcode, rec.op1, rec.op2).c_str(),
+		rec.a, rec.x, rec.y, rec.sp, rec.p, (unsigned long long)cyc);
+	out << line << std::endl;
+}
 
-		case uint8_t(0x2E): // ROL Absolute
-			if(verbose) std::cout << "ROL Absolute\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			assert(eff_addr <= 0xFFFF);
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = rolHelper(memory[eff_addr]);
-				dispHelper(eff_addr);
-			}
-			softSwitchesHelper(eff_addr);
-			opbytes = 3;
-			break;
+// Prints up to the last count traced instructions, oldest first
+void Raquette::printTrace(std::ostream &out, unsigned count) {
+	unsigned head = traceHead.load();
+	unsigned avail = (head < TRACE_LEN) ? head : TRACE_LEN;
+	if(count > avail) count = avail;
+	for(unsigned i = head - count; i != head; i++){
+		formatTraceRecord(out, traceBuf[i & (TRACE_LEN-1)]);
+	}
+}
 
-		case uint8_t(0x3E): // ROL Absolute, X
-			if(verbose) std::cout << "ROL Absolute, X\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1] + RAQ_X;
-			assert(eff_addr <= 0xFFFF);
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = rolHelper(memory[eff_addr]);
-				dispHelper(eff_addr);
-			}
-			softSwitchesHelper(eff_addr);
-			opbytes = 3;
-			break;
+// Clears the profile and starts counting every instruction run by runCycles()
+void Raquette::startProfile(){
+	pcProfile.assign(0x10000, {0, 0});
+	callCounts.assign(0x10000, 0);
+	callCycles.assign(0x10000, 0);
+	callStack.clear();
+	for(int i=0; i<256; i++){
+		opcodeProfile[i] = {0, 0};
+	}
+	profiling = true;
+}
 
-		case uint8_t(0x6A): // ROR Accumulator
-			if(verbose) std::cout << "ROR Accumulator\n";
-			RAQ_ACC = rorHelper(RAQ_ACC);
-			opbytes = 1;
-			break;
+// Stops counting, the profile is kept for profileReport()
+void Raquette::stopProfile(){
+	profiling = false;
+}
 
-		case uint8_t(0x66): // ROR Zero Page
-			if(verbose) std::cout << "ROR Zero Page\n";
-			eff_addr = memory[pc+1];
-			memory[eff_addr] = rorHelper(memory[eff_addr]);
-			opbytes = 2;
-			break;
+// Counts one instruction at addr that took spent cycles
+// JSR and RTS also keep a shadow call stack, so each routine gets its calls and total cycles.
+// Code that drops or fakes return addresses on the stack only skews the totals of the routines involved.
+void Raquette::profileHelper(uint16_t addr, uint8_t opcode, unsigned spent){
+	ProfileCount &count = pcProfile[addr];
+	count.hits++;
+	count.cycles += spent;
+	opcodeProfile[opcode].hits++;
+	opcodeProfile[opcode].cycles += spent;
+
+	if(opcode == 0x20){ // JSR, pc is the routine
+		callCounts[pc]++;
+		if(callStack.size() == 0x100) callStack.erase(callStack.begin()); // Deeper than the 6502 stack allows
+		callStack.push_back({uint16_t(pc), cycles});
+	}else if((opcode == 0x60) && !callStack.empty()){ // RTS
+		callCycles[callStack.back().target] += cycles - callStack.back().start;
+		callStack.pop_back();
+	}
+}
 
-		case uint8_t(0x76): // ROR Zero Page, X
-			if(verbose) std::cout << "ROR Zero Page, X\n";
-			eff_addr = ((memory[pc+1] + RAQ_X) & 0xFF);
-			memory[eff_addr] = rorHelper(memory[eff_addr]);
-			opbytes = 2;
-			break;
+// Reads exported symbols from an ld65 map file (ld65 -m), by address
+// Only symbols named in a .export directive are listed in the map.
+// Returns an empty map if the file cannot be read.
+static std::map<uint16_t, std::string> loadMapSymbols(const char *mapFile){
+	std::map<uint16_t, std::string> symbols;
+	std::ifstream infile(mapFile);
+	std::string line;
+	while(std::getline(infile, line)){
+		if(line.compare(0, 22, "Exports list by value:") == 0) break;
+	}
+	std::getline(infile, line); // Underline
+	// Each line holds up to two entries of name, hex value and flags
+	while(std::getline(infile, line) && !line.empty()){
+		std::istringstream fields(line);
+		std::string name, value, flags;
+		while(fields >> name >> value >> flags){
+			symbols[uint16_t(std::stoul(value, nullptr, 16))] = name;
+		}
+	}
+	return symbols;
+}
 
-		case uint8_t(0x6E): // ROR Absolute
-			if(verbose) std::cout << "ROR Absolute\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			assert(eff_addr <= 0xFFFF);
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = rorHelper(memory[eff_addr]);
-				dispHelper(eff_addr);
+// Prints where the profiled time went: routines, instructions and opcodes, busiest first
+// Addresses are named from the exports in mapFile, such as raq_rom.map from the ROM Makefile.
+// Without symbols, every JSR target counts as the start of a routine.
+void Raquette::profileReport(std::ostream &out, const char *mapFile, unsigned top){
+	if(pcProfile.empty()){
+		out << "No profile\n";
+		return;
+	}
+	std::map<uint16_t, std::string> symbols = loadMapSymbols(mapFile);
+	if(symbols.empty()){
+		out << "No symbols in " << mapFile << ", naming routines by address\n";
+		for(int addr=0; addr < 0x10000; addr++){
+			if(callCounts[addr]){
+				char name[8];
+				snprintf(name, sizeof(name), "$%04X", addr);
+				symbols[addr] = name;
 			}
-			softSwitchesHelper(eff_addr);
-			opbytes = 3;
-			break;
+		}
+	}
 
-		case uint8_t(0x7E): // ROR Absolute, X
-			if(verbose) std::cout << "ROR Absolute, X\n";
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1] + RAQ_X;
-			assert(eff_addr <= 0xFFFF);
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = rorHelper(memory[eff_addr]);
-				dispHelper(eff_addr);
-			}
-			softSwitchesHelper(eff_addr);
-			opbytes = 3;
-			break;
+	// Names an address as the nearest symbol at or below it, plus an offset
+	auto symbolize = [&](int addr){
+		auto it = symbols.upper_bound(addr);
+		if(it == symbols.begin()) return std::string("?");
+		--it;
+		if(it->first == addr) return it->second;
+		return it->second + "+" + std::to_string(addr - it->first);
+	};
+
+	uint64_t totalCycles = 0;
+	uint64_t totalHits = 0;
+	std::map<uint16_t, uint64_t> selfCycles; // By routine start
+	for(int addr=0; addr < 0x10000; addr++){
+		const ProfileCount &count = pcProfile[addr];
+		if(!count.hits) continue;
+		totalCycles += count.cycles;
+		totalHits += count.hits;
+		auto it = symbols.upper_bound(addr);
+		if(it != symbols.begin()) selfCycles[(--it)->first] += count.cycles;
+	}
+	out << "Profiled " << totalHits << " instructions in " << totalCycles << " cycles\n";
+	if(!totalCycles) return;
+
+	char line[112];
+	out << "\nRoutine                   Self cycles      %       Calls  Total cycles\n";
+	std::vector<std::pair<uint64_t, uint16_t>> routines;
+	for(auto &entry : selfCycles){
+		routines.push_back({entry.second, entry.first});
+	}
+	std::sort(routines.rbegin(), routines.rend());
+	for(unsigned i=0; (i < top) && (i < routines.size()); i++){
+		uint16_t start = routines[i].second;
+		snprintf(line, sizeof(line), "%-20s %16llu %6.2f %11llu %13llu",
+			symbols[start].c_str(), (unsigned long long)routines[i].first, 100.0 * routines[i].first / totalCycles,
+			(unsigned long long)callCounts[start], (unsigned long long)callCycles[start]);
+		out << line << std::endl;
+	}
 
-		case uint8_t(0x29): // AND
-		case uint8_t(0x25):
-		case uint8_t(0x35):
-		case uint8_t(0x2D):
-		case uint8_t(0x3D):
-		case uint8_t(0x39):
-		case uint8_t(0x21):
-		case uint8_t(0x31):
-			std::tie(eff_addr, opbytes) = aModeHelper(thisbyte);
-			if(verbose) std::cout << "AND " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-
-			tmp = RAQ_ACC & memory[eff_addr];
-			RAQ_ACC = tmp;
-			flag_z = (RAQ_ACC == 0); // Zero flag if zero
-			flag_n = ((RAQ_ACC & 0b10000000) != 0); // Negative flag if sign bit set
-			softSwitchesHelper(eff_addr);
-			break;
+	out << "\nAddress  Location              Instruction         Hits        Cycles\n";
+	std::vector<std::pair<uint64_t, uint16_t>> hot;
+	for(int addr=0; addr < 0x10000; addr++){
+		if(pcProfile[addr].hits) hot.push_back({pcProfile[addr].cycles, uint16_t(addr)});
+	}
+	std::sort(hot.rbegin(), hot.rend());
+	for(unsigned i=0; (i < top) && (i < hot.size()); i++){
+		uint16_t addr = hot[i].second;
+		snprintf(line, sizeof(line), "%04X     %-20s %-14s %11llu %13llu", addr, symbolize(addr).c_str(),
+			disassemble(addr, memory[addr], memory[(addr+1) & 0xFFFF], memory[(addr+2) & 0xFFFF]).c_str(),
+			(unsigned long long)pcProfile[addr].hits, (unsigned long long)pcProfile[addr].cycles);
+		out << line << std::endl;
+	}
 
-		case uint8_t(0x49): // EOR
-		case uint8_t(0x45):
-		case uint8_t(0x55):
-		case uint8_t(0x4D):
-		case uint8_t(0x5D):
-		case uint8_t(0x59):
-		case uint8_t(0x41):
-		case uint8_t(0x51):
-			std::tie(eff_addr, opbytes) = aModeHelper(thisbyte);
-			if(verbose) std::cout << "EOR " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-
-			tmp = RAQ_ACC ^ memory[eff_addr];
-			RAQ_ACC = tmp;
-			flag_z = (RAQ_ACC == 0); // Zero flag if zero
-			flag_n = ((RAQ_ACC & 0b10000000) != 0); // Negative flag if sign bit set
-			softSwitchesHelper(eff_addr);
-			break;
+	out << "\nOpcode  Mnemonic        Hits        Cycles\n";
+	std::vector<std::pair<uint64_t, uint8_t>> ops;
+	for(int op=0; op < 256; op++){
+		if(opcodeProfile[op].hits) ops.push_back({opcodeProfile[op].cycles, uint8_t(op)});
+	}
+	std::sort(ops.rbegin(), ops.rend());
+	for(unsigned i=0; (i < top) && (i < ops.size()); i++){
+		uint8_t op = ops[i].second;
+		snprintf(line, sizeof(line), "%02X      %-8s %11llu %13llu", op, opTable[op].mnemonic,
+			(unsigned long long)opcodeProfile[op].hits, (unsigned long long)opcodeProfile[op].cycles);
+		out << line << std::endl;
+	}
+}
 
-		case uint8_t(0x09): // ORA
-		case uint8_t(0x05):
-		case uint8_t(0x15):
-		case uint8_t(0x0D):
-		case uint8_t(0x1D):
-		case uint8_t(0x19):
-		case uint8_t(0x01):
-		case uint8_t(0x11):
-			std::tie(eff_addr, opbytes) = aModeHelper(thisbyte);
-			if(verbose) std::cout << "ORA " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			tmp = RAQ_ACC | memory[eff_addr];
-			RAQ_ACC = tmp;
-			flag_z = (RAQ_ACC == 0); // Zero flag if zero
-			flag_n = ((RAQ_ACC & 0b10000000) != 0); // Negative flag if sign bit set
-			softSwitchesHelper(eff_addr);
-			break;
+// ISA based on MOS 6502
+// Each opcode byte indexes opTable, which gives the addressing mode, length, cycles and handler.
+// Little-endian (least sig byte first)
+// Processor status is packed in status, except N and Z which are evaluated lazily from nzResult
+// The tracing policy is a template parameter so the untraced core has no trace checks at all.
+template <class Tracing>
+int Raquette::stepT() {
+	assert(pc >= 0);
+	if (pc >= num_words) {
+		return 1; // Already out of bounds
+	}
+
+	int eff_addr;
+	bool crossed;
+	uint8_t thisbyte = memory[pc];
+	const OpInfo &op = opTable[thisbyte];
+
+	if(!op.handler){
+		badOpcodeHelper();
+		return 1;
+	}
+
+	if(Tracing::enabled) traceHelper();
+	std::tie(eff_addr, crossed) = aModeHelper(op.amode);
 
-		case uint8_t(0x85): // STA
-		case uint8_t(0x95):
-		case uint8_t(0x8D):
-		case uint8_t(0x9D):
-		case uint8_t(0x99):
-		case uint8_t(0x81):
-		case uint8_t(0x91):
-			std::tie(eff_addr, opbytes) = aModeHelper(thisbyte);
-			if(verbose) std::cout << "STA " << std::hex << eff_addr << std::dec << " pc+=" << opbytes << std::endl;
-			if(eff_addr < ROM_LO){
-				memory[eff_addr] = RAQ_ACC;
-				dispHelper(eff_addr);
+	uint64_t before = cycles;
+	uint16_t addr = pc;
+	cycles += op.cycles + (op.pagePenalty & crossed);
+	instructions++;
+	pc += op.length;
+	(this->*op.handler)(eff_addr);
+	if(Tracing::profiled) profileHelper(addr, thisbyte, cycles - before);
+	return !((pc > 0) && (pc < num_words));
+}
+
+// Executes one instruction, recording it in the trace ring if verbose
+int Raquette::step(bool verbose) {
+	return verbose ? stepT<Trace>() : stepT<NoTrace>();
+}
+
+// Returns the cached block starting at addr, building it on a miss
+// Returns nullptr if the code there is not cached (zero page, stack, I/O or an invalid opcode).
+Raquette::Block *Raquette::findBlock(int addr){
+	int page = addr >> 8;
+	if((page < 0x02) || !pages[page].read) return nullptr;
+
+	if(!blockIndex[page]) blockIndex[page] = new Block[0x100];
+	Block &block = blockIndex[page][addr & 0xFF];
+	if(!block.ops.empty()) return &block;
+
+	buildBlock(block, addr);
+	if(block.ops.empty()) return nullptr;
+	block.next = nullptr;
+	blockCount++;
+	return &block;
+}
+
+// Decodes straight-line code from addr until a control transfer, an invalid opcode or an uncached page
+// Every page the block touches is overlaid with codeWrite() unless it is read-only.
+void Raquette::buildBlock(Block &block, int addr){
+	int start = addr;
+	block.maxCycles = 0;
+	while(block.ops.size() < BLOCK_MAX_OPS){
+		const OpInfo &op = opTable[memory[addr]];
+		if(!op.handler) break; // Left for stepT() to report
+		if(addr + op.length >= num_words) break;
+		int lastPage = (addr + op.length - 1) >> 8;
+		if(!pages[lastPage].read) break;
+
+		if(block.ops.empty()){
+			block.runs = 0;
+			block.native = nullptr;
+		}
+		DecodedOp dec = {op.handler, uint16_t(addr), 0, op.amode, op.length, op.cycles, op.pagePenalty};
+		switch(op.amode){
+			case AM_IMM:
+				dec.operand = addr + 1;
+				break;
+			case AM_ZP: case AM_ZPX: case AM_ZPY: case AM_INDX: case AM_INDY:
+				dec.operand = memory[addr+1];
+				break;
+			case AM_ABS: case AM_ABSX: case AM_ABSY: case AM_IND:
+				dec.operand = (memory[addr+2] << 8) | memory[addr+1];
+				break;
+			case AM_REL:
+				dec.operand = (addr + 2 + int8_t(memory[addr+1])) & 0xFFFF;
+				break;
+			default: // No operand
+				break;
+		}
+		block.ops.push_back(dec);
+		block.maxCycles += op.cycles + op.pagePenalty + ((op.amode == AM_REL) ? 2 : 0);
+
+		for(int page = addr >> 8; page <= lastPage; page++){
+			if(pageBlocks[page].empty()){
+				// codeBytes is only kept up to date for pages holding blocks
+				std::fill(&codeBytes[page<<8], &codeBytes[(page<<8) + 0x100], false);
 			}
-			softSwitchesHelper(eff_addr);
-			break;
+			if(pageBlocks[page].empty() || (pageBlocks[page].back() != start)){
+				pageBlocks[page].push_back(start);
+			}
+			if(!codeOverlaid[page] && (pages[page].write || pages[page].writeHandler)){
+				codePages[page] = pages[page];
+				pages[page].write = nullptr;
+				pages[page].writeHandler = &Raquette::codeWrite;
+				codeOverlaid[page] = true;
+			}
+		}
 
-		case uint8_t(0x4C): // JMP (absolute)
-			// The next two bytes specify a little endian address.
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			if(verbose) std::cout << "Absolute JMP " << std::hex << eff_addr << std::dec << std::endl;
-			pc = eff_addr;
-			opbytes = 0; // For JMP we just go directly to the address, ignoring PC increment
-			break;
+		for(int i=0; i<op.length; i++){
+			codeBytes[addr+i] = true;
+		}
 
-		case uint8_t(0x6C): // JMP (indirect)
-			// The next two bytes specify a little endian address containing a little endian address
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			tmp2 = (tmp << 8) + memory[pc+1];
+		addr += op.length;
+		if((op.amode == AM_REL) || (op.handler == &Raquette::opJMP) || (op.handler == &Raquette::opJSR)
+			|| (op.handler == &Raquette::opRTS) || (op.handler == &Raquette::opRTI) || (op.handler == &Raquette::opBRK)){
+			break; // Control transfer ends the block
+		}
+		if(!pages[addr >> 8].read) break;
+	}
 
-			// Now tmp2 has the address of the second address
-			// First the MSB
-			tmp = memory[tmp2+1]; // tmp is an unsigned int with room for shifts
+	block.idleCycles = 0;
+	if((block.ops.size() == 2) && idleRead(block.ops[0])
+		&& (block.ops[1].amode == AM_REL) && (block.ops[1].operand == start)){
+		const DecodedOp &branch = block.ops[1];
+		block.idleCycles = block.ops[0].cycles + branch.cycles + 1 + ((((branch.pc + 2) ^ start) & 0xFF00) != 0);
+	}
+}
 
-			// Now the LSB
-			eff_addr = (tmp << 8) + memory[tmp2];
+// True if op reads the keyboard and changes nothing but registers and flags
+bool Raquette::idleRead(const DecodedOp &op){
+	if((op.amode != AM_ABS) || (op.operand != 0xC000)) return false;
+	if(pages[0xC0].read || (pages[0xC0].readHandler != &Raquette::ioRead)) return false;
+	return (op.handler == &Raquette::opBIT) || (op.handler == &Raquette::opLDA)
+		|| (op.handler == &Raquette::opLDX) || (op.handler == &Raquette::opLDY);
+}
 
-			if(verbose) std::cout << "Indirect JMP " << std::hex << eff_addr << std::dec << std::endl;
-			pc = eff_addr;
-			opbytes = 0; // For JMP we just go directly to the address, ignoring PC increment
-			break;
+// Runs an idle loop once, then skips every further pass that ends before target
+// Each pass would read the same key and set the same registers and flags, so only cycles move.
+// Returns nonzero if the CPU halted (same as stepT()).
+int Raquette::runIdle(const Block &block, uint64_t target){
+	uint16_t start = block.ops[0].pc;
+	unsigned pass = block.idleCycles;
+	if(runBlock(block)) return 1;
+	if(pc == start){
+		uint64_t passes = (target - cycles) / pass;
+		uint64_t skipped = passes * pass;
+		cycles += skipped;
+		idleSkipped += skipped;
+		idle = true;
+	}
+	return 0;
+}
 
-		case uint8_t(0x20): // JSR (Absolute)
-			// Push pc of next instruction minus 1 onto stack (msb first, little endian since stack is upside down)
-			memory[0x100+RAQ_STACK--] = (((pc+2)>>8) & 0b11111111);
-			memory[0x100+RAQ_STACK--] = ((pc+2) & 0b11111111);
-			// The next two bytes specify a little endian address.
-			tmp = memory[pc+2]; // tmp is an unsigned int with room for shifts
-			eff_addr = (tmp << 8) + memory[pc+1];
-			if(verbose) std::cout << "JSR " << std::hex << eff_addr << std::dec << std::endl;
-			pc = eff_addr;
-			opbytes = 0;
-			break;
+// Runs a predecoded block, returning nonzero if the CPU halted (same as stepT())
+int Raquette::runBlock(const Block &block){
+	blockStop = false;
+	for(const DecodedOp &op : block.ops){
+		int eff_addr = op.operand;
+		bool crossed = false;
+		unsigned tmp;
+
+		switch(op.amode){
+			case AM_ZPX:
+				eff_addr = (op.operand + RAQ_X) & 0xFF;
+				break;
+			case AM_ZPY:
+				eff_addr = (op.operand + RAQ_Y) & 0xFF;
+				break;
+			case AM_ABSX:
+				eff_addr = (op.operand + RAQ_X) & 0xFFFF;
+				crossed = ((op.operand ^ eff_addr) & 0xFF00) != 0;
+				break;
+			case AM_ABSY:
+				eff_addr = (op.operand + RAQ_Y) & 0xFFFF;
+				crossed = ((op.operand ^ eff_addr) & 0xFF00) != 0;
+				break;
+			case AM_IND:
+				eff_addr = (memory[(op.operand+1) & 0xFFFF] << 8) + memory[op.operand];
+				break;
+			case AM_INDX:
+				tmp = (op.operand + RAQ_X) & 0xFF;
+				eff_addr = (memory[(tmp+1) & 0xFF] << 8) + memory[tmp];
+				break;
+			case AM_INDY:
+				tmp = (memory[(op.operand+1) & 0xFF] << 8) + memory[op.operand];
+				eff_addr = (tmp + RAQ_Y) & 0xFFFF;
+				crossed = ((tmp ^ eff_addr) & 0xFF00) != 0;
+				break;
+			default: // Resolved when the block was built
+				break;
+		}
 
-		case uint8_t(0x60): // RTS
-			eff_addr = (( ((memory[0x100+RAQ_STACK+0x2])<<8) | (memory[0x100+RAQ_STACK+1]) ) +1); // The +1 is important and easy to miss
-			if(verbose) std::cout << "return to " << std::hex << eff_addr << std::dec << std::endl;
-			RAQ_STACK += 2;
-			pc = eff_addr;
-			opbytes = 0;
-			break;
+		cycles += op.cycles + (op.pagePenalty & crossed);
+		instructions++;
+		pc = op.pc + op.length;
+		(this->*op.handler)(eff_addr);
+		if(blockStop) break; // The block may have been freed or be stale, or an event is due
+	}
+	return !((pc > 0) && (pc < num_words));
+}
 
-		case uint8_t(0x40): // RTI
-			if(verbose) std::cout << "RTI" << std::endl;
+// Returns true if the block has native code, translating it once it has run JIT_HOT times
+bool Raquette::jitBlock(Block &block){
+	if(block.native) return true;
+	if(++block.runs != JIT_HOT) return false;
+	if(!jit) jit = new RaqJit(log);
+	block.native = jit->translate(block, memory);
+	return block.native != nullptr;
+}
 
-			// Pop status from stack
-			RAQ_STACK += 1;
-			tmp = (memory[0x100+RAQ_STACK]);
+// Runs a block's native code, then the instruction it stopped on if that needs the interpreter
+// Returns nonzero if the CPU halted (same as stepT()).
+int Raquette::runNative(const Block &block, uint64_t target){
+	JitContext ctx = {memory, pages, cycles, instructions, target, jit->links.data(), uint32_t(pc), nzResult,
+		RAQ_ACC, RAQ_X, RAQ_Y, RAQ_STACK, status, 0};
+	block.native(&ctx);
+	cycles = ctx.cycles;
+	instructions = ctx.instructions;
+	pc = ctx.pc;
+	nzResult = ctx.nz;
+	RAQ_ACC = ctx.a;
+	RAQ_X = ctx.x;
+	RAQ_Y = ctx.y;
+	RAQ_STACK = ctx.sp;
+	status = ctx.status;
+	if(ctx.fallback) return stepT<NoTrace>();
+	return !((pc > 0) && (pc < num_words));
+}
 
-			flag_c = ((tmp & 0b00000001) !=0);
-			flag_z = ((tmp & 0b00000010) !=0);
-			flag_i = ((tmp & 0b00000100) !=0);
-			flag_d = ((tmp & 0b00001000) !=0);
-			flag_b = ((tmp & 0b00010000) !=0);
-			flag_v = ((tmp & 0b01000000) !=0);
-			flag_n = ((tmp & 0b10000000) !=0);
+// Write handler for pages holding cached code
+// Data stored next to code goes straight through the page's normal mapping.
+// Storing over code drops the page's blocks and overlay, then replays the write.
+void Raquette::codeWrite(int eff_addr, uint8_t val){
+	int page = eff_addr >> 8;
+	if(codeBytes[eff_addr]){
+		invalidateCodePage(page);
+		memWrite(eff_addr, val);
+	}else if(codePages[page].write){
+		codePages[page].write[eff_addr & 0xFF] = val;
+	}else{
+		(this->*codePages[page].writeHandler)(eff_addr, val);
+	}
+}
 
-			// Pop program counter from stack
-			eff_addr = ( ((memory[0x100+RAQ_STACK+0x2])<<8) | (memory[0x100+RAQ_STACK+1]) ); // Unline RTS, no +1
-			if(verbose) std::cout << "return to " << std::hex << eff_addr << std::dec << std::endl;
-			RAQ_STACK += 2;
-			pc = eff_addr;
+void Raquette::invalidateCodePage(int page){
+	if(pageBlocks[page].empty()) return; // No blocks, so no overlay either
+	for(uint16_t start : pageBlocks[page]){
+		Block &block = blockIndex[start >> 8][start & 0xFF];
+		if(!block.ops.empty()) blockCount--;
+		block.ops.clear(); // Keeps its storage for the next block built here
+		if(jit) jit->unlink(start);
+	}
+	pageBlocks[page].clear();
+	blockEpoch++;
+	if(codeOverlaid[page]){
+		pages[page] = codePages[page];
+		codeOverlaid[page] = false;
+	}
+	blockStop = true;
+}
 
-			opbytes = 0;
-			break;
+// Drops every cached block
+// Must be called after changing code through memory[] directly rather than memWrite().
+void Raquette::flushBlockCache(){
+	for(int page=0; page<0x100; page++){
+		invalidateCodePage(page);
+	}
+}
 
+// Handler for each EventType
+void (Raquette::*const Raquette::eventHandlers[EV_COUNT])() = {
+	&Raquette::vblEvent, &Raquette::stepperEvent, &Raquette::keyRepeatEvent, &Raquette::interruptEvent,
+	&Raquette::inputEvent
+};
 
-		case uint8_t(0x48): // PHA
-			if(verbose) std::cout << "PHA" << std::endl;
-			memory[0x100+RAQ_STACK--] = RAQ_ACC;
-			opbytes = 1;
-			break;
+// Orders the event heap so the earliest event is at the front
+// Events due on the same cycle run in EventType order. Recorded input was applied after runCycles()
+// returned, so EV_INPUT coming last lets a replay see the machine exactly as the recording did.
+static bool eventLater(const Raquette::Event &a, const Raquette::Event &b){
+	return (a.when > b.when) || ((a.when == b.when) && (a.type > b.type));
+}
 
-		case uint8_t(0x08): // PHP
-			// Note: flag_b bit pushed is always 1 from BRK or PHP instruction
-			tmp = (flag_n<<7) + (flag_v<<6) + (0x1<<5) + (0x1<<4) + (flag_d<<3) + (flag_i<<2) + (flag_z<<1) + (flag_c);
-			if(verbose) std::cout << "PHP S:" << std::hex << tmp << std::dec << std::endl;
-			memory[0x100+RAQ_STACK--] = tmp;
-			opbytes = 1;
-			break;
+// Queues an event to run once the cycle count reaches when
+// An event due before the end of the current run cuts the run short.
+void Raquette::schedule(EventType type, uint64_t when){
+	events.push_back({when, type});
+	std::push_heap(events.begin(), events.end(), eventLater);
+	if(when < runLimit){
+		runLimit = when;
+		blockStop = true;
+	}
+}
 
-		case uint8_t(0x68): // PLA
-			if(verbose) std::cout << "PLA" << std::endl;
-			RAQ_STACK += 1;
-			RAQ_ACC = (memory[0x100+RAQ_STACK]);
-			flag_z = (RAQ_ACC == 0); // Zero flag if zero
-			flag_n = ((RAQ_ACC & 0b10000000) != 0); // Negative flag if sign bit set
-			opbytes = 1;
-			break;
+// Drops any pending events of the given type
+void Raquette::cancel(EventType type){
+	auto end = std::remove_if(events.begin(), events.end(), [type](const Event &ev){ return ev.type == type; });
+	if(end == events.end()) return;
+	events.erase(end, events.end());
+	std::make_heap(events.begin(), events.end(), eventLater);
+}
 
-		case uint8_t(0x28): // PLP
-			if(verbose) std::cout << "PLP" << std::endl;
-			RAQ_STACK += 1;
-			tmp = (memory[0x100+RAQ_STACK]);
+bool Raquette::pending(EventType type){
+	for(const Event &ev : events){
+		if(ev.type == type) return true;
+	}
+	return false;
+}
 
-			flag_c = ((tmp & 0b00000001) !=0);
-			flag_z = ((tmp & 0b00000010) !=0);
-			flag_i = ((tmp & 0b00000100) !=0);
-			flag_d = ((tmp & 0b00001000) !=0);
-			flag_b = ((tmp & 0b00010000) !=0);
-			flag_v = ((tmp & 0b01000000) !=0);
-			flag_n = ((tmp & 0b10000000) !=0);
+// Runs every event that is due, earliest first
+void Raquette::runEvents(){
+	while(!events.empty() && (events.front().when <= cycles)){
+		EventType type = events.front().type;
+		std::pop_heap(events.begin(), events.end(), eventLater);
+		events.pop_back();
+		(this->*eventHandlers[type])();
+	}
+}
 
-			opbytes = 1;
-			break;
+void Raquette::vblEvent(){
+	frames++;
+	schedule(EV_VBL, cycles - (cycles % FRAME_CYCLES) + FRAME_CYCLES);
+}
 
-		case uint8_t(0x90): // BCC
-			if(verbose) std::cout << "BCC ";
-			if(flag_c == false){
-				if(verbose) std::cout << "taken\n";
-				branchHelper(); // This changes PC appropriately
-			}else{
-				if(verbose) std::cout << "not taken\n";
-			}
-			opbytes = 2; // Always increment by 2 regardless
-			break;
+// Lets the rotor react to the magnets once they have been steady for STEPPER_CYCLES
+void Raquette::stepperEvent(){
+	disk.stepper();
+}
 
-		case uint8_t(0xB0): // BCS
-			if(verbose) std::cout << "BCS ";
-			if(flag_c == true){
-				if(verbose) std::cout << "taken\n";
-				branchHelper(); // This changes PC appropriately
-			}else{
-				if(verbose) std::cout << "not taken\n";
-			}
-			opbytes = 2; // Always increment by 2 regardless
-			break;
+// Called for every stepper phase change
+void Raquette::stepperHelper(){
+	if(!pending(EV_STEPPER)) schedule(EV_STEPPER, cycles + STEPPER_CYCLES);
+}
 
-		case uint8_t(0xF0): // BEQ
-			if(verbose) std::cout << "BEQ ";
-			if(flag_z == true){
-				if(verbose) std::cout << "taken\n";
-				branchHelper(); // This changes PC appropriately
-			}else{
-				if(verbose) std::cout << "not taken\n";
-			}
-			opbytes = 2; // Always increment by 2 regardless
-			break;
+// Sets the strobe again without changing the key, as if it had been pressed again
+void Raquette::keyRepeatEvent(){
+	memory[0xC000] |= 0b10000000;
+	schedule(EV_KEY_REPEAT, cycles + REPEAT_CYCLES);
+}
 
-		case uint8_t(0x30): // BMI
-			if(verbose) std::cout << "BMI ";
-			if(flag_n == true){
-				if(verbose) std::cout << "taken\n";
-				branchHelper(); // This changes PC appropriately
-			}else{
-				if(verbose) std::cout << "not taken\n";
-			}
-			opbytes = 2; // Always increment by 2 regardless
-			break;
+// Sets the keyboard latch, val has bit 7 set for a new key press
+void Raquette::keyInput(uint8_t val){
+	if(replayingInput || (val == memory[0xC000])) return;
+	if(recordingInput) inputLog.push_back({cycles, IN_KEY, val});
+	inputHelper(IN_KEY, val);
+}
 
-		case uint8_t(0xD0): // BNE
-			if(verbose) std::cout << "BNE ";
-			if(flag_z == false){
-				if(verbose) std::cout << "taken\n";
-				branchHelper(); // This changes PC appropriately
-			}else{
-				if(verbose) std::cout << "not taken\n";
-			}
-			opbytes = 2; // Always increment by 2 regardless
-			break;
+// Tells the machine whether the REPT key is down
+void Raquette::setRepeat(bool held){
+	if(replayingInput || (held == repeatHeld)) return;
+	if(recordingInput) inputLog.push_back({cycles, IN_REPEAT, held});
+	inputHelper(IN_REPEAT, held);
+}
 
-		case uint8_t(0x10): // BPL
-			if(verbose) std::cout << "BPL ";
-			if(flag_n == false){
-				if(verbose) std::cout << "taken\n";
-				branchHelper(); // This changes PC appropriately
-			}else{
-				if(verbose) std::cout << "not taken\n";
-			}
-			opbytes = 2; // Always increment by 2 regardless
-			break;
+// Applies one input, live or replayed
+void Raquette::inputHelper(InputType type, uint8_t value){
+	if(type == IN_KEY){
+		memory[0xC000] = value;
+	}else if(value && !repeatHeld){
+		repeatHeld = true;
+		schedule(EV_KEY_REPEAT, cycles + REPEAT_CYCLES);
+	}else if(!value && repeatHeld){
+		repeatHeld = false;
+		cancel(EV_KEY_REPEAT);
+	}
+}
 
-		case uint8_t(0x50): // BVC
-			if(verbose) std::cout << "BVC ";
-			if(flag_v == false){
-				if(verbose) std::cout << "taken\n";
-				branchHelper(); // This changes PC appropriately
-			}else{
-				if(verbose) std::cout << "not taken\n";
-			}
-			opbytes = 2; // Always increment by 2 regardless
-			break;
+// Applies every recorded input that is due, then waits for the next one
+void Raquette::inputEvent(){
+	if((replayPos < inputLog.size()) && (inputLog[replayPos].cycles < cycles)){
+		// Cannot happen if the replay started from the recorded state
+		*log << "Input replay is out of step, input for cycle " << inputLog[replayPos].cycles
+			<< " applied at cycle " << cycles << std::endl;
+	}
+	while((replayPos < inputLog.size()) && (inputLog[replayPos].cycles <= cycles)){
+		inputHelper(inputLog[replayPos].type, inputLog[replayPos].value);
+		replayPos++;
+	}
+	if(replayPos < inputLog.size()){
+		schedule(EV_INPUT, inputLog[replayPos].cycles);
+	}else{
+		replayingInput = false; // Back to live input
+	}
+}
 
-		case uint8_t(0x70): // BVS
-			if(verbose) std::cout << "BVS ";
-			if(flag_v == true){
-				if(verbose) std::cout << "taken\n";
-				branchHelper(); // This changes PC appropriately
-			}else{
-				if(verbose) std::cout << "not taken\n";
-			}
-			opbytes = 2; // Always increment by 2 regardless
-			break;
+void Raquette::startRecording(){
+	stopReplay();
+	inputLog.clear();
+	inputStart = cycles;
+	recordingInput = true;
+}
 
-		case uint8_t(0x38): // SEC
-			if(verbose) std::cout << "SEC\n";
-			flag_c = true;
-			opbytes = 1;
-			break;
+void Raquette::stopRecording(){
+	recordingInput = false;
+}
 
-		case uint8_t(0xF8): // SED
-			if(verbose) std::cout << "SED\n";
-			flag_d = true;
-			opbytes = 1;
-			break;
+// Input due on the cycle the replay starts at is applied at once, as it was when recorded
+bool Raquette::startReplay(){
+	if(cycles != inputStart){
+		*log << "Input was recorded from cycle " << inputStart << ", the machine is at cycle " << cycles << std::endl;
+		return false;
+	}
+	stopRecording();
+	cancel(EV_INPUT);
+	replayPos = 0;
+	replayingInput = true;
+	replaySession = true;
+	inputEvent();
+	return true;
+}
 
-		case uint8_t(0x78): // SEI
-			if(verbose) std::cout << "SEI\n";
-			flag_i = true;
-			opbytes = 1;
-			break;
+void Raquette::stopReplay(){
+	cancel(EV_INPUT);
+	replayingInput = false;
+	replaySession = false;
+}
 
-		case uint8_t(0x18): // CLC
-			if(verbose) std::cout << "CLC\n";
-			flag_c = false;
-			opbytes = 1;
-			break;
+// Input log files start with this header, then hold one record after another as
+// the cycles since the previous record (a little endian base 128 varint), the type and the value.
+// Most records take 4 bytes.
+struct InputFileHeader {
+	char magic[8]; // "RAQINPUT"
+	uint32_t version; // Raquette::INPUT_VERSION
+	uint32_t count; // Records that follow
+	uint64_t start; // Raquette::inputStart
+};
+static const char INPUT_MAGIC[8] = {'R', 'A', 'Q', 'I', 'N', 'P', 'U', 'T'};
+
+bool Raquette::saveInput(const char *fileName){
+	InputFileHeader header = {};
+	std::copy(INPUT_MAGIC, INPUT_MAGIC+8, header.magic);
+	header.version = INPUT_VERSION;
+	header.count = inputLog.size();
+	header.start = inputStart;
+	std::vector<uint8_t> bytes((const uint8_t *)&header, (const uint8_t *)&header + sizeof(header));
+	uint64_t last = inputStart;
+	for(const InputRecord &rec : inputLog){
+		uint64_t delta = rec.cycles - last;
+		last = rec.cycles;
+		while(delta >= 0x80){
+			bytes.push_back(uint8_t(delta) | 0x80);
+			delta >>= 7;
+		}
+		bytes.push_back(uint8_t(delta));
+		bytes.push_back(rec.type);
+		bytes.push_back(rec.value);
+	}
+	std::ofstream outfile(fileName, std::ios::binary | std::ios::out | std::ios::trunc);
+	if(outfile){
+		outfile.write((const char *)bytes.data(), bytes.size());
+	}
+	if(!outfile){
+		*log << "Cannot write input log " << fileName << std::endl;
+		return false;
+	}
+	return true;
+}
 
-		case uint8_t(0xD8): // CLD
-			if(verbose) std::cout << "CLD\n";
-			flag_d = false;
-			opbytes = 1;
-			break;
+// Reads a log written by saveInput(), leaving the current one alone if the file is damaged
+bool Raquette::loadInput(const char *fileName){
+	std::ifstream infile(fileName, std::ios::binary | std::ios::in);
+	if(!infile){
+		*log << "Cannot open input log " << fileName << std::endl;
+		return false;
+	}
+	std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+	InputFileHeader header;
+	if(bytes.size() < sizeof(header)){
+		*log << fileName << " is not an input log\n";
+		return false;
+	}
+	std::copy(bytes.begin(), bytes.begin() + sizeof(header), (uint8_t *)&header);
+	if(!std::equal(INPUT_MAGIC, INPUT_MAGIC+8, header.magic) || (header.version != INPUT_VERSION)){
+		*log << fileName << " is not an input log of version " << INPUT_VERSION << std::endl;
+		return false;
+	}
 
-		case uint8_t(0x58): // CLI
-			if(verbose) std::cout << "CLI\n";
-			flag_i = false;
-			opbytes = 1;
-			break;
+	std::vector<InputRecord> records;
+	uint64_t when = header.start;
+	size_t pos = sizeof(header);
+	for(uint32_t i=0; i < header.count; i++){
+		uint64_t delta = 0;
+		for(int shift=0; ; shift += 7){
+			if((pos >= bytes.size()) || (shift > 63)) break;
+			uint8_t byte = bytes[pos++];
+			delta |= uint64_t(byte & 0x7F) << shift;
+			if(!(byte & 0x80)) break;
+		}
+		if((pos + 2 > bytes.size()) || (bytes[pos] > IN_REPEAT)){
+			*log << "Input log " << fileName << " is damaged at record " << i << std::endl;
+			return false;
+		}
+		when += delta;
+		records.push_back({when, InputType(bytes[pos]), bytes[pos+1]});
+		pos += 2;
+	}
+	stopReplay();
+	inputLog.swap(records);
+	inputStart = header.start;
+	return true;
+}
 
-		case uint8_t(0xB8): // CLV
-			if(verbose) std::cout << "CLV\n";
-			flag_v = false;
-			opbytes = 1;
-			break;
+// Raises the IRQ line on behalf of a device, source is its bit in irqLines
+void Raquette::assertIRQ(unsigned source){
+	irqLines |= (1u << source);
+	if(!pending(EV_INTERRUPT)) schedule(EV_INTERRUPT, cycles);
+}
 
-		default:
-			std::cout << "Undefined instruction:" << std::hex << (int) thisbyte << std::dec << std::endl;
-			pc++;
-			return 1;
-			break;
+// Drops a device's hold on the IRQ line, usually once its handler has serviced it
+void Raquette::releaseIRQ(unsigned source){
+	irqLines &= ~(1u << source);
+}
+
+void Raquette::assertNMI(){
+	nmiPending = true;
+	if(!pending(EV_INTERRUPT)) schedule(EV_INTERRUPT, cycles);
+}
+
+// Takes a pending NMI, or an IRQ if interrupts are enabled
+// A masked IRQ stays pending until CLI, PLP or RTI clears the I flag (see irqUnmaskHelper()).
+void Raquette::interruptEvent(){
+	if(nmiPending){
+		nmiPending = false;
+		interruptHelper(0xFFFA);
+	}else if(irqLines && !(status & FLAG_I)){
+		interruptHelper(0xFFFE);
 	}
-	// TODO use opcycles for timer callbacks
-	pc += opbytes;
-	return !((pc > 0) && (pc < num_words));
+}
+
+// Enters an interrupt handler through the given vector, like BRK but with the B bit clear
+void Raquette::interruptHelper(uint16_t vector){
+	memory[0x100+RAQ_STACK--] = ((pc>>8) & 0b11111111);
+	memory[0x100+RAQ_STACK--] = (pc & 0b11111111);
+	memory[0x100+RAQ_STACK--] = getStatus() & ~FLAG_B;
+	status |= FLAG_I;
+	pc = (memory[vector+1] << 8) + memory[vector];
+	cycles += 7;
+	idle = false;
+}
 
+// Called when an instruction clears the I flag, so a held IRQ is taken after it
+void Raquette::irqUnmaskHelper(){
+	if(irqLines && !(status & FLAG_I) && !pending(EV_INTERRUPT)) schedule(EV_INTERRUPT, cycles);
 }
 
+// Runs instructions until at least budget cycles have elapsed
+// Whole instructions are always executed, so the last one may run past the budget.
+// That overshoot is subtracted from the next call to keep long-run timing exact.
+Raquette::StopReason Raquette::runCycles(uint64_t budget){
+	uint64_t target = cycles - overshoot + budget;
+	bool everyStep = profiling || tracing; // Instruments each instruction, so no blocks
+	bool useBlocks = (useBlockCache || useIdleSkip) && !everyStep;
+	Block *prev = nullptr; // Block that ran last, if nothing was stepped since
+	idle = false;
+	while(cycles < target){
+		// Run straight up to the next event, or to the end of the budget if that comes first
+		runLimit = std::min(target, nextEvent());
+		while(cycles < runLimit){
+			if(jit && jit->full()){
+				// Out of space for native code, start again from an empty cache
+				flushBlockCache();
+				jit->reset();
+			}
+
+			// The block after the last one is usually the same as last time, so it is chained
+			// and only looked up when that guess is wrong or blocks were dropped since.
+			Block *block = nullptr;
+			if(prev && (prev->nextEpoch == blockEpoch) && (prev->nextPc == pc) && prev->next){
+				block = prev->next;
+			}else if(useBlocks){
+				block = findBlock(pc);
+				if(prev){
+					prev->next = block;
+					prev->nextPc = pc;
+					prev->nextEpoch = blockEpoch;
+				}
+			}
+			if(block && !useBlockCache && !(useIdleSkip && block->idleCycles)) block = nullptr;
+
+			// A block only runs if it cannot reach the limit before its last instruction,
+			// so we stop on the same instruction as when stepping one at a time.
+			int halted;
+			prev = block;
+			if(!block || (cycles + block->maxCycles > runLimit)){
+				prev = nullptr;
+				if(!everyStep) halted = stepT<NoTrace>();
+				else if(profiling) halted = stepT<Profile>();
+				else halted = stepT<Trace>();
+			}else if(useIdleSkip && block->idleCycles){
+				halted = runIdle(*block, runLimit);
+			}else if(useJit && !irqLines && jitBlock(*block)){
+				// Translated code cannot notice CLI or PLP unmasking a held IRQ
+				halted = runNative(*block, runLimit);
+			}else{
+				halted = runBlock(*block);
+			}
+			if(halted){
+				overshoot = 0;
+				runLimit = 0;
+				return STOP_HALT;
+			}
+		}
+		runLimit = 0;
+		runEvents();
+	}
+	overshoot = cycles - target;
+	return STOP_BUDGET;
+}
 
 int Raquette::runMicroSeconds(unsigned int microseconds){
 	// At 1 MHz we do 1 cycle per microsecond
-	// TODO count cycles
-	// Average IPC is 0.43 so as an estimate,
-	unsigned int instructions = (microseconds*0.43);
-	for(unsigned int i=0; i<instructions; i++){
-		if(step(false)) return 1;
+	return (runCycles(microseconds) == STOP_HALT);
+}
+
+static const char STATE_MAGIC[8] = {'R', 'A', 'Q', 'S', 'T', 'A', 'T', 'E'};
+
+// Copies the whole machine into state
+// Caches (blocks, JIT code, trace and profile) are not part of the machine and are not saved.
+void Raquette::captureState(SaveState &state){
+	std::copy(STATE_MAGIC, STATE_MAGIC+8, state.magic);
+	state.version = STATE_VERSION;
+	state.size = sizeof(SaveState);
+	state.cycles = cycles;
+	state.overshoot = overshoot;
+	state.instructions = instructions;
+	state.frames = frames;
+	state.idleSkipped = idleSkipped;
+	state.pc = pc;
+	for(int i=0; i<4; i++){
+		state.regs[i] = regs[i];
 	}
-	return 0;
+	state.p = getStatus();
+	state.graphicsMode = graphics_mode;
+	state.fullScreen = full_screen;
+	state.pageTwo = page_two;
+	state.hiRes = hi_res;
+	state.repeatHeld = repeatHeld;
+	state.nmiPending = nmiPending;
+	state.irqLines = irqLines;
+	state.stepperPhase = disk.stepperPhase;
+	state.halftrack = disk.halftrack;
+	state.stepperMagnets = disk.stepper_p0 | (disk.stepper_p1 << 1) | (disk.stepper_p2 << 2) | (disk.stepper_p3 << 3);
+	state.spinning = disk.spinning;
+	state.drive = disk.drive;
+	// Every event type is pending at most once, so this cannot overflow
+	// A pending replay is host input rather than part of the machine, restoreState() picks it up again.
+	assert(events.size() <= STATE_MAX_EVENTS);
+	state.numEvents = 0;
+	for(unsigned i=0; i < STATE_MAX_EVENTS; i++){
+		state.events[i] = {0, 0, 0};
+	}
+	for(const Event &ev : events){
+		if(ev.type != EV_INPUT) state.events[state.numEvents++] = {ev.when, ev.type, 0};
+	}
+	std::copy(memory, memory+0x10000, state.memory);
+	std::copy(&disk.disk[0][0][0], &disk.disk[0][0][0] + RaqDisk::DISK_BYTES, &state.disk[0][0][0]);
+}
+
+// Copies src over dest 256 bytes at a time, skipping the parts that are already the same
+// so that restoring a state does not unshare pages it leaves unchanged.
+static void copyChangedHelper(const uint8_t *src, uint8_t *dest, size_t len){
+	for(size_t i=0; i < len; i += 0x100){
+		if(!std::equal(src + i, src + i + 0x100, dest + i)){
+			std::copy(src + i, src + i + 0x100, dest + i);
+		}
+	}
+}
+
+// Puts the machine back exactly as captureState() found it
+// Returns false, leaving the machine untouched, if state is from another version or is damaged.
+bool Raquette::restoreState(const SaveState &state){
+	if(!std::equal(STATE_MAGIC, STATE_MAGIC+8, state.magic)){
+		*log << "Not a Raquette save state\n";
+		return false;
+	}
+	if((state.version != STATE_VERSION) || (state.size != sizeof(SaveState))){
+		*log << "Save state is version " << state.version << ", expected version " << STATE_VERSION << std::endl;
+		return false;
+	}
+	if(state.numEvents > STATE_MAX_EVENTS){
+		*log << "Save state has too many events\n";
+		return false;
+	}
+	if((state.stepperPhase > 3) || (state.halftrack > 68)){
+		*log << "Save state has the disk head out of range\n";
+		return false;
+	}
+	for(unsigned i=0; i < state.numEvents; i++){
+		if(state.events[i].type >= EV_COUNT){
+			*log << "Save state has an unknown event\n";
+			return false;
+		}
+	}
+
+	cycles = state.cycles;
+	overshoot = state.overshoot;
+	instructions = state.instructions;
+	frames = state.frames;
+	idleSkipped = state.idleSkipped;
+	pc = state.pc;
+	for(int i=0; i<4; i++){
+		regs[i] = state.regs[i];
+	}
+	setStatus(state.p);
+	graphics_mode = state.graphicsMode;
+	full_screen = state.fullScreen;
+	page_two = state.pageTwo;
+	hi_res = state.hiRes;
+	repeatHeld = state.repeatHeld;
+	nmiPending = state.nmiPending;
+	irqLines = state.irqLines;
+	disk.stepperPhase = state.stepperPhase;
+	disk.halftrack = state.halftrack;
+	disk.stepper_p0 = state.stepperMagnets & 1;
+	disk.stepper_p1 = state.stepperMagnets & 2;
+	disk.stepper_p2 = state.stepperMagnets & 4;
+	disk.stepper_p3 = state.stepperMagnets & 8;
+	disk.spinning = state.spinning;
+	disk.drive = state.drive;
+	events.clear();
+	for(unsigned i=0; i < state.numEvents; i++){
+		if(state.events[i].type != EV_INPUT) events.push_back({state.events[i].when, EventType(state.events[i].type)});
+	}
+	std::make_heap(events.begin(), events.end(), eventLater);
+	// Input already applied at the restored cycle stays applied. A recording forgets anything later,
+	// since history now takes another path, and a replay carries on from the next record due.
+	// A replay that already ran out starts again if the restored cycle is before its end.
+	auto firstLater = std::upper_bound(inputLog.begin(), inputLog.end(), cycles,
+		[](uint64_t when, const InputRecord &rec){ return when < rec.cycles; });
+	if(recordingInput){
+		inputLog.erase(firstLater, inputLog.end());
+	}else if(replaySession){
+		replayPos = firstLater - inputLog.begin();
+		replayingInput = (replayPos < inputLog.size());
+		if(replayingInput) schedule(EV_INPUT, inputLog[replayPos].cycles);
+	}
+	// Cached code stays valid on pages whose bytes do not change, so restoring a state close to
+	// the current one (run-ahead, rewind) keeps the blocks and native code built so far
+	for(int page=0; page<0x100; page++){
+		if((codeOverlaid[page] || !pageBlocks[page].empty())
+			&& !std::equal(state.memory + (page<<8), state.memory + (page<<8) + 0x100, memory + (page<<8))){
+			invalidateCodePage(page);
+		}
+	}
+	copyChangedHelper(state.memory, memory, 0x10000);
+	copyChangedHelper(&state.disk[0][0][0], &disk.disk[0][0][0], RaqDisk::DISK_BYTES);
+	idle = false;
+	screen_update = true;
+	return true;
+}
+
+// Renders the screen as it will be the given number of frames from now, then puts the machine back
+// The host can show the effect of new input a few frames sooner without the guest seeing any
+// difference. Only what changes on screen over those frames is redrawn, and the same parts are
+// marked so the next renderScreen() puts the real frame back. Returns false if nothing was redrawn.
+bool Raquette::renderAhead(unsigned count){
+	if(tracing || profiling) return renderScreen(); // Would record instructions that never happen
+	if(!aheadState) aheadState = new SaveState();
+	captureState(*aheadState);
+	bool wasIdle = idle;
+	bool wasShown = flashShown;
+	bool wasReplaying = replayingInput;
+	runCycles(uint64_t(count) * FRAME_CYCLES);
+	bool drawn = renderScreen(); // Redraws the marks made before and during the run
+	// Running past the last record of a replay ends it, but back at the saved cycle the records
+	// after it are still to come. With the replay restored, restoreState() picks the next one again.
+	replayingInput = wasReplaying;
+	restoreState(*aheadState);
+	idle = wasIdle;
+	flashShown = wasShown; // The cells drawn in the other phase are marked below
+	// restoreState() asks for the whole screen, but only what was just drawn differs from the
+	// real frame. Marks left from before the run were drawn too, so they are marked again below.
+	screen_update = false;
+	for(const DirtyRect &rect : dirtyRects){
+		markRectHelper(rect);
+	}
+	return drawn;
+}
+
+// Writes a save state file, returns false if it cannot be written
+bool Raquette::saveState(const char *fileName){
+	SaveState *state = new SaveState(); // Zeroed, so padding is saved as zeros
+	captureState(*state);
+	std::ofstream outfile(fileName, std::ios::binary | std::ios::out | std::ios::trunc);
+	if(outfile){
+		outfile.write((const char *)state, sizeof(SaveState));
+	}
+	delete state;
+	if(!outfile){
+		*log << "Cannot write save state " << fileName << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Restores a save state file written by saveState()
+// The file is mapped rather than read, so restoring costs little more than copying memory and disk.
+bool Raquette::loadState(const char *fileName){
+	int fd = open(fileName, O_RDONLY);
+	if(fd < 0){
+		*log << "Cannot open save state " << fileName << std::endl;
+		return false;
+	}
+	struct stat st;
+	if((fstat(fd, &st) != 0) || (st.st_size != sizeof(SaveState))){
+		*log << fileName << " is not a save state of this version\n";
+		close(fd);
+		return false;
+	}
+	void *mapped = mmap(nullptr, sizeof(SaveState), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mapped == MAP_FAILED){
+		*log << "Cannot map save state " << fileName << std::endl;
+		return false;
+	}
+	bool ok = restoreState(*(const SaveState *)mapped);
+	munmap(mapped, sizeof(SaveState));
+	return ok;
 }
 
 void Raquette::show_regs() {
@@ -1823,14 +2264,15 @@ void Raquette::show_regs() {
 		<< "  x:" << std::hex << (int) RAQ_X << std::dec
 		<< "  y:" << std::hex << (int) RAQ_Y << std::dec
 		<< "  sp:" << std::hex << (int) RAQ_STACK << std::dec
+		<< "  cycles:" << cycles
 		<< std::endl;
-	std::cout << "Status flags: C" << flag_c
-		<< " Z" << flag_z
-		<< " I" << flag_i
-		<< " D" << flag_d
-		<< " B" << flag_b
-		<< " V" << flag_v
-		<< " N" << flag_n
+	std::cout << "Status flags: C" << flagC()
+		<< " Z" << flagZ()
+		<< " I" << ((status & FLAG_I) != 0)
+		<< " D" << ((status & FLAG_D) != 0)
+		<< " B" << ((status & FLAG_B) != 0)
+		<< " V" << ((status & FLAG_V) != 0)
+		<< " N" << flagN()
 		<< std::endl;
 }
 
@@ -1856,52 +2298,50 @@ void Raquette::consoleSession(){
 	keypad(stdscr, TRUE); // Capture backspace, delete, arrow keys
 	curs_set(0); // Invisible cursor
 	WINDOW *win = newwin(24, 40, 0, 0);
-	wtimeout(win, 1); // Nonblocking getch
 	char ch;
-	int numstep = 0;
-
-	do{
-		numstep++;
-
-		// Displaying every 500 steps gives roughly accurate performance for 1MHz
-		if(0==(numstep%500)){
-			// We will print the rows in memory-order
-			wmove(win, 0, 0);
-			for(int i=0; i<24; i++){
-				int row = (8*(i%3))+(i/3);
-				int rowaddr = (0x400 + (i*40) + ((i/3)*8));
-				int col = 0;
-				for(int j=0; j<40; j++){
-					if((memory[rowaddr+j] >= 0x40) && (memory[rowaddr+j] <= 0x7F)){
-						// Blinking character
-						if((numstep%300000) < 200000){
-							mvwaddch(win, row, col, RAQ_CHAR(memory[rowaddr+j]));
-							mvwchgat(win, row, col++, 1, A_STANDOUT, 0, NULL);
-						}else{
-							mvwaddch(win, row, col, RAQ_CHAR(memory[rowaddr+j]));
-							mvwchgat(win, row, col++, 1, A_NORMAL, 0, NULL);
-							//mvwaddch(win, row, col++, ' ');
-						}
+	unsigned slice = 1000;
+
+	// Displaying every 1000 cycles gives roughly accurate performance for 1MHz
+	while(runCycles(slice) == STOP_BUDGET){
+		// We will print the rows in memory-order
+		wmove(win, 0, 0);
+		for(int i=0; i<24; i++){
+			int row = (8*(i%3))+(i/3);
+			int rowaddr = (0x400 + (i*40) + ((i/3)*8));
+			int col = 0;
+			for(int j=0; j<40; j++){
+				if((memory[rowaddr+j] >= 0x40) && (memory[rowaddr+j] <= 0x7F)){
+					// Blinking character
+					if(flashHelper()){
+						mvwaddch(win, row, col, RAQ_CHAR(memory[rowaddr+j]));
+						mvwchgat(win, row, col++, 1, A_STANDOUT, 0, NULL);
 					}else{
-						// Normal character
-						mvwaddch(win, row, col++, RAQ_CHAR(memory[rowaddr+j]));
+						mvwaddch(win, row, col, RAQ_CHAR(memory[rowaddr+j]));
+						mvwchgat(win, row, col++, 1, A_NORMAL, 0, NULL);
+						//mvwaddch(win, row, col++, ' ');
 					}
+				}else{
+					// Normal character
+					mvwaddch(win, row, col++, RAQ_CHAR(memory[rowaddr+j]));
 				}
 			}
+		}
 
-			wrefresh(win);
+		wrefresh(win);
 
-			ch = wgetch(win);
-			//std::cout << "Entered " << std::hex << (int) ch << std::dec << std::endl;
-			if(ch != ERR){
-				if(ch == 0xA){ // 0xA is line feed, and 0xD is CR. The Apple 2 expects the latter.
-					memory[0xC000] = 0x0D | 0b10000000;
-				}else{
-					memory[0xC000] = ch | 0b10000000;
-				}
+		// With nothing to do until a key arrives, sleep for up to 20 ms and skip as many cycles
+		wtimeout(win, idle ? 20 : 1);
+		slice = idle ? 20000 : 1000;
+		ch = wgetch(win);
+		//std::cout << "Entered " << std::hex << (int) ch << std::dec << std::endl;
+		if(ch != ERR){
+			if(ch == 0xA){ // 0xA is line feed, and 0xD is CR. The Apple 2 expects the latter.
+				keyInput(0x0D | 0b10000000);
+			}else{
+				keyInput(ch | 0b10000000);
 			}
 		}
-	}while(!step(false));
+	}
 
 	// only endwin when exiting
 	endwin();
@@ -1912,90 +2352,284 @@ void Raquette::consoleSession(){
 // In text mode, characters are 5p wide and 7p tall, padded to 7p x 8p
 // This yields (280/7)=40 char wide, (192/8)=24 char tall
 // The extra padding is 2px on the right and 1px on the bottom.
-// TODO Need cycle counting for char blink
-// TODO add force render option
-bool Raquette::renderScreen(){
+// Pixel rows are in reverse order
+const uint8_t Raquette::charset[0x40*7] = {
+	0x70,0x80,0xba,0xaa,0xba,0x8a,0x70, // @
+	0x88,0x88,0x88,0xf8,0x88,0x88,0x70, // A
+	0xf0,0x88,0x88,0xf0,0x88,0x88,0xf0, // B
+	0x70,0x88,0x80,0x80,0x80,0x88,0x70, // C
+	0xf0,0x88,0x88,0x88,0x88,0x88,0xf0, // D
+	0xfa,0x80,0x80,0xf0,0x80,0x80,0xf8, // E
+	0x80,0x80,0x80,0xf0,0x80,0x80,0xf8, // F
+	0x70,0x88,0x98,0x80,0x80,0x88,0x70, // G
+	0x88,0x88,0x88,0xf8,0x88,0x88,0x88, // H
+	0xf8,0x20,0x20,0x20,0x20,0x20,0xf8, // I
+	0x70,0x88,0x08,0x08,0x08,0x08,0x78, // J
+	0x88,0x88,0x90,0xe0,0x90,0x88,0x88, // K
+	0xf8,0x80,0x80,0x80,0x80,0x80,0x80, // L
+	0x88,0x88,0x88,0x88,0xa8,0xd8,0x88, // M
+	0x88,0x88,0x98,0xa8,0xc8,0x88,0x88, // N
+	0x70,0x88,0x88,0x88,0x88,0x88,0x70, // O
+	0x80,0x80,0x80,0xf0,0x88,0x88,0xf0, // P
+	0x68,0x90,0xa8,0x88,0x88,0x88,0x70, // Q
+	0x88,0x88,0x88,0xf0,0x88,0x88,0xf0, // R
+	0xf0,0x08,0x08,0x70,0x80,0x80,0x78, // S
+	0x20,0x20,0x20,0x20,0x20,0x20,0xf8, // T
+	0x70,0x88,0x88,0x88,0x88,0x88,0x88, // U
+	0x20,0x50,0x88,0x88,0x88,0x88,0x88, // V
+	0x88,0xd8,0xa8,0x88,0x88,0x88,0x88, // W
+	0x88,0x88,0x50,0x20,0x50,0x88,0x88, // X
+	0x20,0x20,0x20,0x20,0x50,0x88,0x88, // Y
+	0xf8,0x80,0x40,0x20,0x10,0x0a,0xf8, // Z
+	0x30,0x20,0x20,0x20,0x20,0x20,0x30, // [
+	0x00,0x08,0x10,0x20,0x40,0x80,0x00, // \ slash
+	0x60,0x20,0x20,0x20,0x20,0x20,0x60, // ]
+	0x00,0x00,0x00,0x00,0x88,0x50,0x20, // ^
+	0xf8,0x00,0x00,0x00,0x00,0x00,0x00, // _
+	0x00,0x00,0x00,0x00,0x00,0x00,0x00, // (blank)
+	0x20,0x00,0x20,0x20,0x20,0x20,0x20, // !
+	0x00,0x00,0x00,0x00,0x00,0x50,0x50, // "
+	0x50,0x50,0xfa,0x50,0xfa,0x50,0x50, // #
+	0x20,0xf0,0x2a,0x70,0xa0,0x7a,0x20, // $
+	0x18,0x98,0x40,0x20,0x10,0xca,0xc0, // %
+	0x68,0x90,0xfa,0x40,0xa0,0xa0,0x40, // &
+	0x00,0x00,0x00,0x00,0x00,0x20,0x20, // '
+	0x10,0x20,0x40,0x40,0x40,0x20,0x10, // (
+	0x40,0x20,0x10,0x10,0x10,0x20,0x40, // )
+	0x20,0xa8,0x70,0x20,0x70,0xa8,0x20, // *
+	0x00,0x20,0x20,0xfa,0x20,0x20,0x00, // +
+	0x40,0x20,0x20,0x00,0x00,0x00,0x00, // ,
+	0x00,0x00,0x00,0xf8,0x00,0x00,0x00, // -
+	0x20,0x00,0x00,0x00,0x00,0x00,0x00, // .
+	0x00,0x80,0x40,0x20,0x10,0x08,0x00, // /
+	0x70,0x88,0xc8,0xa8,0x98,0x88,0x70, // 0
+	0x70,0x20,0x20,0x20,0x20,0x60,0x20, // 1
+	0xf8,0x40,0x20,0x10,0x08,0x88,0x70, // 2
+	0x70,0x88,0x08,0x30,0x08,0x88,0x70, // 3
+	0x10,0x10,0x10,0xf8,0x90,0x50,0x30, // 4
+	0xf0,0x08,0x08,0xf0,0x80,0x80,0xf8, // 5
+	0x70,0x88,0x88,0xf0,0x80,0x80,0x70, // 6
+	0x40,0x40,0x40,0x20,0x10,0x08,0xf8, // 7
+	0x70,0x88,0x88,0x70,0x88,0x88,0x70, // 8
+	0x70,0x08,0x08,0x78,0x88,0x88,0x70, // 9
+	0x00,0x20,0x00,0x00,0x00,0x20,0x00, // :
+	0x40,0x20,0x20,0x00,0x00,0x20,0x00, // ;
+	0x10,0x20,0x40,0x80,0x40,0x20,0x10, // <
+	0x00,0x00,0xf8,0x00,0xf8,0x00,0x00, // =
+	0x40,0x20,0x10,0x08,0x10,0x20,0x40, // >
+	0x20,0x00,0x20,0x20,0x10,0x88,0x70, // ?
+};
 
-	if(screen_update){
-		int page_base = (page_two ? 0x800 : 0x400);
-		int hires_base = (page_two? 0x4000 : 0x2000);
-		for(int memrow=0; memrow<24; memrow++){
-			int row = (8*(memrow%3))+(memrow/3);
-			int rowaddr = (page_base + (memrow*40) + ((memrow/3)*8));
+// Redraws whatever dispWrite() marked, or everything if screen_update is set
+// Returns false if nothing needed redrawing. dirtyRects lists the parts that were redrawn, with
+// neighbouring cells in a row and neighbouring hi-res scanlines merged.
+bool Raquette::renderScreen(){
+	if(!dispBuf){
+		dispBuf = new char[192][280]();
+		screen_update = true;
+	}
+	dirtyRects.clear();
+	bool full = screen_update;
+	if(flashHelper() != flashShown){
+		flashShown = !flashShown;
+		if(!full) markFlashHelper();
+	}
+	if(!full && !displayDirty) return false;
+
+	for(int row=0; row<24; row++){
+		if(cellRowHelper(row)){
+			int first = -1; // Start of the current run of dirty cells
+			for(int col=0; col<=40; col++){
+				if((col < 40) && (full || cellDirty[row][col])){
+					renderCellHelper(row, col);
+					cellDirty[row][col] = false;
+					if(first < 0) first = col;
+				}else if(first >= 0){
+					dirtyRects.push_back({uint16_t(first*7), uint16_t(row*8), uint16_t((col-first)*7), 8});
+					first = -1;
+				}
+			}
+		}else{
+			for(int line=row*8; line<(row+1)*8; line++){
+				if(!full && !lineDirty[line]) continue;
+				renderLineHelper(line);
+				lineDirty[line] = false;
+				DirtyRect *last = dirtyRects.empty() ? nullptr : &dirtyRects.back();
+				if(last && (last->w == 280) && (last->y + last->h == line)){
+					last->h++;
+				}else{
+					dirtyRects.push_back({0, uint16_t(line), 280, 1});
+				}
+			}
+		}
+	}
+	if(full){
+		// Marks left from before a mode or page switch no longer mean anything
+		for(int row=0; row<24; row++){
 			for(int col=0; col<40; col++){
-				// If not graphics mode, or if we are printing the text lines for split mode
-				if((!graphics_mode) || ((!full_screen)&&(row>19))){
-					// Text Mode
-					for(int chary=1; chary<8; chary++){
-						for(int charx=0; charx<5; charx++){
-							char foo = 15*(((charset[(7*(1+(memory[rowaddr+col] % 0x40)))-chary])>>(7-charx))&0b1);
-							dispBuf[(row*8)+(chary-1)][(col*7)+charx] = foo; // 15 (white) or 0 (black)
-						}
-						for(int charx=5; charx<7; charx++){
-							dispBuf[(row*8)+(chary-1)][(col*7)+charx] = 0; // Clear last 2 pixels of each row
-						}
+				cellDirty[row][col] = false;
+			}
+		}
+		for(int line=0; line<192; line++){
+			lineDirty[line] = false;
+		}
+		dirtyRects.clear();
+		dirtyRects.push_back({0, 0, 280, 192});
+	}
+	displayDirty = false;
+	screen_update = false;
+	return true;
+}
+
+// Marks every cell and scanline inside rect, so the next renderScreen() redraws it whatever the mode
+void Raquette::markRectHelper(const DirtyRect &rect){
+	for(int line=rect.y; line<rect.y+rect.h; line++){
+		lineDirty[line] = true;
+	}
+	for(int row=rect.y/8; row<(rect.y+rect.h+7)/8; row++){
+		for(int col=rect.x/7; col<(rect.x+rect.w+6)/7; col++){
+			cellDirty[row][col] = true;
+		}
+	}
+	displayDirty = true;
+}
+
+// Flashing characters are inverse for 0.6 s and normal for 0.3 s of emulated time, so they
+// blink the same however fast the machine is run and come out the same in a replay
+bool Raquette::flashHelper(){
+	return (cycles % 900000) < 600000;
+}
+
+// Marks the text cells showing a flashing character
+void Raquette::markFlashHelper(){
+	int base = page_two ? 0x800 : 0x400;
+	for(int row=0; row<24; row++){
+		if(graphics_mode && (full_screen || (row < 20))) continue; // Not text
+		for(int col=0; col<40; col++){
+			uint8_t val = memory[base + ((row%8)*128) + ((row/8)*40) + col];
+			if((val >= 0x40) && (val <= 0x7F)){
+				cellDirty[row][col] = true;
+				displayDirty = true;
+			}
+		}
+	}
+}
+
+void Raquette::expandScreen(const DirtyRect &rect, uint32_t *dest, size_t pitch, unsigned scale, const uint32_t *palette){
+	raqExpandRect(raqExpandBest(), dispBuf, rect, dest, pitch, scale, palette);
+}
+
+// Text glyphs, ready to copy into dispBuf
+// Screen codes 0x00-0x3F are inverse, 0x40-0x7F flash and 0x80-0xFF are normal, each range
+// repeating the same 64 characters. The first index is the flash phase: flashing characters
+// are normal in phase 0 and inverse in phase 1, the others are the same in both.
+// Each glyph is 5x7 dots in the top left of its 7x8 cell, white (15) on black or black on white
+// when inverse. Rows are padded to 8 bytes to keep them aligned.
+struct GlyphTable {
+	uint8_t rows[2][256][8][8];
+};
+
+static constexpr GlyphTable buildGlyphTable(){
+	GlyphTable t{};
+	for(int phase=0; phase<2; phase++){
+		for(int code=0; code<256; code++){
+			bool inverse = (code < 0x40) || ((code < 0x80) && phase);
+			for(int y=0; y<8; y++){
+				for(int x=0; x<7; x++){
+					bool lit = false;
+					if((y < 7) && (x < 5)){
+						lit = (Raquette::charset[(7*(code % 0x40)) + 6 - y] >> (7-x)) & 0b1; // Pixel rows are stored in reverse order
 					}
-					for(int charx=0; charx<7; charx++){
-						dispBuf[(row*8)+(8-1)][(col*7)+charx] = 0; // Clear last extra row
+					t.rows[phase][code][y][x] = (lit != inverse) ? 15 : 0; // White or black
+				}
+			}
+		}
+	}
+	return t;
+}
+
+static constexpr GlyphTable glyphTable = buildGlyphTable();
+
+// Draws one 7x8 cell of text, or of lo-res graphics in graphics mode
+void Raquette::renderCellHelper(int row, int col){
+	uint8_t val = memory[(page_two ? 0x800 : 0x400) + ((row%8)*128) + ((row/8)*40) + col];
+	if((!graphics_mode) || ((!full_screen)&&(row>19))){
+		// Text Mode
+		const uint8_t (*glyph)[8] = glyphTable.rows[flashShown][val];
+		for(int chary=0; chary<8; chary++){
+			memcpy(&dispBuf[(row*8)+chary][col*7], glyph[chary], 7);
+		}
+	}else{
+		// LO-RES graphics
+		int topColor = (val>>4) & 0x0f;
+		int botColor = (val & 0x0f);
+		for(int blocky=1; blocky<9; blocky++){
+			for(int blockx=0; blockx<7; blockx++){
+				dispBuf[(row*8)+(blocky-1)][(col*7)+blockx] = (blocky < 5 ? botColor : topColor);
+			}
+		}
+	}
+}
+
+// Hi-res colours, worked out for every way a byte can be drawn
+// A lit dot is white if a dot next to it on the line is lit too, including the last dot of the
+// byte before and the first dot of the byte after. Otherwise its colour depends on whether it
+// falls on an even or odd pixel of the line and on the byte's palette bit (bit 7):
+// violet or blue on even pixels, green or orange on odd ones. A byte starts on an even pixel
+// in even columns, since each byte is 7 pixels wide.
+// Indexed by column parity, the previous byte's last dot, the byte itself and the next byte's
+// first dot. The eighth entry is padding so each can be copied as one 64-bit word.
+struct HiresTable {
+	uint8_t pixels[2][2][256][2][8];
+};
+
+static constexpr HiresTable buildHiresTable(){
+	HiresTable t{};
+	for(int odd=0; odd<2; odd++){
+		for(int prev=0; prev<2; prev++){
+			for(int byte=0; byte<256; byte++){
+				for(int next=0; next<2; next++){
+					// Dots -1 to 7, with the neighbours' dots at each end
+					int dots[9] = {prev, 0, 0, 0, 0, 0, 0, 0, next};
+					for(int i=0; i<7; i++){
+						dots[i+1] = (byte >> i) & 0b1;
 					}
-				}else if(hi_res && (col%2 == 0)){ // Print 2 char widths at a time (blocks of 14x8)
-					// HI-RES graphics
-					int rowaddr = hires_base + ((row%8)*128) + (row/8)*40; // Steps of 128, interleaved in groups of 8
-					for(int line=0; line<8; line++){ // 8 lines per char row
-						int dots[14];
-						for(int i=0; i<7; i++){
-							dots[i] = (memory[rowaddr+(1024*line)+(col)] >> i) & 0b1; // first byte 3.5 pixels
-							dots[i+7] = (memory[rowaddr+(1024*line)+(col)+1] >> i) & 0b1; // second byte 3.5 pixels
-						}
-						int palate1 = (memory[rowaddr+(1024*line)+(col)] >> 7) & 0b1;
-						int palate2 = (memory[rowaddr+(1024*line)+(col+1)] >> 7) & 0b1;
-
-						// join two chars and print 14 pixels per line
-						for (int pixel=0; pixel<7; pixel++){
-							int color1, color2;
-							if(dots[pixel*2] && dots[(pixel*2)+1]){
-								color1=15; // white
-								color2=15; // white
-							}else if(!dots[pixel*2] && dots[(pixel*2)+1]){
-								color1 = (palate1 ? 17 : 16); // Green or Orange
-								color2 = (palate2 ? 17 : 16); // Green or Orange
-							}else if(dots[pixel*2] && !dots[(pixel*2)+1]){
-								color1 = (palate1 ? 19 : 18); // Violet or Blue
-								color2 = (palate2 ? 19 : 18); // Violet or Blue
+					int palette = (byte >> 7) & 0b1;
+					for(int i=0; i<7; i++){
+						uint8_t colour = 0; // Black
+						if(dots[i+1]){
+							if(dots[i] || dots[i+2]){
+								colour = 15; // White
+							}else if((i + odd) % 2 == 0){
+								colour = (palette ? 19 : 18); // Violet or Blue
 							}else{
-								color1 = 0; // black
-								color2 = 0; // black
-							}
-							dispBuf[(8*row)+line][(col*7)+(pixel*2)] = dots[pixel*2] * ((pixel > 3) ? color2 : color1);
-							dispBuf[(8*row)+line][(col*7)+(pixel*2)+1] = dots[(pixel*2)+1] * ((pixel > 2) ? color2 : color1);
-						}
-						// Add white fringe artifact for accuracy
-						// This is bad, but good enough for now
-						// Eventually the HI-RES graphics rendering should be totally redone
-						for(int i=-1; i<13; i++){
-							if (dispBuf[(8*row)+line][(col*7)+(i)] && dispBuf[(8*row)+line][(col*7)+(i+1)]){
-								if (((col*7)+(i)) > 0){
-									dispBuf[(8*row)+line][(col*7)+(i)] = 15; // White
-								}
-								dispBuf[(8*row)+line][(col*7)+(i+1)] = 15; // White
+								colour = (palette ? 17 : 16); // Green or Orange
 							}
 						}
-					}
-				}else if(!hi_res){
-					// LO-RES graphics
-					int topColor = (memory[rowaddr+col]>>4) & 0x0f;
-					int botColor = (memory[rowaddr+col] & 0x0f);
-					for(int blocky=1; blocky<9; blocky++){
-						for(int blockx=0; blockx<7; blockx++){
-							dispBuf[(row*8)+(blocky-1)][(col*7)+blockx] = (blocky < 5 ? botColor : topColor);
-						}
+						t.pixels[odd][prev][byte][next][i] = colour;
 					}
 				}
 			}
 		}
-		screen_update = false;
-		return true;
-	}else{
-		return false;
+	}
+	return t;
+}
+
+static constexpr HiresTable hiresTable = buildHiresTable();
+
+// Draws one hi-res scanline, one table entry per byte
+void Raquette::renderLineHelper(int line){
+	int row = line/8;
+	const uint8_t *bytes = &memory[(page_two ? 0x4000 : 0x2000) + ((row%8)*128) + ((row/8)*40) + (1024*(line%8))]; // Steps of 128, interleaved in groups of 8
+	char *pixels = dispBuf[line];
+	for(int col=0; col<40; col++){
+		int prev = (col > 0) ? ((bytes[col-1] >> 6) & 0b1) : 0;
+		int next = (col < 39) ? (bytes[col+1] & 0b1) : 0;
+		const uint8_t *entry = hiresTable.pixels[col & 1][prev][bytes[col]][next];
+		if(col < 39){
+			memcpy(pixels + (col*7), entry, 8); // The extra pixel is overwritten by the next byte
+		}else{
+			memcpy(pixels + (col*7), entry, 7);
+		}
 	}
 }
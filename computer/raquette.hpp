@@ -1,5 +1,18 @@
 #pragma once
 
+#include <array>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <iostream>
+#include <atomic>
+
+#define ROM_LO (0xC000)
+
+class RaqJit;
+class RaqTraceWriter;
+struct JitContext;
+
 class Raquette: public Computer {
 	public:
 
@@ -7,110 +20,424 @@ class Raquette: public Computer {
 	class RaqDisk {
 		public:
 		// 35 tracks of 16 sectors of 256 bytes
-		uint8_t disk[35][16][256];
+		// Mapped rather than allocated: an empty drive costs nothing until written, and a loaded image
+		// is mapped privately from its file, so every machine using it shares the same pages until
+		// one writes to them.
+		static const unsigned DISK_BYTES = 35*16*256;
+		uint8_t (*disk)[16][256];
 		uint8_t stepperPhase;
 		uint8_t halftrack;
 		bool stepper_p0;
 		bool stepper_p1;
 		bool stepper_p2;
 		bool stepper_p3;
-		RaqDisk();
+		RaqDisk(); // Empty drive
+		~RaqDisk();
+		RaqDisk(const RaqDisk &) = delete; // Owns its mapping
+		bool load(const std::string &fileName, std::ostream &log);
 		uint8_t stepper();
 		bool spinning;
 		uint8_t drive; // 1 or 2
 	};
 
-	// 7 processor status flags:
-	bool flag_c, flag_z, flag_i, flag_d, flag_b, flag_v, flag_n;
-	char dispBuf[192][280];
+	// Addressing modes, as stored in the opcode table
+	enum AddrMode : uint8_t {
+		AM_IMP, AM_ACC, AM_IMM, AM_ZP, AM_ZPX, AM_ZPY, AM_ABS,
+		AM_ABSX, AM_ABSY, AM_IND, AM_INDX, AM_INDY, AM_REL
+	};
+
+	// Describes one opcode byte. Invalid opcodes have a null handler.
+	struct OpInfo {
+		const char *mnemonic;
+		AddrMode amode;
+		uint8_t length; // Bytes including the opcode
+		uint8_t cycles; // Base cycle count
+		uint8_t pagePenalty; // 1 if crossing a page costs an extra cycle
+		void (Raquette::*handler)(int eff_addr);
+	};
+	static const std::array<OpInfo, 256> opTable;
+
+	// Why runCycles() returned
+	enum StopReason : uint8_t {
+		STOP_BUDGET, // Ran the requested number of cycles
+		STOP_HALT // Invalid opcode or PC out of bounds
+	};
+
+	uint64_t cycles; // CPU cycles executed since power on
+	uint64_t overshoot; // Cycles the last runCycles() ran past its budget
+	uint64_t instructions; // Instructions executed since power on, interrupts not included
+
+	// Cycle-timed device events
+	// runCycles() runs straight up to the earliest pending event, then calls its handler
+	// between two instructions. Handlers may schedule further events, including their own next one.
+	enum EventType : uint8_t {
+		EV_VBL, // Start of vertical blank, once per frame
+		EV_STEPPER, // Disk head has settled after a stepper phase change
+		EV_KEY_REPEAT, // REPT key held, strobe the last key again
+		EV_INTERRUPT, // An interrupt may be taken, see assertIRQ()
+		EV_INPUT, // Next recorded input is due, see startReplay(). Runs after any other event due on the same cycle.
+		EV_COUNT
+	};
+	struct Event {
+		uint64_t when; // Cycle count at which the handler runs
+		EventType type;
+	};
+	static void (Raquette::*const eventHandlers[EV_COUNT])();
+	std::vector<Event> events; // Min-heap on when
+	void schedule(EventType type, uint64_t when);
+	void cancel(EventType type);
+	bool pending(EventType type);
+	uint64_t nextEvent() const { return events.empty() ? UINT64_MAX : events.front().when; }
+	void runEvents();
+	uint64_t runLimit; // Where the current straight run of runCycles() ends, 0 outside runCycles()
+
+	static const unsigned FRAME_CYCLES = 17030; // 65 cycles per line, 262 lines
+	static const unsigned STEPPER_CYCLES = 1000; // Time for the head to follow the magnets
+	static const unsigned REPEAT_CYCLES = 1000000 / 15; // REPT strobes at 15 Hz
+	uint64_t frames; // Vertical blanks since power on
+	bool repeatHeld; // REPT key down
+	void vblEvent();
+	void stepperHelper();
+	void stepperEvent();
+	void keyRepeatEvent();
+
+	// Host input
+	// Hosts change the machine only through keyInput() and setRepeat(), between calls to runCycles().
+	// While recording, every change is logged with the cycle count it took effect at. A replay applies
+	// the log from EV_INPUT events at exactly those cycles, however the runs are sliced, so a replayed
+	// machine ends up bit-identical to the recorded one. Live input is ignored until the log runs out.
+	enum InputType : uint8_t {
+		IN_KEY, // Keyboard latch at 0xC000 set to value
+		IN_REPEAT // REPT key released (0) or held (1)
+	};
+	struct InputRecord {
+		uint64_t cycles;
+		InputType type;
+		uint8_t value;
+	};
+	static const uint32_t INPUT_VERSION = 1;
+	std::vector<InputRecord> inputLog; // In cycle order
+	uint64_t inputStart; // Cycle count when recording started, a replay must start from the same one
+	bool recordingInput;
+	bool replayingInput;
+	bool replaySession; // Set from startReplay() to stopReplay(), so a rewind into the log replays it again
+	size_t replayPos; // Next record to apply
+	void keyInput(uint8_t val);
+	void setRepeat(bool held);
+	void startRecording(); // Clears the log
+	void stopRecording();
+	bool saveInput(const char *fileName);
+	bool loadInput(const char *fileName); // Replaces the log, does not start a replay
+	bool startReplay(); // Plays the log on a machine in the state recording started from
+	void stopReplay();
+	void inputHelper(InputType type, uint8_t value);
+	void inputEvent();
+
+	// Interrupts
+	// Devices hold the IRQ line for as long as they need service, each with its own source bit.
+	// NMI is edge triggered, each assertNMI() is taken once. Both are only looked at when an
+	// EV_INTERRUPT event runs, so nothing is checked per instruction while none is pending.
+	uint32_t irqLines; // One bit per IRQ source holding the line
+	bool nmiPending;
+	void assertIRQ(unsigned source);
+	void releaseIRQ(unsigned source);
+	void assertNMI();
+	void interruptEvent();
+	void interruptHelper(uint16_t vector);
+	void irqUnmaskHelper();
+
+	// One entry per 256-byte page of the address space
+	// Accesses use the read/write pointer when set, otherwise they trap to the handler.
+	struct MemPage {
+		uint8_t *read;
+		uint8_t *write;
+		uint8_t (Raquette::*readHandler)(int eff_addr);
+		void (Raquette::*writeHandler)(int eff_addr, uint8_t val);
+	};
+	MemPage pages[256];
+
+	// Tracing policies for stepT()
+	// enabled records each instruction in traceBuf, profiled counts it in the profile.
+	struct NoTrace { static constexpr bool enabled = false, profiled = false; };
+	struct Trace { static constexpr bool enabled = true, profiled = false; };
+	struct Profile { static constexpr bool enabled = false, profiled = true; };
+
+	// One traced instruction, captured before it executes (16 bytes)
+	struct TraceRecord {
+		uint32_t cycles; // Low 32 bits of the cycle counter
+		uint16_t pc;
+		uint8_t opcode, op1, op2; // Operand bytes are raw, even if unused
+		uint8_t a, x, y, sp, p;
+		uint16_t cyclesHigh; // Bits 32-47 of the cycle counter
+	};
+	static const unsigned TRACE_LEN = 0x10000; // Records kept, must be a power of 2
+	std::vector<TraceRecord> traceBuf; // Allocated on first traced step
+	std::atomic<unsigned> traceHead; // Total records written, wraps around traceBuf
+	std::atomic<unsigned> traceTail; // Total records saved by traceWriter
+	RaqTraceWriter *traceWriter; // Saves the ring to a file on its own thread (see raqtrace.hpp)
+	bool tracing; // Set while runCycles() traces every instruction
+	bool startTrace(const char *fileName);
+	void stopTrace();
+
+	// Execution profile, see startProfile()
+	// While profiling, runCycles() interprets every instruction so each one is counted.
+	struct ProfileCount {
+		uint64_t hits;
+		uint64_t cycles;
+	};
+	struct ProfileFrame {
+		uint16_t target; // Routine called by JSR
+		uint64_t start; // Cycle count at the call
+	};
+	bool profiling;
+	std::vector<ProfileCount> pcProfile; // Indexed by address, allocated by startProfile()
+	ProfileCount opcodeProfile[256];
+	std::vector<uint64_t> callCounts; // JSRs to each address
+	std::vector<uint64_t> callCycles; // Cycles from each JSR to the matching RTS, callees included
+	std::vector<ProfileFrame> callStack; // Calls not returned from yet
+	void startProfile();
+	void stopProfile();
+	void profileHelper(uint16_t addr, uint8_t opcode, unsigned spent);
+	void profileReport(std::ostream &out, const char *mapFile, unsigned top = 20);
+
+	// Processor status register bits
+	enum : uint8_t {
+		FLAG_C = 0x01, FLAG_Z = 0x02, FLAG_I = 0x04, FLAG_D = 0x08,
+		FLAG_B = 0x10, FLAG_U = 0x20, FLAG_V = 0x40, FLAG_N = 0x80
+	};
+	// Packed status register. The N and Z bits are not kept here: nearly every
+	// instruction changes them, so we only remember the last result in nzResult
+	// and work them out when a branch, PHP or a debugger actually asks.
+	uint8_t status;
+	uint16_t nzResult; // Z if the low byte is zero, N from bit 7 or bit 8 (for BIT)
+
+	bool flagC() const { return status & FLAG_C; }
+	bool flagZ() const { return (nzResult & 0xFF) == 0; }
+	bool flagN() const { return ((nzResult >> 1) | nzResult) & 0x80; }
+	void setFlag(uint8_t mask, bool set) { status = set ? (status | mask) : (status & ~mask); }
+	// Full status byte as pushed on the stack, bit 5 always set
+	uint8_t getStatus() const {
+		return (status & ~(FLAG_N | FLAG_Z)) | FLAG_U | (flagN() ? FLAG_N : 0) | (flagZ() ? FLAG_Z : 0);
+	}
+	void setStatus(uint8_t p) {
+		status = p & ~(FLAG_N | FLAG_Z);
+		// Pick a result that reproduces the N and Z bits we were given
+		if(p & FLAG_Z) nzResult = (p & FLAG_N) ? 0x100 : 0;
+		else nzResult = (p & FLAG_N) ? 0x80 : 1;
+	}
+	char (*dispBuf)[280]; // 192 rows of 280 pixels, allocated by the first renderScreen()
 	RaqDisk disk; // Assumed to be in slot 6 for now
+
+	// Everything a machine needs from outside, so that many can run side by side in one process
+	struct Config {
+		std::string romFile = "../software/raquette/rom/raq_rom.bin"; // Loaded at the top of memory
+		std::string diskFile = "../software/raquette/foo.DSK"; // Empty for no disk
+		const uint8_t *image = nullptr; // If set, copied to memory from address 0 instead of loading romFile
+		int imageLen = 0;
+		std::ostream *log = &std::cout; // Where messages go, nullptr for nowhere
+	};
+	explicit Raquette(const Config &config);
 	Raquette(uint8_t *init_contents = nullptr, int len_contents = 0);
+	~Raquette();
+	bool loaded; // False if the ROM or disk could not be loaded, the reason went to log
+	std::ostream *log;
+	std::ostream nullLog; // Discards everything, used when Config::log is nullptr
 	// TODO reset (for resetting regs and pc)
-	std::tuple<int, int> aModeHelper(uint8_t thisbyte);
-	uint8_t cycleCountHelper(uint8_t byte);
+
+	// Save states
+	// A snapshot of the whole machine with a fixed layout, so a saved file can be mapped and copied
+	// straight back in. Memory and disk each start on their own 4K page. Values are in host byte order.
+	// Bump STATE_VERSION whenever the layout or the meaning of a field changes.
+	static const uint32_t STATE_VERSION = 1;
+	static const unsigned STATE_MAX_EVENTS = 16;
+	struct SavedEvent {
+		uint64_t when;
+		uint32_t type; // EventType
+		uint32_t unused;
+	};
+	struct SaveState {
+		char magic[8]; // "RAQSTATE"
+		uint32_t version; // STATE_VERSION
+		uint32_t size; // sizeof(SaveState)
+		uint64_t cycles;
+		uint64_t overshoot;
+		uint64_t instructions;
+		uint64_t frames;
+		uint64_t idleSkipped;
+		uint16_t pc;
+		uint8_t regs[4]; // A, X, Y, SP
+		uint8_t p; // Status as pushed by PHP
+		uint8_t graphicsMode, fullScreen, pageTwo, hiRes; // Video soft switches
+		uint8_t repeatHeld;
+		uint8_t nmiPending;
+		uint32_t irqLines;
+		uint8_t stepperPhase, halftrack;
+		uint8_t stepperMagnets; // Bit n set if stepper phase n is on
+		uint8_t spinning, drive;
+		uint32_t numEvents;
+		SavedEvent events[STATE_MAX_EVENTS];
+		alignas(4096) uint8_t memory[0x10000];
+		alignas(4096) uint8_t disk[35][16][256];
+	};
+	void captureState(SaveState &state);
+	bool restoreState(const SaveState &state);
+	bool saveState(const char *fileName);
+	bool loadState(const char *fileName);
+	SaveState *aheadState; // Scratch for renderAhead(), allocated on first use
+	bool renderAhead(unsigned count);
+
+	std::tuple<int, bool> aModeHelper(uint8_t amode);
 	uint8_t rolHelper(uint8_t byte);
 	uint8_t rorHelper(uint8_t byte);
-	void dispHelper(int eff_addr);
 	void softSwitchesHelper(int eff_addr);
-	void branchHelper();
+	void mapMemory();
+	void dispWrite(int eff_addr, uint8_t val);
+	uint8_t ioRead(int eff_addr);
+	void ioWrite(int eff_addr, uint8_t val);
+
+	// Reads a byte on behalf of an instruction
+	uint8_t memRead(int eff_addr) {
+		const MemPage &page = pages[eff_addr >> 8];
+		if(page.read) return page.read[eff_addr & 0xFF];
+		return (this->*page.readHandler)(eff_addr);
+	}
+
+	// Writes a byte on behalf of an instruction
+	// Pages with neither a write pointer nor a handler (ROM) ignore the write
+	void memWrite(int eff_addr, uint8_t val) {
+		const MemPage &page = pages[eff_addr >> 8];
+		if(page.write){
+			page.write[eff_addr & 0xFF] = val;
+		}else if(page.writeHandler){
+			(this->*page.writeHandler)(eff_addr, val);
+		}
+	}
+
+	// Predecoded basic blocks, used by runCycles()
+	// A block runs straight-line code up to and including the first control transfer.
+	// Operands that do not depend on registers are resolved when the block is built.
+	struct DecodedOp {
+		void (Raquette::*handler)(int eff_addr);
+		uint16_t pc; // Address of the opcode
+		uint16_t operand; // Effective address if fixed, otherwise the raw operand bytes
+		AddrMode amode;
+		uint8_t length;
+		uint8_t cycles;
+		uint8_t pagePenalty;
+	};
+	struct Block {
+		std::vector<DecodedOp> ops;
+		unsigned maxCycles; // Worst case, with every page penalty and a taken branch
+		unsigned runs; // Times run by runBlock(), to find hot blocks for the JIT
+		void (*native)(JitContext *ctx); // Translated code, if any
+		unsigned idleCycles; // Cycles per pass if the block is an idle loop (see runIdle()), otherwise 0
+		Block *next; // Block that ran after this one last time, only followed while nextEpoch is current
+		uint64_t nextEpoch;
+		uint16_t nextPc; // Start address of next
+	};
+	static const unsigned BLOCK_MAX_OPS = 64;
+	static const unsigned JIT_HOT = 32; // Runs before a block is translated
+	bool useBlockCache; // Cleared to always interpret one instruction at a time
+	// Blocks are found by a direct-mapped index: one array per page, allocated the first time a
+	// block starts in that page, with a slot for every address. A slot with no ops holds no block.
+	Block *blockIndex[256];
+	unsigned blockCount; // Blocks currently cached
+	uint64_t blockEpoch; // Bumped whenever blocks are dropped, so older chains are not followed
+	std::vector<uint16_t> pageBlocks[256]; // Start addresses of the blocks touching each page
+	MemPage codePages[256]; // Mapping of each page before it was overlaid by codeWrite()
+	bool codeOverlaid[256];
+	bool codeBytes[0x10000]; // Set for each byte decoded into a cached block
+	bool blockStop; // Set by codeWrite() or schedule() so a running block stops at once
+	Block *findBlock(int addr);
+	void buildBlock(Block &block, int addr);
+	int runBlock(const Block &block);
+	void codeWrite(int eff_addr, uint8_t val);
+	void invalidateCodePage(int page);
+	void flushBlockCache();
+
+	// Idle loop detection
+	// A block that only reads the keyboard and branches back to itself cannot change anything
+	// but the cycle count until a key arrives, and keys only arrive between calls to runCycles().
+	// Such loops are skipped up to the budget instead of being run pass by pass. Skipped passes
+	// only move cycles and idleSkipped, instructions counts what was really run.
+	// Idle loops are found while building blocks, so with useBlockCache cleared the blocks are still
+	// looked up for this, but then run one instruction at a time.
+	bool useIdleSkip; // Cleared to run idle loops pass by pass
+	bool idle; // Set if the last runCycles() ended waiting for a key, the host may sleep until one arrives
+	uint64_t idleSkipped; // Cycles skipped in idle loops since power on
+	bool idleRead(const DecodedOp &op);
+	int runIdle(const Block &block, uint64_t target);
+
+	// Optional x86-64 translation of hot blocks (see raqjit.hpp)
+	// Needs useBlockCache. Can be switched at any time, the interpreter stays the reference.
+	bool useJit;
+	RaqJit *jit; // Created the first time useJit is seen set
+	bool jitBlock(Block &block);
+	int runNative(const Block &block, uint64_t target);
+
+	void branchHelper(int eff_addr);
+	void badOpcodeHelper();
+	void traceHelper();
+	template <class Tracing> int stepT();
 	int step(bool verbose = false);
+	StopReason runCycles(uint64_t budget);
 	int runMicroSeconds(unsigned int microseconds);
 	void show_regs();
+	void printTrace(std::ostream &out, unsigned count = TRACE_LEN);
+	static std::string disassemble(uint16_t addr, uint8_t opcode, uint8_t op1, uint8_t op2);
+	static void formatTraceRecord(std::ostream &out, const TraceRecord &rec);
 	void consoleSession();
 	bool renderScreen();
 
+	// Display dirty tracking
+	// dispWrite() marks only what a write changes on screen: one 7x8 cell of text or lo-res, or one
+	// hi-res scanline (colours and fringes depend on the neighbouring bytes, so the 40 bytes of a
+	// scanline are redrawn together). Writes to a page or mode that is not being shown mark nothing.
+	// screen_update asks for the whole screen, after a mode or page switch or a restored state.
+	// Flashing characters change with the cycle counter rather than a write, so renderScreen() marks
+	// the cells showing them whenever the flash phase has moved on.
+	struct DirtyRect {
+		uint16_t x, y, w, h; // In dispBuf pixels
+	};
+	std::vector<DirtyRect> dirtyRects; // Parts of dispBuf the last renderScreen() redrew
+	bool cellDirty[24][40];
+	bool lineDirty[192];
+	bool displayDirty; // Set if any cell or line is marked
+	bool flashShown; // Flash phase dispBuf was drawn with
+	bool flashHelper(); // True while flashing characters are shown inverse
+	void markFlashHelper();
+	void markRectHelper(const DirtyRect &rect);
+	bool cellRowHelper(int row);
+	void renderCellHelper(int row, int col);
+	void renderLineHelper(int line);
+	void setDisplayHelper(bool &flag, bool val);
+	// Converts rect of dispBuf to 32-bit pixels through palette (256 entries), each one a scale x scale
+	// square, using the fastest kernel the host supports (see raqpixels.hpp)
+	void expandScreen(const DirtyRect &rect, uint32_t *dest, size_t pitch, unsigned scale, const uint32_t *palette);
+
+	// Instruction handlers (see opTable)
+	void opADC(int eff_addr); void opAND(int eff_addr); void opASL(int eff_addr); void opASLA(int eff_addr);
+	void opBCC(int eff_addr); void opBCS(int eff_addr); void opBEQ(int eff_addr); void opBIT(int eff_addr);
+	void opBMI(int eff_addr); void opBNE(int eff_addr); void opBPL(int eff_addr); void opBRK(int eff_addr);
+	void opBVC(int eff_addr); void opBVS(int eff_addr); void opCLC(int eff_addr); void opCLD(int eff_addr);
+	void opCLI(int eff_addr); void opCLV(int eff_addr); void opCMP(int eff_addr); void opCPX(int eff_addr);
+	void opCPY(int eff_addr); void opDEC(int eff_addr); void opDEX(int eff_addr); void opDEY(int eff_addr);
+	void opEOR(int eff_addr); void opINC(int eff_addr); void opINX(int eff_addr); void opINY(int eff_addr);
+	void opJMP(int eff_addr); void opJSR(int eff_addr); void opLDA(int eff_addr); void opLDX(int eff_addr);
+	void opLDY(int eff_addr); void opLSR(int eff_addr); void opLSRA(int eff_addr); void opNOP(int eff_addr);
+	void opORA(int eff_addr); void opPHA(int eff_addr); void opPHP(int eff_addr); void opPLA(int eff_addr);
+	void opPLP(int eff_addr); void opROL(int eff_addr); void opROLA(int eff_addr); void opROR(int eff_addr);
+	void opRORA(int eff_addr); void opRTI(int eff_addr); void opRTS(int eff_addr); void opSBC(int eff_addr);
+	void opSEC(int eff_addr); void opSED(int eff_addr); void opSEI(int eff_addr); void opSTA(int eff_addr);
+	void opSTX(int eff_addr); void opSTY(int eff_addr); void opTAX(int eff_addr); void opTAY(int eff_addr);
+	void opTSX(int eff_addr); void opTXA(int eff_addr); void opTXS(int eff_addr); void opTYA(int eff_addr);
+
 	bool screen_update;
 	bool graphics_mode;
 	bool full_screen;
 	bool page_two;
 	bool hi_res;
 
-	// Pixel rows are in reverse order
-	const uint8_t charset[0x40*7] = {
-	0x70,0x80,0xba,0xaa,0xba,0x8a,0x70, // @
-	0x88,0x88,0x88,0xf8,0x88,0x88,0x70, // A
-	0xf0,0x88,0x88,0xf0,0x88,0x88,0xf0, // B
-	0x70,0x88,0x80,0x80,0x80,0x88,0x70, // C
-	0xf0,0x88,0x88,0x88,0x88,0x88,0xf0, // D
-	0xfa,0x80,0x80,0xf0,0x80,0x80,0xf8, // E
-	0x80,0x80,0x80,0xf0,0x80,0x80,0xf8, // F
-	0x70,0x88,0x98,0x80,0x80,0x88,0x70, // G
-	0x88,0x88,0x88,0xf8,0x88,0x88,0x88, // H
-	0xf8,0x20,0x20,0x20,0x20,0x20,0xf8, // I
-	0x70,0x88,0x08,0x08,0x08,0x08,0x78, // J
-	0x88,0x88,0x90,0xe0,0x90,0x88,0x88, // K
-	0xf8,0x80,0x80,0x80,0x80,0x80,0x80, // L
-	0x88,0x88,0x88,0x88,0xa8,0xd8,0x88, // M
-	0x88,0x88,0x98,0xa8,0xc8,0x88,0x88, // N
-	0x70,0x88,0x88,0x88,0x88,0x88,0x70, // O
-	0x80,0x80,0x80,0xf0,0x88,0x88,0xf0, // P
-	0x68,0x90,0xa8,0x88,0x88,0x88,0x70, // Q
-	0x88,0x88,0x88,0xf0,0x88,0x88,0xf0, // R
-	0xf0,0x08,0x08,0x70,0x80,0x80,0x78, // S
-	0x20,0x20,0x20,0x20,0x20,0x20,0xf8, // T
-	0x70,0x88,0x88,0x88,0x88,0x88,0x88, // U
-	0x20,0x50,0x88,0x88,0x88,0x88,0x88, // V
-	0x88,0xd8,0xa8,0x88,0x88,0x88,0x88, // W
-	0x88,0x88,0x50,0x20,0x50,0x88,0x88, // X
-	0x20,0x20,0x20,0x20,0x50,0x88,0x88, // Y
-	0xf8,0x80,0x40,0x20,0x10,0x0a,0xf8, // Z
-	0x30,0x20,0x20,0x20,0x20,0x20,0x30, // [
-	0x00,0x08,0x10,0x20,0x40,0x80,0x00, // \ slash
-	0x60,0x20,0x20,0x20,0x20,0x20,0x60, // ]
-	0x00,0x00,0x00,0x00,0x88,0x50,0x20, // ^
-	0xf8,0x00,0x00,0x00,0x00,0x00,0x00, // _
-	0x00,0x00,0x00,0x00,0x00,0x00,0x00, // (blank)
-	0x20,0x00,0x20,0x20,0x20,0x20,0x20, // !
-	0x00,0x00,0x00,0x00,0x00,0x50,0x50, // "
-	0x50,0x50,0xfa,0x50,0xfa,0x50,0x50, // #
-	0x20,0xf0,0x2a,0x70,0xa0,0x7a,0x20, // $
-	0x18,0x98,0x40,0x20,0x10,0xca,0xc0, // %
-	0x68,0x90,0xfa,0x40,0xa0,0xa0,0x40, // &
-	0x00,0x00,0x00,0x00,0x00,0x20,0x20, // '
-	0x10,0x20,0x40,0x40,0x40,0x20,0x10, // (
-	0x40,0x20,0x10,0x10,0x10,0x20,0x40, // )
-	0x20,0xa8,0x70,0x20,0x70,0xa8,0x20, // *
-	0x00,0x20,0x20,0xfa,0x20,0x20,0x00, // +
-	0x40,0x20,0x20,0x00,0x00,0x00,0x00, // ,
-	0x00,0x00,0x00,0xf8,0x00,0x00,0x00, // -
-	0x20,0x00,0x00,0x00,0x00,0x00,0x00, // .
-	0x00,0x80,0x40,0x20,0x10,0x08,0x00, // /
-	0x70,0x88,0xc8,0xa8,0x98,0x88,0x70, // 0
-	0x70,0x20,0x20,0x20,0x20,0x60,0x20, // 1
-	0xf8,0x40,0x20,0x10,0x08,0x88,0x70, // 2
-	0x70,0x88,0x08,0x30,0x08,0x88,0x70, // 3
-	0x10,0x10,0x10,0xf8,0x90,0x50,0x30, // 4
-	0xf0,0x08,0x08,0xf0,0x80,0x80,0xf8, // 5
-	0x70,0x88,0x88,0xf0,0x80,0x80,0x70, // 6
-	0x40,0x40,0x40,0x20,0x10,0x08,0xf8, // 7
-	0x70,0x88,0x88,0x70,0x88,0x88,0x70, // 8
-	0x70,0x08,0x08,0x78,0x88,0x88,0x70, // 9
-	0x00,0x20,0x00,0x00,0x00,0x20,0x00, // :
-	0x40,0x20,0x20,0x00,0x00,0x20,0x00, // ;
-	0x10,0x20,0x40,0x80,0x40,0x20,0x10, // <
-	0x00,0x00,0xf8,0x00,0xf8,0x00,0x00, // =
-	0x40,0x20,0x10,0x08,0x10,0x20,0x40, // >
-	0x20,0x00,0x20,0x20,0x10,0x88,0x70, // ?
-	};
+	static const uint8_t charset[0x40*7]; // Glyphs for the 64 characters, 7 rows each
 };
 
@@ -1,7 +1,14 @@
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <vector>
+#include <unistd.h>
 #include "computer.hpp"
 #include "raquette.hpp"
+#include "raqtrace.hpp"
+#include "raqrewind.hpp"
+#include "raqpixels.hpp"
+#include "raqrunner.hpp"
 #include "lvdc.hpp"
 
 #define BASEBYTES 2
@@ -31,16 +38,16 @@ void test_base_computer(){
 	return;
 }
 
-// This is a temporary debugging test that expects a proprietary ROM that we cannot not include in the repo.
-// We will have our own FOSS ROM eventually.
-void test_raq_romfile(){
+// Reads our monitor ROM into the top of dest and zeroes the rest of the 64K
+// Returns false if the file cannot be opened
+bool load_raq_rom(uint8_t *dest){
 //	std::ifstream infile("./software/raquette/OUT.BIN", std::ios::binary | std::ios::in);
 //	std::ifstream infile("A2ROM.BIN", std::ios::binary | std::ios::in);
 //	std::ifstream infile("apple.rom", std::ios::binary | std::ios::in);
 	std::ifstream infile("../software/raquette/rom/raq_rom.bin", std::ios::binary | std::ios::in);
 	if(!infile){
 		std::cout << "Cannot open ROM file\n";
-		return;
+		return false;
 	}
 	//get length of file
 	infile.seekg(0, std::ios::end);
@@ -51,17 +58,24 @@ void test_raq_romfile(){
 	std::cout << "Opened rom of length " << length << std::endl;
 	infile.read(buffer, length);
 
-	uint8_t raq_rom_arr[0xFFFF];
-	for (unsigned i=0; i < 0xD000; i++) {
-		raq_rom_arr[i] = 0x00; // Zero low mem
+	for (unsigned i=0; i < 0x10000; i++) {
+		dest[i] = 0x00; // Zero low mem
 	}
 	// TODO merge this functionality into raquette class
 	for (unsigned i=0; i < length; i++) {
-//		raq_rom_arr[i+0xD000] = buffer[i];
-		raq_rom_arr[1+i+(0xFFFF-length)] = buffer[i];
+//		dest[i+0xD000] = buffer[i];
+		dest[1+i+(0xFFFF-length)] = buffer[i];
 	}
 
 	delete [] buffer;
+	return true;
+}
+
+// This is a temporary debugging test that expects a proprietary ROM that we cannot not include in the repo.
+// We will have our own FOSS ROM eventually.
+void test_raq_romfile(){
+	uint8_t raq_rom_arr[0xFFFF+1];
+	if(!load_raq_rom(raq_rom_arr)) return;
 
 	Raquette raquette(raq_rom_arr, 0xFFFF+1);
 
@@ -75,31 +89,28 @@ void test_raq_romfile(){
 //	raquette.show_regs();
 }
 
-void test_raq_all(){
+// Reads the 64K functional test image into dest
+// Returns false if the file cannot be opened
+bool load_raq_functional_test(uint8_t *dest){
 	std::ifstream infile("../software/raquette/functionalTest/6502_functional_test.bin", std::ios::binary | std::ios::in);
 	if(!infile){
 		std::cout << "Cannot open ROM file\n";
-		return;
+		return false;
 	}
 	//get length of file
 	infile.seekg(0, std::ios::end);
 	size_t length = infile.tellg();
 	infile.seekg(0, std::ios::beg);
+	if(length > 0x10000) length = 0x10000;
 
-	char * buffer = new char[length];
 	std::cout << "Opened file of length " << length << std::endl;
-	infile.read(buffer, length);
-
-	// Zero low mem
-	uint8_t raq_rom_arr[0xFFFF];
-	uint8_t tmp;
-	// Copy in ROM
-	for (unsigned i=0; i < length; i++) {
-		tmp = buffer[i];
-		raq_rom_arr[i] = tmp;
-	}
+	infile.read((char *)dest, length);
+	return true;
+}
 
-	delete [] buffer;
+void test_raq_all(){
+	uint8_t raq_rom_arr[0xFFFF+1];
+	if(!load_raq_functional_test(raq_rom_arr)) return;
 
 	Raquette raquette(raq_rom_arr, 0xFFFF+1);
 
@@ -116,10 +127,965 @@ void test_raq_all(){
 		prevpc = raquette.pc;
 	}
 	raquette.show_regs();
-	std::cout << "Executed " << numsteps << " instructions\n";
+	std::cout << "Executed " << numsteps << " instructions in " << raquette.cycles << " cycles\n";
 
 }
 
+// True if the instruction at pc jumps or branches to itself, which is how the functional test stops once taken
+bool raq_trapped(Raquette &raquette){
+	uint8_t *mem = raquette.memory;
+	int pc = raquette.pc;
+	if(mem[pc] == 0x4C) return (((mem[pc+2] << 8) | mem[pc+1]) == pc); // JMP *
+	if((mem[pc] & 0x1F) == 0x10) return (mem[pc+1] == 0xFE); // Branch to itself
+	return false;
+}
+
+// FNV-1a over all of a Raquette's memory, to compare whole machines cheaply
+uint64_t raq_memory_hash(Raquette &raquette){
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(unsigned i=0; i < 0x10000; i++){
+		hash = (hash ^ raquette.memory[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// Runs the functional test through runCycles(): interpreted, with the block cache, then with the JIT
+// All runs must stop on the same instruction with the same cycle count, registers, flags and memory.
+void test_raq_blocks(){
+	uint8_t raq_rom_arr[0xFFFF+1];
+	if(!load_raq_functional_test(raq_rom_arr)) return;
+
+	const char *names[3] = {"Interpreter: ", "Block cache: ", "JIT:         "};
+	int endpc[3];
+	uint64_t endcycles[3];
+	uint64_t endinstr[3];
+	uint8_t endregs[3][5]; // A, X, Y, SP and P
+	uint64_t endhash[3];
+	double endsecs[3];
+	for(int mode=0; mode<3; mode++){
+		Raquette raquette(raq_rom_arr, 0xFFFF+1);
+		raquette.pc = 0x0400;
+		raquette.useBlockCache = (mode > 0);
+		raquette.useIdleSkip = (mode > 0);
+		raquette.useJit = (mode > 1);
+
+		auto start = std::chrono::steady_clock::now();
+		int prevpc = 0xFFFFF;
+		while((raquette.pc != prevpc) || !raq_trapped(raquette)){
+			prevpc = raquette.pc;
+			if(raquette.runCycles(1000) == Raquette::STOP_HALT) break;
+		}
+		std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+		endpc[mode] = raquette.pc;
+		endcycles[mode] = raquette.cycles;
+		endinstr[mode] = raquette.instructions;
+		for(int r=0; r<4; r++){
+			endregs[mode][r] = raquette.regs[r];
+		}
+		endregs[mode][4] = raquette.getStatus();
+		endhash[mode] = raq_memory_hash(raquette);
+		endsecs[mode] = secs.count();
+		std::cout << names[mode] << "stopped at pc:" << std::hex << raquette.pc << std::dec
+			<< " after " << raquette.instructions << " instructions, " << raquette.cycles << " cycles in "
+			<< secs.count() << " s\n";
+	}
+	for(int mode=1; mode<3; mode++){
+		if((endpc[mode] != endpc[0]) || (endcycles[mode] != endcycles[0]) || (endinstr[mode] != endinstr[0])
+			|| !std::equal(endregs[mode], endregs[mode]+5, endregs[0]) || (endhash[mode] != endhash[0])){
+			std::cout << names[mode] << "does not match the interpreter\n";
+		}
+		// Blocks are on by default, which is only worth it while they beat the interpreter
+		std::cout << names[mode] << endsecs[0] / endsecs[mode] << "x the interpreter's speed\n";
+		if(endsecs[mode] >= endsecs[0]){
+			std::cout << names[mode] << "is not faster than the interpreter\n";
+		}
+	}
+}
+
+// Boots the monitor ROM, which soon sits waiting for a key, with and without idle loop skipping
+// Both runs interpret one instruction at a time apart from the skipped loop. They must end in the
+// same state, and the skipping run must have noticed it was idle and count only what it ran.
+void test_raq_idle(){
+	uint8_t raq_rom_arr[0xFFFF+1];
+	if(!load_raq_rom(raq_rom_arr)) return;
+
+	const char *names[2] = {"Interpreter: ", "Idle skip:   "};
+	int endpc[2];
+	uint8_t endacc[2];
+	uint64_t endcycles[2];
+	uint64_t endinstr[2];
+	for(int mode=0; mode<2; mode++){
+		Raquette raquette(raq_rom_arr, 0xFFFF+1);
+		raquette.useBlockCache = false;
+		raquette.useIdleSkip = (mode > 0);
+
+		// One emulated second, in slices like the GUI runs it
+		auto start = std::chrono::steady_clock::now();
+		for(int i=0; i<20; i++){
+			if(raquette.runCycles(50000) == Raquette::STOP_HALT) break;
+		}
+		std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+		endpc[mode] = raquette.pc;
+		endacc[mode] = raquette.regs[0];
+		endcycles[mode] = raquette.cycles;
+		endinstr[mode] = raquette.instructions;
+		std::cout << names[mode] << "stopped at pc:" << std::hex << raquette.pc << std::dec
+			<< " after " << raquette.cycles << " cycles (" << raquette.idleSkipped << " skipped), "
+			<< raquette.instructions << " instructions run in "
+			<< secs.count() << " s\n";
+		if(mode && !raquette.idle){
+			std::cout << names[mode] << "did not find the keyboard loop\n";
+		}
+		if(raquette.frames != (raquette.cycles / Raquette::FRAME_CYCLES)){
+			std::cout << names[mode] << "saw " << raquette.frames << " vertical blanks\n";
+		}
+	}
+	if((endpc[1] != endpc[0]) || (endacc[1] != endacc[0]) || (endcycles[1] != endcycles[0])){
+		std::cout << names[1] << "does not match the interpreter\n";
+	}
+	if(endinstr[1] >= endinstr[0]){
+		std::cout << names[1] << "counted skipped passes as instructions\n";
+	}
+}
+
+// Delivers a masked IRQ, an unmasked IRQ and an NMI to a small program, in every execution mode
+// The program counts in X, its IRQ handler counts in Y and its NMI handler counts at $12.
+void test_raq_interrupts(){
+	const uint8_t prog[] = {
+		0x78,             // 0400 SEI
+		0xA5, 0x10,       // 0401 LDA $10    ; Wait until the test sets $10
+		0xF0, 0xFC,       // 0403 BEQ $0401
+		0x58,             // 0405 CLI
+		0xE8,             // 0406 INX
+		0x4C, 0x06, 0x04  // 0407 JMP $0406
+	};
+	uint8_t raq_rom_arr[0xFFFF+1] = {};
+	for(unsigned i=0; i<sizeof(prog); i++){
+		raq_rom_arr[0x400+i] = prog[i];
+	}
+	raq_rom_arr[0x500] = 0xC8; // INY
+	raq_rom_arr[0x501] = 0x40; // RTI
+	raq_rom_arr[0x510] = 0xE6; // INC $12
+	raq_rom_arr[0x511] = 0x12;
+	raq_rom_arr[0x512] = 0x40; // RTI
+	raq_rom_arr[0xFFFA] = 0x10; // NMI vector
+	raq_rom_arr[0xFFFB] = 0x05;
+	raq_rom_arr[0xFFFE] = 0x00; // IRQ vector
+	raq_rom_arr[0xFFFF] = 0x05;
+
+	const char *names[3] = {"Interpreter: ", "Block cache: ", "JIT:         "};
+	uint64_t endcycles[3];
+	uint8_t endx[3];
+	for(int mode=0; mode<3; mode++){
+		Raquette raquette(raq_rom_arr, 0xFFFF+1);
+		raquette.pc = 0x0400;
+		raquette.useBlockCache = (mode > 0);
+		raquette.useIdleSkip = (mode > 0);
+		raquette.useJit = (mode > 1);
+
+		// Masked, nothing happens
+		raquette.runCycles(100);
+		raquette.assertIRQ(0);
+		raquette.runCycles(10000);
+		uint8_t masked = raquette.regs[2];
+
+		// CLI lets the held IRQ in, and it keeps coming back until released
+		raquette.memory[0x10] = 1;
+		raquette.runCycles(100);
+		raquette.releaseIRQ(0);
+		uint8_t taken = raquette.regs[2];
+		raquette.runCycles(10000); // Lets the handler that was running return
+		uint8_t after = raquette.regs[2];
+		raquette.runCycles(10000);
+		uint8_t later = raquette.regs[2];
+
+		// One NMI, taken exactly once
+		raquette.assertNMI();
+		raquette.runCycles(10000);
+
+		std::cout << names[mode] << "IRQs masked:" << (int) masked << " taken:" << (int) taken
+			<< " after release:" << (int) later << " NMIs:" << (int) raquette.memory[0x12]
+			<< " cycles:" << raquette.cycles << "\n";
+		if((masked != 0) || (taken == 0) || (later != after) || (raquette.memory[0x12] != 1)){
+			std::cout << names[mode] << "interrupts were not delivered as expected\n";
+		}
+		endcycles[mode] = raquette.cycles;
+		endx[mode] = raquette.regs[1];
+	}
+	for(int mode=1; mode<3; mode++){
+		if((endx[mode] != endx[0]) || (endcycles[mode] != endcycles[0])){
+			std::cout << names[mode] << "does not match the interpreter\n";
+		}
+	}
+}
+
+// Types a line at the monitor prompt, one key per frame once the last one has been read
+void raq_type_line(Raquette &raquette, const std::string &line){
+	for(unsigned typed=0; typed < line.size(); ){
+		raquette.runCycles(Raquette::FRAME_CYCLES);
+		if(!(raquette.memory[0xC000] & 0b10000000)){
+			raquette.memory[0xC000] = line[typed++] | 0b10000000;
+		}
+	}
+	raquette.runCycles(Raquette::FRAME_CYCLES);
+}
+
+// Boots the monitor ROM, saves it at the prompt and types a line, then restores the save into a
+// fresh machine, types the same line and checks that both machines end up identical.
+void test_raq_savestate(){
+	const std::string input = "0123456789\r";
+	Raquette::SaveState *before = new Raquette::SaveState();
+	Raquette::SaveState *after = new Raquette::SaveState();
+
+	Raquette booted;
+	for(int i=0; i<60; i++){
+		booted.runCycles(Raquette::FRAME_CYCLES);
+	}
+	if(!booted.saveState("raq_state.bin")) return;
+	raq_type_line(booted, input);
+	booted.captureState(*before);
+
+	Raquette restored;
+	restored.useJit = true;
+	auto start = std::chrono::steady_clock::now();
+	bool loaded = restored.loadState("raq_state.bin");
+	std::chrono::duration<double, std::micro> usecs = std::chrono::steady_clock::now() - start;
+	if(!loaded) return;
+	std::cout << "Restored " << sizeof(Raquette::SaveState) << " byte save state in " << usecs.count() << " us\n";
+	raq_type_line(restored, input);
+	restored.captureState(*after);
+
+	std::cout << "Saved:    pc:" << std::hex << before->pc << std::dec << " cycles:" << before->cycles << "\n";
+	std::cout << "Restored: pc:" << std::hex << after->pc << std::dec << " cycles:" << after->cycles << "\n";
+	if(!std::equal((const char *)before, (const char *)before + sizeof(Raquette::SaveState), (const char *)after)){
+		std::cout << "Restored machine does not match the saved one\n";
+	}
+
+	// A save state from another version must be refused
+	before->version++;
+	if(restored.restoreState(*before)){
+		std::cout << "Save state with the wrong version was accepted\n";
+	}
+	delete before;
+	delete after;
+}
+
+// Types the next key of input at the monitor prompt once the last one has been read
+void raq_type_next(Raquette &raquette, const std::string &input, unsigned &typed){
+	if((typed < input.size()) && !(raquette.memory[0xC000] & 0b10000000)){
+		raquette.memory[0xC000] = input[typed++] | 0b10000000;
+	}
+}
+
+// Types a line at the monitor prompt, a key per frame, and runs on until frames frames have passed
+// The log ends well before the machine does, so replays of it run past its last record.
+void raq_record_typing(Raquette &recorded, unsigned frames){
+	const std::string input = "0123456789\r";
+	unsigned typed = 0;
+	recorded.startRecording();
+	for(unsigned frame=0; frame<frames; frame++){
+		if((frame >= 30) && (typed < input.size()) && !(recorded.memory[0xC000] & 0b10000000)){
+			recorded.keyInput(input[typed++] | 0b10000000);
+		}
+		recorded.runCycles(Raquette::FRAME_CYCLES);
+	}
+	recorded.stopRecording();
+}
+
+// Types at the monitor prompt with a snapshot every frame, then rewinds to a snapshot and to a
+// cycle between two snapshots. Both must rebuild the machine exactly, and typing the rest of the
+// input again from the rewound state must end where the first run did.
+void test_raq_rewind(){
+	const std::string input = "0123456789\r0123456789\rFEDCBA9876543210\r";
+	const unsigned FRAMES = 600;
+	Raquette::SaveState *expected = new Raquette::SaveState();
+	Raquette::SaveState *mid = new Raquette::SaveState();
+	Raquette::SaveState *got = new Raquette::SaveState();
+	uint64_t snapCycle = 0;
+	unsigned snapTyped = 0;
+
+	Raquette raquette;
+	RaqRewind rewind(raquette, 1, 60, 8); // 480 frames of history, so the oldest ones are dropped
+	unsigned typed = 0;
+	for(unsigned frame=0; frame<FRAMES; frame++){
+		raq_type_next(raquette, input, typed);
+		rewind.update();
+		if(frame == 400){
+			snapCycle = raquette.cycles;
+			snapTyped = typed;
+			raquette.runCycles(5000);
+			raquette.captureState(*mid);
+			raquette.runCycles(Raquette::FRAME_CYCLES - 5000);
+		}else{
+			raquette.runCycles(Raquette::FRAME_CYCLES);
+		}
+	}
+	raquette.captureState(*expected);
+	rewind.report(std::cout);
+
+	// Between two snapshots, the cycle count is exact but the overshoot of the slice it ended is not saved
+	bool ok = rewind.rewindTo(mid->cycles);
+	std::cout << "Rewound " << (expected->cycles - mid->cycles) << " cycles in " << rewind.lastRewindUs << " us\n";
+	raquette.captureState(*got);
+	got->overshoot = mid->overshoot;
+	if(!ok || !std::equal((const char *)mid, (const char *)mid + sizeof(Raquette::SaveState), (const char *)got)){
+		std::cout << "Machine rewound between snapshots does not match\n";
+	}
+
+	// To a snapshot, then the same input again
+	ok = rewind.rewindTo(snapCycle);
+	std::cout << "Rewound to snapshot in " << rewind.lastRewindUs << " us\n";
+	typed = snapTyped;
+	for(unsigned frame=400; ok && (frame<FRAMES); frame++){
+		if(frame != 400) raq_type_next(raquette, input, typed);
+		rewind.update();
+		raquette.runCycles(Raquette::FRAME_CYCLES);
+	}
+	raquette.captureState(*got);
+	// Idle loop passes skipped, and so instructions run, depend on how the runs were sliced, frame 400 was split the first time
+	got->idleSkipped = expected->idleSkipped;
+	got->instructions = expected->instructions;
+	if(!ok || !std::equal((const char *)expected, (const char *)expected + sizeof(Raquette::SaveState), (const char *)got)){
+		std::cout << "Machine replayed from a snapshot does not match\n";
+	}else{
+		std::cout << "Rewound machines match, ended at pc:" << std::hex << got->pc << std::dec
+			<< " cycles:" << got->cycles << "\n";
+	}
+
+	if((rewind.oldestCycle() == 0) || rewind.rewindTo(rewind.oldestCycle() - 1)){
+		std::cout << "Rewound past the start of the buffer\n";
+	}
+	delete expected;
+	delete mid;
+	delete got;
+
+	// Rewinding a replay that has run out to before its last records must replay them again
+	Raquette recorded;
+	raq_record_typing(recorded, 120);
+	Raquette replayed;
+	replayed.inputLog = recorded.inputLog;
+	replayed.inputStart = recorded.inputStart;
+	if(!replayed.startReplay()) return;
+	RaqRewind history(replayed);
+	for(int frame=0; frame<120; frame++){
+		history.update();
+		replayed.runCycles(Raquette::FRAME_CYCLES);
+	}
+	ok = !replayed.replayingInput && history.rewindFrames(90); // To frame 30, before the first key
+	while(ok && (replayed.cycles < recorded.cycles)){
+		replayed.runCycles(std::min<uint64_t>(recorded.cycles - replayed.cycles, Raquette::FRAME_CYCLES));
+	}
+	if(!ok || (raq_memory_hash(replayed) != raq_memory_hash(recorded))){
+		std::cout << "Replay rewound after its end does not match the recording\n";
+	}else{
+		std::cout << "Replay rewound after its end matches the recording\n";
+	}
+}
+
+// Pixels of dispBuf redrawn by the last renderScreen()
+unsigned raq_dirty_pixels(Raquette &raquette){
+	unsigned pixels = 0;
+	for(const Raquette::DirtyRect &rect : raquette.dirtyRects){
+		pixels += rect.w * rect.h;
+	}
+	return pixels;
+}
+
+// Redraws the whole screen and returns false if that changes anything the last renderScreen() left
+bool raq_render_matches(Raquette &raquette){
+	static char drawn[192][280];
+	std::copy(&raquette.dispBuf[0][0], &raquette.dispBuf[0][0] + sizeof(drawn), &drawn[0][0]);
+	raquette.screen_update = true;
+	raquette.renderScreen();
+	return std::equal(&drawn[0][0], &drawn[0][0] + sizeof(drawn), &raquette.dispBuf[0][0]);
+}
+
+// Types a key at the monitor prompt and renders two frames ahead
+// The frame shown ahead must be the one the machine really draws two frames later,
+// and running ahead must leave the machine exactly as it was.
+void test_raq_runahead(){
+	static char ahead[192][280];
+	Raquette::SaveState *before = new Raquette::SaveState();
+	Raquette::SaveState *after = new Raquette::SaveState();
+
+	Raquette raquette;
+	raquette.useJit = true;
+	for(int i=0; i<60; i++){
+		raquette.runCycles(Raquette::FRAME_CYCLES);
+	}
+	raquette.renderScreen();
+	raquette.memory[0xC000] = 'A' | 0b10000000;
+
+	raquette.captureState(*before);
+	size_t blocks = raquette.blockCount;
+	auto start = std::chrono::steady_clock::now();
+	raquette.renderAhead(2);
+	std::chrono::duration<double, std::micro> usecs = std::chrono::steady_clock::now() - start;
+	raquette.captureState(*after);
+	std::copy(&raquette.dispBuf[0][0], &raquette.dispBuf[0][0] + sizeof(ahead), &ahead[0][0]);
+	unsigned pixels = raq_dirty_pixels(raquette);
+	std::cout << "Ran 2 frames ahead in " << usecs.count() << " us, redrew " << pixels
+		<< " pixels, cached blocks went from " << blocks << " to " << raquette.blockCount << "\n";
+	if(pixels == 280*192){
+		std::cout << "Running ahead redrew the whole screen\n";
+	}
+	if(!std::equal((const char *)before, (const char *)before + sizeof(Raquette::SaveState), (const char *)after)){
+		std::cout << "Running ahead changed the machine\n";
+	}
+
+	raquette.renderScreen();
+	if(std::equal(&ahead[0][0], &ahead[0][0] + sizeof(ahead), &raquette.dispBuf[0][0])){
+		std::cout << "Frame shown ahead is the same as the current one\n";
+	}
+	// Only what was drawn ahead was put back, which must leave the same frame as a full redraw
+	if(!raq_render_matches(raquette)){
+		std::cout << "Frame after running ahead does not match a full redraw\n";
+	}
+	for(int i=0; i<2; i++){
+		raquette.runCycles(Raquette::FRAME_CYCLES);
+	}
+	raquette.renderScreen();
+	if(!std::equal(&ahead[0][0], &ahead[0][0] + sizeof(ahead), &raquette.dispBuf[0][0])){
+		std::cout << "Frame shown ahead does not match the machine two frames later\n";
+	}else{
+		std::cout << "Frame shown ahead matches the machine two frames later\n";
+	}
+	delete before;
+	delete after;
+
+	// Running ahead every frame of a replay, across the end of its log, must not change the replay
+	Raquette recorded;
+	raq_record_typing(recorded, 120);
+	Raquette plain, shown;
+	for(Raquette *replayed : {&plain, &shown}){
+		replayed->inputLog = recorded.inputLog;
+		replayed->inputStart = recorded.inputStart;
+		if(!replayed->startReplay()) return;
+	}
+	for(int i=0; i<120; i++){
+		plain.runCycles(Raquette::FRAME_CYCLES);
+		shown.runCycles(Raquette::FRAME_CYCLES);
+		shown.renderAhead(3);
+	}
+	if((raq_memory_hash(shown) != raq_memory_hash(recorded)) || (raq_memory_hash(plain) != raq_memory_hash(recorded))){
+		std::cout << "Replay run ahead across the end of its log does not match a plain replay\n";
+	}else{
+		std::cout << "Replay of " << recorded.inputLog.size() << " inputs run ahead matches a plain replay\n";
+	}
+}
+
+// Records typing at the monitor prompt, with REPT held for a while, in runs of uneven length.
+// Replaying the log on a fresh machine in whole frames with the JIT on, and again one instruction
+// at a time, must end with memory bit-identical to the recorded machine.
+void test_raq_input(){
+	const std::string input = "0123456789\rFEDCBA9876543210\r";
+	Raquette recorded;
+	recorded.startRecording();
+	unsigned typed = 0;
+	for(unsigned i=0; i<3000; i++){
+		if((typed < input.size()) && !(recorded.memory[0xC000] & 0b10000000)){
+			recorded.keyInput(input[typed++] | 0b10000000);
+		}
+		recorded.setRepeat((i >= 1500) && (i < 1700));
+		recorded.runCycles(1000 + (i * 7919) % 5000);
+	}
+	recorded.stopRecording();
+	if(!recorded.saveInput("raq_input.bin")) return;
+	std::ifstream logFile("raq_input.bin", std::ios::binary | std::ios::ate);
+	std::cout << "Recorded " << recorded.inputLog.size() << " inputs over " << recorded.cycles << " cycles in "
+		<< logFile.tellg() << " bytes\n";
+
+	for(int mode=0; mode<2; mode++){
+		Raquette replayed;
+		replayed.useJit = (mode == 0);
+		replayed.useBlockCache = (mode == 0);
+		replayed.useIdleSkip = (mode == 0);
+		if(!replayed.loadInput("raq_input.bin") || !replayed.startReplay()) return;
+		auto start = std::chrono::steady_clock::now();
+		while(replayed.cycles < recorded.cycles){
+			uint64_t left = recorded.cycles - replayed.cycles;
+			replayed.runCycles((mode == 0) ? std::min<uint64_t>(left, Raquette::FRAME_CYCLES) : 1);
+		}
+		std::chrono::duration<double, std::milli> msecs = std::chrono::steady_clock::now() - start;
+		const char *name = (mode == 0) ? "Replay in frames with the JIT" : "Replay one instruction at a time";
+		// Instructions are not compared, skipped idle loop passes are not counted as run
+		if((replayed.cycles != recorded.cycles) || (replayed.pc != recorded.pc)
+			|| !std::equal(recorded.memory, recorded.memory + 0x10000, replayed.memory)){
+			std::cout << name << " does not match the recording\n";
+		}else{
+			std::cout << name << " matches, pc:" << std::hex << replayed.pc << std::dec << " cycles:"
+				<< replayed.cycles << " in " << msecs.count() << " ms\n";
+		}
+	}
+
+	// A replay must start from the cycle the recording did
+	Raquette late;
+	late.runCycles(1000);
+	if(late.loadInput("raq_input.bin") && late.startReplay()){
+		std::cout << "Replay started from the wrong cycle\n";
+	}
+}
+
+// Types at the monitor prompt and checks that only the changed cells are redrawn, then makes random
+// writes to every display page and random mode switches, checking after each batch that redrawing
+// only what was marked gives the same screen as redrawing it all.
+void test_raq_dirty(){
+	Raquette booted;
+	for(int i=0; i<60; i++){
+		booted.runCycles(Raquette::FRAME_CYCLES);
+	}
+	booted.renderScreen();
+	booted.keyInput('A' | 0b10000000);
+	unsigned frames = 0, pixels = 0;
+	for(int i=0; i<60; i++){
+		booted.runCycles(Raquette::FRAME_CYCLES);
+		if(booted.renderScreen()) frames++;
+		pixels += raq_dirty_pixels(booted);
+	}
+	std::cout << "Typing a key redrew " << frames << " frames, " << pixels << " pixels in all\n";
+	if(!raq_render_matches(booted)){
+		std::cout << "Screen redrawn in parts does not match the monitor's screen\n";
+	}
+
+	static uint8_t image[0x10000];
+	Raquette raquette(image, 0x10000);
+	raquette.renderScreen();
+	raquette.memWrite(0x0800, 'B'); // Text page 2 while page 1 is shown
+	raquette.memWrite(0x2000, 0x7F); // Hi-res while in text mode
+	if(raquette.renderScreen()){
+		std::cout << "Writes to memory that is not shown were redrawn\n";
+	}
+	srand(1);
+	unsigned mismatches = 0, partial = 0;
+	for(int batch=0; batch<2000; batch++){
+		for(int i=0; i<20; i++){
+			int addr = (rand() % 2) ? (0x0400 + rand() % 0x800) : (0x2000 + rand() % 0x4000);
+			raquette.memWrite(addr, rand() & 0xFF);
+		}
+		if(batch % 50 == 0){
+			raquette.memRead(0xC050 + rand() % 8); // Any of the video soft switches
+		}
+		if(!raquette.screen_update) partial++;
+		raquette.renderScreen();
+		if(!raq_render_matches(raquette)) mismatches++;
+	}
+	std::cout << partial << " of 2000 random batches redrawn in parts, " << mismatches << " did not match a full redraw\n";
+}
+
+// Text cell as the renderer used to draw it, bit by bit from charset, for normal characters
+void raq_text_reference(uint8_t val, char cell[8][7]){
+	for(int chary=0; chary<8; chary++){
+		for(int charx=0; charx<7; charx++){
+			bool lit = (chary < 7) && (charx < 5) && ((Raquette::charset[(7*(1+(val % 0x40)))-(chary+1)] >> (7-charx)) & 0b1);
+			cell[chary][charx] = lit ? 15 : 0;
+		}
+	}
+}
+
+// Checks every screen code in both flash phases against the old bit by bit drawing, checks that
+// only the flashing cells are redrawn when the phase changes, and times a scrolled text screen.
+void test_raq_text(){
+	const unsigned FRAMES = 2000;
+	static uint8_t image[0x10000];
+	Raquette raquette(image, 0x10000);
+	unsigned mismatches = 0;
+	for(int phase=0; phase<2; phase++){
+		raquette.cycles = phase ? 0 : 600000; // Flashing characters inverse at the start of each 900000 cycles
+		for(int i=0; i<256; i++){
+			raquette.memory[0x400 + ((i/40)*128) + (i%40)] = i; // Rows 0 to 6
+		}
+		raquette.screen_update = true;
+		raquette.renderScreen();
+		for(int i=0; i<256; i++){
+			char expected[8][7];
+			raq_text_reference(i, expected);
+			bool inverse = (i < 0x40) || ((i < 0x80) && phase);
+			int row = (i/40) * 8, col = (i%40) * 7;
+			for(int y=0; y<8; y++){
+				for(int x=0; x<7; x++){
+					if(raquette.dispBuf[row+y][col+x] != (inverse ? 15 - expected[y][x] : expected[y][x])) mismatches++;
+				}
+			}
+		}
+	}
+	std::cout << "256 screen codes in both flash phases, " << mismatches << " pixels did not match\n";
+
+	// A screen of normal text with one flashing cursor
+	for(int i=0; i<960; i++){
+		raquette.memory[0x400 + ((i/40)%8)*128 + ((i/320)*40) + (i%40)] = 0xC1 + (i % 26);
+	}
+	raquette.memory[0x400 + 39] = 0x60; // Flashing space
+	raquette.cycles = 0;
+	raquette.screen_update = true;
+	raquette.renderScreen();
+	raquette.cycles = 100000;
+	bool early = raquette.renderScreen();
+	raquette.cycles = 600000;
+	raquette.renderScreen();
+	unsigned pixels = raq_dirty_pixels(raquette);
+	if(early || (pixels != 56) || !raq_render_matches(raquette)){
+		std::cout << "Flash phase change redrew " << pixels << " pixels, expected only the flashing cell's 56\n";
+	}
+
+	// Scrolling moves every line up, so every cell is redrawn
+	auto start = std::chrono::steady_clock::now();
+	for(unsigned frame=0; frame<FRAMES; frame++){
+		for(int i=0; i<960; i++){
+			raquette.memWrite(0x400 + ((i/40)%8)*128 + ((i/320)*40) + (i%40), 0xC1 + ((i + frame) % 26));
+		}
+		raquette.renderScreen();
+	}
+	std::chrono::duration<double, std::milli> msecs = std::chrono::steady_clock::now() - start;
+	std::cout << "Scrolled text screen: " << (msecs.count() * 1000 / FRAMES) << " us per frame including the writes\n";
+}
+
+// Hi-res scanline as the renderer used to decode it before the table, as a reference for the table
+// This is the old renderLineHelper() loop, reading the line's 40 bytes from bytes instead of memory.
+void raq_hires_reference(const uint8_t *bytes, char *pixels){
+	for(int col=0; col<40; col+=2){
+		int dots[14];
+		for(int i=0; i<7; i++){
+			dots[i] = (bytes[col] >> i) & 0b1; // first byte 3.5 pixels
+			dots[i+7] = (bytes[col+1] >> i) & 0b1; // second byte 3.5 pixels
+		}
+		int palate1 = (bytes[col] >> 7) & 0b1;
+		int palate2 = (bytes[col+1] >> 7) & 0b1;
+
+		// join two chars and print 14 pixels per line
+		for (int pixel=0; pixel<7; pixel++){
+			int color1, color2;
+			if(dots[pixel*2] && dots[(pixel*2)+1]){
+				color1=15; // white
+				color2=15; // white
+			}else if(!dots[pixel*2] && dots[(pixel*2)+1]){
+				color1 = (palate1 ? 17 : 16); // Green or Orange
+				color2 = (palate2 ? 17 : 16); // Green or Orange
+			}else if(dots[pixel*2] && !dots[(pixel*2)+1]){
+				color1 = (palate1 ? 19 : 18); // Violet or Blue
+				color2 = (palate2 ? 19 : 18); // Violet or Blue
+			}else{
+				color1 = 0; // black
+				color2 = 0; // black
+			}
+			pixels[(col*7)+(pixel*2)] = dots[pixel*2] * ((pixel > 3) ? color2 : color1);
+			pixels[(col*7)+(pixel*2)+1] = dots[(pixel*2)+1] * ((pixel > 2) ? color2 : color1);
+		}
+	}
+	// Any two lit pixels side by side turn white
+	for(int x=0; x<279; x++){
+		if(pixels[x] && pixels[x+1]){
+			pixels[x] = 15; // White
+			pixels[x+1] = 15; // White
+		}
+	}
+}
+
+// Fills full screen hi-res page 1 with random bytes, checks every line against the reference
+// decoder, and times whole-screen redraws with the table against the reference.
+void test_raq_hires(){
+	const unsigned FRAMES = 2000;
+	static uint8_t image[0x10000];
+	Raquette raquette(image, 0x10000);
+	raquette.memRead(0xC050); // Graphics
+	raquette.memRead(0xC052); // Full screen
+	raquette.memRead(0xC057); // Hi-res
+	srand(1);
+	unsigned mismatches = 0;
+	for(int screen=0; screen<100; screen++){
+		for(int addr=0x2000; addr<0x4000; addr++){
+			raquette.memory[addr] = rand() & 0xFF;
+		}
+		raquette.screen_update = true;
+		raquette.renderScreen();
+		for(int line=0; line<192; line++){
+			int row = line/8;
+			char expected[280];
+			raq_hires_reference(&raquette.memory[0x2000 + ((row%8)*128) + ((row/8)*40) + (1024*(line%8))], expected);
+			if(!std::equal(expected, expected+280, raquette.dispBuf[line])) mismatches++;
+		}
+	}
+	std::cout << "100 random hi-res screens, " << mismatches << " lines did not match the reference\n";
+
+	auto start = std::chrono::steady_clock::now();
+	for(unsigned frame=0; frame<FRAMES; frame++){
+		raquette.screen_update = true;
+		raquette.renderScreen();
+	}
+	std::chrono::duration<double, std::milli> table = std::chrono::steady_clock::now() - start;
+	start = std::chrono::steady_clock::now();
+	for(unsigned frame=0; frame<FRAMES; frame++){
+		for(int line=0; line<192; line++){
+			int row = line/8;
+			raq_hires_reference(&raquette.memory[0x2000 + ((row%8)*128) + ((row/8)*40) + (1024*(line%8))], raquette.dispBuf[line]);
+		}
+	}
+	std::chrono::duration<double, std::milli> reference = std::chrono::steady_clock::now() - start;
+	std::cout << "Full screen hi-res: " << (table.count() * 1000 / FRAMES) << " us per frame with the table, "
+		<< (reference.count() * 1000 / FRAMES) << " us decoding dots\n";
+}
+
+// Times each palette expansion kernel the host supports on a screen of random colours, at the
+// scales the frontend uses and at the largest that fits a 3840x2160 display, and checks each one
+// against the scalar kernel, also on a rectangle that does not start or end on a whole vector.
+void bench_raq_expand(){
+	const unsigned scales[] = {1, 2, 3, 4, 11};
+	const unsigned FRAMES = 200;
+	uint32_t palette[256];
+	for(int i=0; i<256; i++){
+		palette[i] = 0xFF000000 | (i * 0x010203);
+	}
+	Raquette raquette;
+	raquette.renderScreen();
+	srand(1);
+	for(int i=0; i<192; i++){
+		for(int j=0; j<280; j++){
+			raquette.dispBuf[i][j] = rand() % 20;
+		}
+	}
+	const Raquette::DirtyRect whole = {0, 0, 280, 192};
+	const Raquette::DirtyRect odd = {3, 5, 17, 9};
+	const RaqExpandKernel &scalar = raqExpandKernels[RAQ_EXPAND_KERNELS-1];
+	std::cout << "Fastest kernel on this host: " << raqExpandBest().name << "\n";
+
+	for(unsigned scale : scales){
+		size_t pitch = 280 * scale * sizeof(uint32_t);
+		std::vector<uint32_t> expected(280 * scale * 192 * scale), got(expected.size());
+		raqExpandRect(scalar, raquette.dispBuf, whole, expected.data(), pitch, scale, palette);
+		for(unsigned k=0; k < RAQ_EXPAND_KERNELS; k++){
+			const RaqExpandKernel &kernel = raqExpandKernels[k];
+			if(!kernel.supported()) continue;
+			auto start = std::chrono::steady_clock::now();
+			for(unsigned frame=0; frame<FRAMES; frame++){
+				raqExpandRect(kernel, raquette.dispBuf, whole, got.data(), pitch, scale, palette);
+			}
+			std::chrono::duration<double, std::milli> msecs = std::chrono::steady_clock::now() - start;
+			std::cout << "Scale " << scale << " (" << 280*scale << "x" << 192*scale << ") " << kernel.name << ": "
+				<< msecs.count() / FRAMES << " ms per frame, " << (got.size() * FRAMES / (msecs.count() * 1000)) << " Mpixels/s\n";
+			if(got != expected){
+				std::cout << kernel.name << " does not match the scalar kernel at scale " << scale << "\n";
+			}
+			// Pixels around a small rectangle must be left alone
+			std::fill(got.begin(), got.end(), 0);
+			std::fill(expected.begin(), expected.end(), 0);
+			size_t offset = (odd.y * scale * pitch / 4) + (odd.x * scale);
+			raqExpandRect(scalar, raquette.dispBuf, odd, expected.data() + offset, pitch, scale, palette);
+			raqExpandRect(kernel, raquette.dispBuf, odd, got.data() + offset, pitch, scale, palette);
+			if(got != expected){
+				std::cout << kernel.name << " does not match the scalar kernel on a small rectangle at scale " << scale << "\n";
+			}
+			raqExpandRect(scalar, raquette.dispBuf, whole, expected.data(), pitch, scale, palette);
+		}
+	}
+}
+
+// Passes a million numbers through the command queue between two threads, checking their order,
+// then runs a machine on its own thread flat out while typing at it, keeping a copy of the screen
+// from only the dirty rects of the frames taken. Taking frames slowly now and then makes the
+// runner replace frames that were never taken, whose rects must still reach the copy.
+// Finally checks the paced runner keeps to 60 frames per second.
+void test_raq_runner(){
+	const unsigned COUNT = 1000000;
+	RaqQueue<unsigned, 256> queue;
+	std::thread producer([&queue](){
+		for(unsigned i=0; i<COUNT; ){
+			if(queue.push(i)) i++;
+			else std::this_thread::yield(); // Full, let the consumer in if they share a core
+		}
+	});
+	unsigned expected = 0, outOfOrder = 0;
+	while(expected < COUNT){
+		unsigned val;
+		if(!queue.pop(val)){
+			std::this_thread::yield();
+			continue;
+		}
+		if(val != expected) outOfOrder++;
+		expected = val + 1;
+	}
+	producer.join();
+	std::cout << "Queue passed " << COUNT << " numbers between threads, " << outOfOrder << " out of order\n";
+
+	const std::string typed = "0123456789\r";
+	const unsigned FRAMES = 600; // Run on for 10 s after typing
+	Raquette raquette;
+	raquette.useJit = true;
+	RaqRunner runner(raquette);
+	runner.paced = false;
+	runner.start();
+	static char screen[192][280];
+	unsigned taken = 0, skipped = 0, mismatches = 0, next = 0;
+	uint64_t lastNumber = 0, typedBy = 0; // Frame by which the last key had been read
+	auto start = std::chrono::steady_clock::now();
+	while(true){
+		if((next < typed.size()) && !(runner.keyLatch() & 0b10000000)){
+			runner.keyInput(typed[next++] | 0b10000000);
+		}
+		const RaqRunner::Frame *frame = runner.takeFrame();
+		if(!frame){
+			std::this_thread::yield();
+			continue;
+		}
+		if(taken && (frame->number > lastNumber + 1)) skipped += frame->number - lastNumber - 1;
+		lastNumber = frame->number;
+		taken++;
+		for(const Raquette::DirtyRect &rect : frame->dirtyRects){
+			for(int y=rect.y; y < rect.y + rect.h; y++){
+				std::copy(&frame->pixels[y][rect.x], &frame->pixels[y][rect.x + rect.w], &screen[y][rect.x]);
+			}
+		}
+		if(!frame->dirtyRects.empty() && !std::equal(&screen[0][0], &screen[0][0] + sizeof(screen), &frame->pixels[0][0])){
+			mismatches++;
+		}
+		if(!typedBy && (next == typed.size()) && !(runner.keyLatch() & 0b10000000)) typedBy = frame->number;
+		if(typedBy && (frame->number >= typedBy + FRAMES) && (taken >= 200)) break;
+		if(taken % 8 == 0) usleep(500); // Long enough for the runner to get a frame or two ahead
+	}
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	runner.stop();
+	std::cout << "Unpaced runner: " << taken << " frames taken, " << skipped << " skipped, "
+		<< (lastNumber / secs.count()) << " frames/s, " << mismatches << " screens did not match\n";
+	const RaqRunner::Frame *last = runner.takeFrame(); // Published after the loop stopped taking
+	if(last){
+		for(const Raquette::DirtyRect &rect : last->dirtyRects){
+			for(int y=rect.y; y < rect.y + rect.h; y++){
+				std::copy(&last->pixels[y][rect.x], &last->pixels[y][rect.x + rect.w], &screen[y][rect.x]);
+			}
+		}
+	}
+	if(!std::equal(&screen[0][0], &screen[0][0] + sizeof(screen), &raquette.dispBuf[0][0])){
+		std::cout << "Screen kept from dirty rects does not match the machine's last frame\n";
+	}
+
+	// The same keys typed one per frame on this thread must leave the same text on screen,
+	// so none were lost or typed twice
+	Raquette reference;
+	unsigned ref = 0;
+	for(unsigned frame=0; frame < 2*FRAMES; frame++){
+		if((ref < typed.size()) && !(reference.memory[0xC000] & 0b10000000)){
+			reference.keyInput(typed[ref++] | 0b10000000);
+		}
+		reference.runCycles(Raquette::FRAME_CYCLES);
+	}
+	if(!std::equal(&reference.memory[0x400], &reference.memory[0x800], &raquette.memory[0x400])){
+		std::cout << "Text typed through the runner does not match text typed directly\n";
+	}
+
+	RaqRunner paced(raquette);
+	paced.start();
+	usleep(500000);
+	paced.stop();
+	const RaqRunner::Frame *frame = paced.takeFrame();
+	std::cout << "Paced runner ran " << (frame ? frame->number + 1 : 0) << " frames in 0.5 s\n";
+}
+
+// Resident memory of this process in KB, from /proc/self/statm
+long raq_resident_kb(){
+	std::ifstream statm("/proc/self/statm");
+	long size = 0, resident = 0;
+	statm >> size >> resident;
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Boots many machines side by side and reports how much memory each one really costs
+// ROM and disk pages are shared, and untouched RAM costs nothing, so this should stay far below
+// the 64K of memory and 140K of disk each machine can address.
+void test_raq_sharing(){
+	const unsigned COUNT = 200;
+	std::vector<Raquette *> machines;
+	Raquette::Config config;
+	config.log = nullptr;
+	long before = raq_resident_kb();
+	for(unsigned i=0; i < COUNT; i++){
+		Raquette *raquette = new Raquette(config);
+		for(int frame=0; frame < 60; frame++){
+			raquette->runCycles(Raquette::FRAME_CYCLES);
+		}
+		machines.push_back(raquette);
+	}
+	long after = raq_resident_kb();
+	double perMachine = double(after - before) / COUNT;
+	std::cout << COUNT << " booted machines use " << (after - before) << " KB, " << perMachine << " KB each\n";
+	if(perMachine > 128){
+		std::cout << "Machines are not sharing their ROM and untouched memory\n";
+	}
+
+	// Every machine must still see the ROM, and its own writes must stay its own
+	machines[0]->memWrite(0x0300, 0xAA);
+	if((machines[1]->memory[0x0300] == 0xAA) || (machines[1]->memory[0xFFFC] != machines[0]->memory[0xFFFC])
+		|| (machines[COUNT-1]->pc != machines[0]->pc)){
+		std::cout << "Machines are not independent\n";
+	}
+	for(Raquette *raquette : machines){
+		delete raquette;
+	}
+}
+
+// Profiles the monitor ROM while lines of digits are typed at its prompt
+// Names come from raq_rom.map, which the ROM Makefile writes next to raq_rom.bin.
+void profile_raq_rom(){
+	const std::string input = "12345\r";
+	Raquette raquette;
+	raquette.startProfile();
+	for(unsigned typed=0; typed < 50 * input.size(); ){
+		raquette.runCycles(Raquette::FRAME_CYCLES);
+		if(!(raquette.memory[0xC000] & 0b10000000)){
+			raquette.memory[0xC000] = input[typed++ % input.size()] | 0b10000000;
+		}
+	}
+	raquette.stopProfile();
+	raquette.profileReport(std::cout, "../software/raquette/rom/raq_rom.map");
+}
+
+// Runs the functional test untraced and then with tracing compiled in, and compares throughput
+void bench_raq_trace(){
+	uint8_t raq_rom_arr[0xFFFF+1];
+	if(!load_raq_functional_test(raq_rom_arr)) return;
+
+	double mips[2];
+	for(int traced=0; traced<2; traced++){
+		Raquette raquette(raq_rom_arr, 0xFFFF+1);
+		raquette.pc = 0x0400;
+
+		auto start = std::chrono::steady_clock::now();
+		int prevpc = 0xFFFFF;
+		int numsteps = 0;
+		while(true){
+			numsteps++;
+			if(raquette.step(traced)) break;
+			if(raquette.pc == prevpc) break;
+			prevpc = raquette.pc;
+		}
+		std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+		mips[traced] = numsteps / secs.count() / 1e6;
+		std::cout << (traced ? "Traced:   " : "Untraced: ") << numsteps << " instructions in "
+			<< secs.count() << " s (" << mips[traced] << " MIPS)\n";
+	}
+	std::cout << "Untraced core is " << (mips[0] / mips[1]) << "x the traced core\n";
+
+	// Same run through runCycles while a writer thread streams the trace to disk
+	Raquette raquette(raq_rom_arr, 0xFFFF+1);
+	raquette.pc = 0x0400;
+	if(!raquette.startTrace("raq_trace.bin")) return;
+	auto start = std::chrono::steady_clock::now();
+	int prevpc = 0xFFFFF;
+	while((raquette.pc != prevpc) || !raq_trapped(raquette)){
+		prevpc = raquette.pc;
+		if(raquette.runCycles(1000) == Raquette::STOP_HALT) break;
+	}
+	raquette.stopTrace();
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	std::cout << "To file:  " << raquette.instructions << " instructions in " << secs.count() << " s ("
+		<< (raquette.instructions / secs.count() / 1e6) << " MIPS)\n";
+
+	std::ifstream infile("raq_trace.bin", std::ios::binary | std::ios::ate);
+	uint64_t records = ((uint64_t)infile.tellg() - sizeof(TraceFileHeader)) / sizeof(Raquette::TraceRecord);
+	if(records != raquette.instructions){
+		std::cout << "raq_trace.bin holds " << records << " records, does not match\n";
+	}else{
+		std::cout << "raq_trace.bin holds every instruction, decode it with ./raqdecode raq_trace.bin\n";
+	}
+}
+
 void test_lvdc(){
 	std::cout << "Testing LVDC\n";
 
@@ -154,6 +1120,66 @@ int main() {
 	test_raq_all(); // Loads a ~13k functional test ROM file to 0x0400 and runs it
 	#endif
 
+	#ifdef USE_RAQIDLETEST
+	test_raq_idle(); // Boots the ROM to its keyboard loop with and without idle loop skipping
+	#endif
+
+	#ifdef USE_RAQIRQTEST
+	test_raq_interrupts(); // Sends IRQs and an NMI to a small program in every execution mode
+	#endif
+
+	#ifdef USE_RAQSTATETEST
+	test_raq_savestate(); // Saves the booted ROM, restores it into a new machine and compares them
+	#endif
+
+	#ifdef USE_RAQREWINDTEST
+	test_raq_rewind(); // Types at the ROM prompt, rewinds and checks the rebuilt machine
+	#endif
+
+	#ifdef USE_RAQRUNAHEADTEST
+	test_raq_runahead(); // Renders ahead after a key press and checks the machine is unchanged
+	#endif
+
+	#ifdef USE_RAQSHARETEST
+	test_raq_sharing(); // Boots 200 machines and reports the memory each one costs
+	#endif
+
+	#ifdef USE_RAQINPUTTEST
+	test_raq_input(); // Records typing at the ROM prompt and replays it bit for bit
+	#endif
+
+	#ifdef USE_RAQDIRTYTEST
+	test_raq_dirty(); // Checks that rendering only the changed cells matches a full redraw
+	#endif
+
+	#ifdef USE_RAQTEXTTEST
+	test_raq_text(); // Checks the text glyph table, inverse and flashing characters, and times a scrolled screen
+	#endif
+
+	#ifdef USE_RAQHIRESTEST
+	test_raq_hires(); // Checks the hi-res table renderer against decoding dot by dot and times both
+	#endif
+
+	#ifdef USE_RAQRUNNERTEST
+	test_raq_runner(); // Checks the command queue and the emulation thread's frames, and its pacing
+	#endif
+
+	#ifdef USE_RAQPROFILE
+	profile_raq_rom(); // Types at the monitor prompt with the profiler on and prints the report
+	#endif
+
+	#ifdef USE_RAQTRACEBENCH
+	bench_raq_trace(); // Compares the untraced and traced interpreter cores on the functional test
+	#endif
+
+	#ifdef USE_RAQEXPANDBENCH
+	bench_raq_expand(); // Times the palette expansion kernels at each scale and checks them against each other
+	#endif
+
+	#ifdef USE_RAQBLOCKTEST
+	test_raq_blocks(); // Runs the functional test interpreted, with the block cache and with the JIT
+	#endif
+
 	#ifdef USE_LVDC
 	test_lvdc();
 	#endif
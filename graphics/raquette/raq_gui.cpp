@@ -2,430 +2,414 @@
 #include <fstream>
 #include "../../computer/computer.hpp"
 #include "../../computer/raquette.hpp"
+#include "../../computer/raqrewind.hpp"
+#include "../../computer/raqpixels.hpp"
+#include "../../computer/raqrunner.hpp"
 #include <SDL2/SDL.h>
 #include <unistd.h>
 
 #define WINDOW_WIDTH 600
-#define TIME_STEP (1)
-#define CPU_FACTOR (50)
+#define RUN_AHEAD_FRAMES (2) // Frames shown ahead of the machine after a key press, 0 to turn off
+#define RUN_AHEAD_MS (1000) // How long after the last key press to keep running ahead
 
 
-void bigPixel(SDL_Renderer *renderer, int x, int y, int size){
-	SDL_Rect pixel;
-	pixel.x = (x*size);
-	pixel.y = (y*size);
-	pixel.w = size;
-	pixel.h = size;
-	SDL_RenderFillRect(renderer, &pixel);
-	return;
-}
-
-unsigned int display_callbackfunc(Uint32 interval, void *param) {
-	SDL_Event event;
-    SDL_UserEvent userevent;
-    userevent.type = SDL_USEREVENT;
-    userevent.code = 2;
-    userevent.data1 = NULL;
-    userevent.data2 = NULL;
-    event.type = SDL_USEREVENT;
-    event.user = userevent;
-    SDL_PushEvent(&event);
-    return(interval);
+#define PIXEL_SIZE (WINDOW_WIDTH/(40*7)) // Window pixels per emulated pixel
 
-}
-
-unsigned int steps_callbackfunc(Uint32 interval, void *param) {
-	SDL_Event event;
-    SDL_UserEvent userevent;
-    userevent.type = SDL_USEREVENT;
-    userevent.code = 1;
-    userevent.data1 = NULL;
-    userevent.data2 = NULL;
-    event.type = SDL_USEREVENT;
-    event.user = userevent;
-    SDL_PushEvent(&event);
-    return(interval);
-}
+// ARGB colour of each dispBuf value
+static const Uint32 palette[256] = {
+	// LO-RES Colors
+	0xFF000000, // Black
+	0xFFB20062, // Magenta
+	0xFF021CED, // Dark blue
+	0xFFC900EE, // Purple
+	0xFF229B02, // Dark Green
+	0xFF677278, // Grey 1
+	0xFF15B1EA, // Medium blue
+	0xFF8587EC, // Light blue
+	0xFF545801, // Brown
+	0xFFE13300, // Orange
+	0xFF6F6D70, // Grey 2
+	0xFFE045E7, // Pink
+	0xFF44F600, // Green
+	0xFFD1D800, // Yellow
+	0xFF48FE75, // Aqua
+	0xFFEEE7EE, // White
+	// HI-RES Colors
+	0xFF20C000, // Green
+	0xFFF05000, // Orange
+	0xFFA000FF, // Violet
+	0xFF0080FF // Blue
+	// Should not happen, but the rest are transparent over the black background
+};
 
-unsigned int kbd_callbackfunc(Uint32 interval, void *param) {
-    SDL_Event event;
-    SDL_UserEvent userevent;
-    userevent.type = SDL_USEREVENT;
-    userevent.code = 0;
-    userevent.data1 = NULL;
-    userevent.data2 = NULL;
-    event.type = SDL_USEREVENT;
-    event.user = userevent;
-    SDL_PushEvent(&event);
-    return(interval);
+// Copies the parts of a frame that changed since the last one taken into the screen texture, already scaled up
+// Only those rows of the texture are locked (see raqpixels.hpp).
+void updateScreenTexture(SDL_Texture *texture, const RaqRunner::Frame &frame){
+	for(const Raquette::DirtyRect &dirty : frame.dirtyRects){
+		SDL_Rect rect = {dirty.x*PIXEL_SIZE, dirty.y*PIXEL_SIZE, dirty.w*PIXEL_SIZE, dirty.h*PIXEL_SIZE};
+		void *pixels;
+		int pitch;
+		if(SDL_LockTexture(texture, &rect, &pixels, &pitch) != 0) continue;
+		raqExpandRect(raqExpandBest(), frame.pixels, dirty, (uint32_t *)pixels, pitch, PIXEL_SIZE, palette);
+		SDL_UnlockTexture(texture);
+	}
 }
 
-int main(void) {
+// -record file saves the session's input when the window is closed, -replay file plays one back
+int main(int argc, char **argv) {
 
 
 	Raquette raquette;
+	raquette.useJit = true; // Translates hot code where the host supports it
+	RaqRewind rewind(raquette); // F5 steps back one second, up to ten seconds
+	const char *recordFile = nullptr;
+	if((argc == 3) && (std::string(argv[1]) == "-record")){
+		recordFile = argv[2];
+		raquette.startRecording();
+	}else if((argc == 3) && (std::string(argv[1]) == "-replay")){
+		if(!raquette.loadInput(argv[2]) || !raquette.startReplay()) return EXIT_FAILURE;
+	}else if(argc != 1){
+		std::cout << "Usage: " << argv[0] << " [-record file | -replay file]\n";
+		return EXIT_FAILURE;
+	}
 
 	SDL_Event event;
 	SDL_Renderer *renderer;
 	SDL_Window *window;
 
-	SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER);
+	SDL_Init(SDL_INIT_VIDEO);
 	SDL_CreateWindowAndRenderer(WINDOW_WIDTH, WINDOW_WIDTH, 0, &window, &renderer);
 	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
 	SDL_RenderClear(renderer);
+	// The machine draws into a texture the size it is shown at, so it is copied without scaling
+	SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+		280*PIXEL_SIZE, 192*PIXEL_SIZE);
 
-	// TODO Use just one callback func but set data in params
-	SDL_TimerID step_timer_id = SDL_AddTimer(TIME_STEP*CPU_FACTOR, steps_callbackfunc, 0);
-	SDL_TimerID kbd_timer_id = SDL_AddTimer(TIME_STEP, kbd_callbackfunc, 0);
-	SDL_TimerID display_timer_id = SDL_AddTimer(TIME_STEP*51, display_callbackfunc, 0);
+	// The machine runs on its own thread from here until runner.stop() (see raqrunner.hpp)
+	// This thread only polls the keyboard and shows the frames it finishes.
+	RaqRunner runner(raquette, &rewind);
+	runner.runAheadFrames = RUN_AHEAD_FRAMES;
+	runner.runAheadMs = RUN_AHEAD_MS;
+	runner.start();
 
 	// TODO Key repeat and rollover is not quite accurate
 	// Pressing a second key with one key held should type the second key once and then stop
-	// REPT key should reset strobe bit at 15 Hz without affecting lower 7 bits
 	// Releasing keys should not clear lower 7 bits. They should always retain the last press, even once released.
 	// All of this is supposed to be done in hardware. Unfortunately SDL makes it awkward to emulate.
 
 	bool quit = false;
 	while (!quit) {
-		SDL_WaitEvent(&event);
-		if(event.type == SDL_USEREVENT){
-			// Keyboard Callback
-			if(event.user.code == 0){
-				const Uint8 *state = SDL_GetKeyboardState(NULL);
-				if (state[SDL_SCANCODE_RETURN]) {
-					if(raquette.memory[0xC000] != (0x0D)){
-						raquette.memory[0xC000]  = (0x0D | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_A]){
-					if(raquette.memory[0xC000] != ('A')){
-						raquette.memory[0xC000]  = ('A' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_B]){
-					if((raquette.memory[0xC000] != ('B')) && (raquette.memory[0xC000] != (0x02))){
-						if((state[SDL_SCANCODE_LCTRL]) || state[SDL_SCANCODE_RCTRL]){
-							raquette.memory[0xC000]  = (0x02 | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('B' | 0b10000000);
-						}
-					}
-				}else if(state[SDL_SCANCODE_C]){
-					if((raquette.memory[0xC000] != ('C')) && (raquette.memory[0xC000] != (0x03))){
-						if((state[SDL_SCANCODE_LCTRL]) || state[SDL_SCANCODE_RCTRL]){
-							raquette.memory[0xC000]  = (0x03 | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('C' | 0b10000000);
-						}
-					}
-				}else if(state[SDL_SCANCODE_D]){
-					if(raquette.memory[0xC000] != ('D')){
-						raquette.memory[0xC000]  = ('D' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_E]){
-					if(raquette.memory[0xC000] != ('E')){
-						raquette.memory[0xC000]  = ('E' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_F]){
-					if(raquette.memory[0xC000] != ('F')){
-						raquette.memory[0xC000]  = ('F' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_G]){
-					if(raquette.memory[0xC000] != ('G')){
-						raquette.memory[0xC000]  = ('G' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_H]){
-					if(raquette.memory[0xC000] != ('H')){
-						raquette.memory[0xC000]  = ('H' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_I]){
-					if(raquette.memory[0xC000] != ('I')){
-						raquette.memory[0xC000]  = ('I' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_J]){
-					if(raquette.memory[0xC000] != ('J')){
-						raquette.memory[0xC000]  = ('J' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_K]){
-					if(raquette.memory[0xC000] != ('K')){
-						raquette.memory[0xC000]  = ('K' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_L]){
-					if(raquette.memory[0xC000] != ('L')){
-						raquette.memory[0xC000]  = ('L' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_M]){
-					if(raquette.memory[0xC000] != ('M')){
-						raquette.memory[0xC000]  = ('M' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_N]){
-					if(raquette.memory[0xC000] != ('N')){
-						raquette.memory[0xC000]  = ('N' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_O]){
-					if(raquette.memory[0xC000] != ('O')){
-						raquette.memory[0xC000]  = ('O' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_P]){
-					if(raquette.memory[0xC000] != ('P')){
-						raquette.memory[0xC000]  = ('P' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_Q]){
-					if(raquette.memory[0xC000] != ('Q')){
-						raquette.memory[0xC000]  = ('Q' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_R]){
-					if(raquette.memory[0xC000] != ('R')){
-						raquette.memory[0xC000]  = ('R' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_S]){
-					if(raquette.memory[0xC000] != ('S')){
-						raquette.memory[0xC000]  = ('S' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_T]){
-					if(raquette.memory[0xC000] != ('T')){
-						raquette.memory[0xC000]  = ('T' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_U]){
-					if(raquette.memory[0xC000] != ('U')){
-						raquette.memory[0xC000]  = ('U' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_V]){
-					if(raquette.memory[0xC000] != ('V')){
-						raquette.memory[0xC000]  = ('V' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_W]){
-					if(raquette.memory[0xC000] != ('W')){
-						raquette.memory[0xC000]  = ('W' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_X]){
-					if(raquette.memory[0xC000] != ('X')){
-						raquette.memory[0xC000]  = ('X' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_Y]){
-					if(raquette.memory[0xC000] != ('Y')){
-						raquette.memory[0xC000]  = ('Y' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_Z]){
-					if(raquette.memory[0xC000] != ('Z')){
-						raquette.memory[0xC000]  = ('Z' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_SPACE]){
-					if(raquette.memory[0xC000] != (' ')){
-						raquette.memory[0xC000]  = (' ' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_1]){
-					if((raquette.memory[0xC000] != ('1')) && (raquette.memory[0xC000] != ('!'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('!' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('1' | 0b10000000);
-						}
-					}
-				}else if(state[SDL_SCANCODE_2]){
-					if((raquette.memory[0xC000] != ('2')) && (raquette.memory[0xC000] != ('@'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('@' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('2' | 0b10000000);
-						}
-					}
-				}else if(state[SDL_SCANCODE_3]){
-					if((raquette.memory[0xC000] != ('3')) && (raquette.memory[0xC000] != ('#'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('#' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('3' | 0b10000000);
-						}
-					}
-				}else if(state[SDL_SCANCODE_4]){
-					if((raquette.memory[0xC000] != ('4')) && (raquette.memory[0xC000] != ('$'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('$' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('4' | 0b10000000);
-						}
-					}
-				}else if(state[SDL_SCANCODE_5]){
-					if((raquette.memory[0xC000] != ('5')) && (raquette.memory[0xC000] != ('%'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('%' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('5' | 0b10000000);
-						}
-					}
-				}else if(state[SDL_SCANCODE_6]){
-					if((raquette.memory[0xC000] != ('6')) && (raquette.memory[0xC000] != ('^'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('^' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('6' | 0b10000000);
-						}
-					}
-				}else if(state[SDL_SCANCODE_7]){
-					if((raquette.memory[0xC000] != ('7')) && (raquette.memory[0xC000] != ('&'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('&' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('7' | 0b10000000);
-						}
-					}
-				}else if(state[SDL_SCANCODE_8]){
-					if((raquette.memory[0xC000] != ('8')) && (raquette.memory[0xC000] != ('*'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('*' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('8' | 0b10000000);
-						}
-					}
-				}else if(state[SDL_SCANCODE_9]){
-					if((raquette.memory[0xC000] != ('9')) && (raquette.memory[0xC000] != ('('))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('(' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('9' | 0b10000000);
-						}
-					}
-				}else if(state[SDL_SCANCODE_0]){
-					if((raquette.memory[0xC000] != ('0')) && (raquette.memory[0xC000] != (')'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = (')' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('0' | 0b10000000);
-						}
-					}
+		// Waiting up to 1 ms for an event polls the keyboard about as often as the old 1 ms timer did
+		if(SDL_WaitEventTimeout(&event, 1)){
+			do{
+				if((event.type == SDL_KEYDOWN) && (event.key.keysym.scancode == SDL_SCANCODE_F5)){
+					runner.rewind(60);
+				}else if(event.type == SDL_QUIT){
+					quit = true;
+				}
+			}while(SDL_PollEvent(&event));
+		}
 
-				}else if(state[SDL_SCANCODE_MINUS]){
-					if((raquette.memory[0xC000] != ('-')) && (raquette.memory[0xC000] != ('_'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('_' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('-' | 0b10000000);
-						}
-					}
+		// Keyboard
+		const Uint8 *state = SDL_GetKeyboardState(NULL);
+		// Work on a copy of the latch and hand the machine any change at the end, so the
+		// change can be recorded (see Raquette::keyInput() and RaqRunner::keyLatch())
+		uint8_t latched = runner.keyLatch();
+		uint8_t key = latched;
+		// Right Alt stands in for REPT, which only makes sense with a key latched
+		runner.setRepeat(state[SDL_SCANCODE_RALT] && (key & 0x7F));
+		if (state[SDL_SCANCODE_RETURN]) {
+			if(key != (0x0D)){
+				key  = (0x0D | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_A]){
+			if(key != ('A')){
+				key  = ('A' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_B]){
+			if((key != ('B')) && (key != (0x02))){
+				if((state[SDL_SCANCODE_LCTRL]) || state[SDL_SCANCODE_RCTRL]){
+					key  = (0x02 | 0b10000000);
+				}else{
+					key  = ('B' | 0b10000000);
+				}
+			}
+		}else if(state[SDL_SCANCODE_C]){
+			if((key != ('C')) && (key != (0x03))){
+				if((state[SDL_SCANCODE_LCTRL]) || state[SDL_SCANCODE_RCTRL]){
+					key  = (0x03 | 0b10000000);
+				}else{
+					key  = ('C' | 0b10000000);
+				}
+			}
+		}else if(state[SDL_SCANCODE_D]){
+			if(key != ('D')){
+				key  = ('D' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_E]){
+			if(key != ('E')){
+				key  = ('E' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_F]){
+			if(key != ('F')){
+				key  = ('F' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_G]){
+			if(key != ('G')){
+				key  = ('G' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_H]){
+			if(key != ('H')){
+				key  = ('H' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_I]){
+			if(key != ('I')){
+				key  = ('I' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_J]){
+			if(key != ('J')){
+				key  = ('J' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_K]){
+			if(key != ('K')){
+				key  = ('K' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_L]){
+			if(key != ('L')){
+				key  = ('L' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_M]){
+			if(key != ('M')){
+				key  = ('M' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_N]){
+			if(key != ('N')){
+				key  = ('N' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_O]){
+			if(key != ('O')){
+				key  = ('O' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_P]){
+			if(key != ('P')){
+				key  = ('P' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_Q]){
+			if(key != ('Q')){
+				key  = ('Q' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_R]){
+			if(key != ('R')){
+				key  = ('R' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_S]){
+			if(key != ('S')){
+				key  = ('S' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_T]){
+			if(key != ('T')){
+				key  = ('T' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_U]){
+			if(key != ('U')){
+				key  = ('U' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_V]){
+			if(key != ('V')){
+				key  = ('V' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_W]){
+			if(key != ('W')){
+				key  = ('W' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_X]){
+			if(key != ('X')){
+				key  = ('X' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_Y]){
+			if(key != ('Y')){
+				key  = ('Y' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_Z]){
+			if(key != ('Z')){
+				key  = ('Z' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_SPACE]){
+			if(key != (' ')){
+				key  = (' ' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_1]){
+			if((key != ('1')) && (key != ('!'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('!' | 0b10000000);
+				}else{
+					key  = ('1' | 0b10000000);
+				}
+			}
+		}else if(state[SDL_SCANCODE_2]){
+			if((key != ('2')) && (key != ('@'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('@' | 0b10000000);
+				}else{
+					key  = ('2' | 0b10000000);
+				}
+			}
+		}else if(state[SDL_SCANCODE_3]){
+			if((key != ('3')) && (key != ('#'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('#' | 0b10000000);
+				}else{
+					key  = ('3' | 0b10000000);
+				}
+			}
+		}else if(state[SDL_SCANCODE_4]){
+			if((key != ('4')) && (key != ('$'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('$' | 0b10000000);
+				}else{
+					key  = ('4' | 0b10000000);
+				}
+			}
+		}else if(state[SDL_SCANCODE_5]){
+			if((key != ('5')) && (key != ('%'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('%' | 0b10000000);
+				}else{
+					key  = ('5' | 0b10000000);
+				}
+			}
+		}else if(state[SDL_SCANCODE_6]){
+			if((key != ('6')) && (key != ('^'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('^' | 0b10000000);
+				}else{
+					key  = ('6' | 0b10000000);
+				}
+			}
+		}else if(state[SDL_SCANCODE_7]){
+			if((key != ('7')) && (key != ('&'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('&' | 0b10000000);
+				}else{
+					key  = ('7' | 0b10000000);
+				}
+			}
+		}else if(state[SDL_SCANCODE_8]){
+			if((key != ('8')) && (key != ('*'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('*' | 0b10000000);
+				}else{
+					key  = ('8' | 0b10000000);
+				}
+			}
+		}else if(state[SDL_SCANCODE_9]){
+			if((key != ('9')) && (key != ('('))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('(' | 0b10000000);
+				}else{
+					key  = ('9' | 0b10000000);
+				}
+			}
+		}else if(state[SDL_SCANCODE_0]){
+			if((key != ('0')) && (key != (')'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = (')' | 0b10000000);
+				}else{
+					key  = ('0' | 0b10000000);
+				}
+			}
 
-				}else if(state[SDL_SCANCODE_COMMA]){
-					if(raquette.memory[0xC000] != (',')){
-						raquette.memory[0xC000]  = (',' | 0b10000000);
-					}
-				}else if(state[SDL_SCANCODE_SLASH]){
-					if((raquette.memory[0xC000] != ('/')) && (raquette.memory[0xC000] != ('\?'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('\?' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('/' | 0b10000000);
-						}
-					}
+		}else if(state[SDL_SCANCODE_MINUS]){
+			if((key != ('-')) && (key != ('_'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('_' | 0b10000000);
+				}else{
+					key  = ('-' | 0b10000000);
+				}
+			}
 
-				}else if(state[SDL_SCANCODE_PERIOD]){
-					if((raquette.memory[0xC000] != ('.')) && (raquette.memory[0xC000] != ('>'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('>' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('.' | 0b10000000);
-						}
-					}
+		}else if(state[SDL_SCANCODE_COMMA]){
+			if(key != (',')){
+				key  = (',' | 0b10000000);
+			}
+		}else if(state[SDL_SCANCODE_SLASH]){
+			if((key != ('/')) && (key != ('\?'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('\?' | 0b10000000);
+				}else{
+					key  = ('/' | 0b10000000);
+				}
+			}
 
+		}else if(state[SDL_SCANCODE_PERIOD]){
+			if((key != ('.')) && (key != ('>'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('>' | 0b10000000);
+				}else{
+					key  = ('.' | 0b10000000);
+				}
+			}
 
-				}else if(state[SDL_SCANCODE_EQUALS]){
-					if((raquette.memory[0xC000] != ('=')) && (raquette.memory[0xC000] != ('+'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('+' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('=' | 0b10000000);
-						}
-					}
-				}else if(state[SDL_SCANCODE_APOSTROPHE]){
-					if((raquette.memory[0xC000] != ('\"')) && (raquette.memory[0xC000] != ('\''))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = ('\"' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = ('\'' | 0b10000000);
-						}
-					}
-				}else if(state[SDL_SCANCODE_SEMICOLON]){
-					if((raquette.memory[0xC000] != (';')) && (raquette.memory[0xC000] != (':'))){
-						if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
-							raquette.memory[0xC000]  = (':' | 0b10000000);
-						}else{
-							raquette.memory[0xC000]  = (';' | 0b10000000);
-						}
-					}
 
-				}else if(state[SDL_SCANCODE_BACKSPACE]){
-					if(raquette.memory[0xC000] != (0x08)){
-						raquette.memory[0xC000]  = (0x08 | 0b10000000);
-					}
+		}else if(state[SDL_SCANCODE_EQUALS]){
+			if((key != ('=')) && (key != ('+'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('+' | 0b10000000);
 				}else{
-					// No keys pressed, last key read already
-					if(raquette.memory[0xC000] < 0b10000000){
-						raquette.memory[0xC000] = 0;
-					}
+					key  = ('=' | 0b10000000);
 				}
-			// Steps callback
-			}else if(event.user.code==1){
-				raquette.runMicroSeconds(TIME_STEP*CPU_FACTOR*1000);
-			// Display Callback
-			}else if(event.user.code==2){
-				if(raquette.renderScreen()){
-					for(int i=0; i<192; i++){
-						for(int j = 0; j<280; j++){
-							// LO-RES Colors
-							if(raquette.dispBuf[i][j] == 0){
-								SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0); // Black
-							}else if(raquette.dispBuf[i][j] == 1){
-								SDL_SetRenderDrawColor(renderer, 178, 0, 98, 0); // Magenta
-							}else if(raquette.dispBuf[i][j] == 2){
-								SDL_SetRenderDrawColor(renderer, 2, 28, 237, 0); // Dark blue
-							}else if(raquette.dispBuf[i][j] == 3){
-								SDL_SetRenderDrawColor(renderer, 201, 0, 238, 0); // Purple
-							}else if(raquette.dispBuf[i][j] == 4){
-								SDL_SetRenderDrawColor(renderer, 34, 155, 2, 0); // Dark Green
-							}else if(raquette.dispBuf[i][j] == 5){
-								SDL_SetRenderDrawColor(renderer, 103, 114, 120, 0); // Grey 1
-							}else if(raquette.dispBuf[i][j] == 6){
-								SDL_SetRenderDrawColor(renderer, 21, 177, 234, 0); // Medium blue
-							}else if(raquette.dispBuf[i][j] == 7){
-								SDL_SetRenderDrawColor(renderer, 133, 135, 236, 0); // Light blue
-							}else if(raquette.dispBuf[i][j] == 8){
-								SDL_SetRenderDrawColor(renderer, 84, 88, 1, 0); // Brown
-							}else if(raquette.dispBuf[i][j] == 9){
-								SDL_SetRenderDrawColor(renderer, 225, 51, 0, 0); // Orange
-							}else if(raquette.dispBuf[i][j] == 10){
-								SDL_SetRenderDrawColor(renderer, 111, 109, 112, 0); // Grey 2
-							}else if(raquette.dispBuf[i][j] == 11){
-								SDL_SetRenderDrawColor(renderer, 224, 69, 231, 0); // Pink
-							}else if(raquette.dispBuf[i][j] == 12){
-								SDL_SetRenderDrawColor(renderer, 68, 246, 0, 0); // Green
-							}else if(raquette.dispBuf[i][j] == 13){
-								SDL_SetRenderDrawColor(renderer, 209, 216, 0, 0); // Yellow
-							}else if(raquette.dispBuf[i][j] == 14){
-								SDL_SetRenderDrawColor(renderer, 72, 254, 117, 0); // Aqua
-							}else if(raquette.dispBuf[i][j] == 15){
-								SDL_SetRenderDrawColor(renderer, 238, 231, 238, 0); // White
-							// HI-RES Colors
-							}else if(raquette.dispBuf[i][j] == 16){
-								SDL_SetRenderDrawColor(renderer, 32, 192, 0, 0); // Green
-							}else if(raquette.dispBuf[i][j] == 17){
-								SDL_SetRenderDrawColor(renderer, 240, 80, 0, 0); // Orange
-							}else if(raquette.dispBuf[i][j] == 18){
-								SDL_SetRenderDrawColor(renderer, 160, 0, 255, 0); // Violet
-							}else if(raquette.dispBuf[i][j] == 19){
-								SDL_SetRenderDrawColor(renderer, 0, 128, 255, 0); // Blue
-							}else{
-								SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0); // Should not happen, but just in case, use black
-							}
-							bigPixel(renderer, 1+j, 1+i, (WINDOW_WIDTH/(40*7)));
-						}
-					}
+			}
+		}else if(state[SDL_SCANCODE_APOSTROPHE]){
+			if((key != ('\"')) && (key != ('\''))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = ('\"' | 0b10000000);
+				}else{
+					key  = ('\'' | 0b10000000);
 				}
-			SDL_RenderPresent(renderer);
 			}
-		}else if(event.type == SDL_QUIT){
-			quit = true;
-			break;
+		}else if(state[SDL_SCANCODE_SEMICOLON]){
+			if((key != (';')) && (key != (':'))){
+				if(state[SDL_SCANCODE_RSHIFT] || state[SDL_SCANCODE_LSHIFT]){
+					key  = (':' | 0b10000000);
+				}else{
+					key  = (';' | 0b10000000);
+				}
+			}
+
+		}else if(state[SDL_SCANCODE_BACKSPACE]){
+			if(key != (0x08)){
+				key  = (0x08 | 0b10000000);
+			}
+		}else{
+			// No keys pressed, last key read already
+			if(key < 0b10000000){
+				key = 0;
+			}
+		}
+		if(key != latched){
+			runner.keyInput(key);
+		}
+
+		// Show each frame the machine finishes, the texture keeps the last one so only what changed is uploaded
+		const RaqRunner::Frame *frame = runner.takeFrame();
+		if(frame){
+			updateScreenTexture(texture, *frame);
+			SDL_Rect screen = {PIXEL_SIZE, PIXEL_SIZE, 280*PIXEL_SIZE, 192*PIXEL_SIZE};
+			SDL_RenderClear(renderer);
+			SDL_RenderCopy(renderer, texture, NULL, &screen);
+			SDL_RenderPresent(renderer);
+		}
+	}
+	runner.stop();
+
+	if(recordFile){
+		raquette.stopRecording();
+		if(raquette.saveInput(recordFile)){
+			std::cout << "Saved " << raquette.inputLog.size() << " inputs to " << recordFile << std::endl;
 		}
-		SDL_UpdateWindowSurface(window);
 	}
 
+	SDL_DestroyTexture(texture);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 	SDL_Quit();